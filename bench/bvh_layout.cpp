@@ -0,0 +1,172 @@
+// Compares the BVH node layouts on the camera rays of a scene: wall-clock
+// time per ray, and cache misses per ray from a simulated two-level cache
+// fed with every node, item, ref and primitive record a traversal reads.
+// The simulation stands in for hardware counters, which are not available
+// everywhere; it only sees the accelerator's own memory traffic.
+//
+// usage: bench_bvh_layout <scene> [--builder=median|sah|lbvh]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "accel.h"
+#include "scene.h"
+
+using std::size_t;
+using std::uint64_t;
+
+namespace {
+
+// set-associative, LRU, 64-byte lines
+struct Cache {
+	size_t sets, ways;
+	std::vector<uint64_t> tags, stamps;
+	uint64_t clock = 0;
+	size_t misses = 0;
+
+	Cache(size_t bytes, size_t _ways) : sets(bytes / 64 / _ways), ways(_ways), tags(sets * ways, ~0ull), stamps(sets * ways, 0) {}
+
+	// true on a hit
+	bool touch(uint64_t line) {
+		size_t set = line % sets;
+		uint64_t *tag = &tags[set * ways], *stamp = &stamps[set * ways];
+
+		clock++;
+		size_t victim = 0;
+		for (size_t w = 0; w < ways; w++) {
+			if (tag[w] == line) {
+				stamp[w] = clock;
+				return true;
+			}
+
+			if (stamp[w] < stamp[victim]) {
+				victim = w;
+			}
+		}
+
+		misses++;
+		tag[victim] = line;
+		stamp[victim] = clock;
+
+		return false;
+	}
+};
+
+struct CacheLevels {
+	Cache l1 { 32 << 10, 8 }, l2 { 1 << 20, 16 };
+
+	void touch(const void *ptr, size_t bytes) {
+		uint64_t first = (uint64_t)ptr / 64, last = ((uint64_t)ptr + bytes - 1) / 64;
+		for (uint64_t line = first; line <= last; line++) {
+			if (!l1.touch(line)) {
+				l2.touch(line);
+			}
+		}
+	}
+};
+
+struct Result {
+	double ns_per_ray;
+	double l1_misses, l2_misses, nodes; // per ray
+	double hit_rate;
+};
+
+// closest hit against the root primitives of a Blas built without the wide
+// collapse, with every memory read reported to `on_read`
+template <typename OnRead>
+float trace(const Blas &blas, const Ray &ray, OnRead &&on_read) {
+	float t_best = std::numeric_limits<float>::infinity();
+	const BVH &bvh = blas.bvh.binary;
+
+	bvh.traverse(RayInv(ray.o, ray.d), t_best, [&](uint32_t item, float &t_max) {
+		on_read(&bvh.items[item], sizeof(uint32_t), false);
+		uint32_t ref = blas.refs[item];
+		on_read(&blas.refs[item], sizeof(uint32_t), false);
+
+		visit_type_index(PrimitiveTypes{}, ref >> 30, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+
+			if constexpr (is_bounded_v<T>) {
+				const T &pr = blas.primitives->get<T>()[ref & ((1u << 30) - 1)];
+				on_read(&pr, sizeof(T), false);
+
+				auto t = intersect_t(pr, ray);
+				if (t.has_value() && t.value() < t_max) {
+					t_max = t.value();
+				}
+			}
+		});
+	}, [&](const BVHNode &node) {
+		on_read(&node, sizeof(BVHNode), true);
+	});
+
+	return t_best;
+}
+
+Result measure(const Scene &scene, BvhBuilder builder, BvhLayout layout) {
+	BvhOptions options;
+	options.builder = builder;
+	options.layout = layout;
+
+	Blas blas;
+	blas.build(scene.primitives, options);
+
+	std::vector<Ray> rays;
+	for (size_t y = 0; y < scene.height; y++) {
+		for (size_t x = 0; x < scene.width; x++) {
+			rays.push_back(scene.generate_ray_to_pixel(x, y));
+		}
+	}
+
+	size_t hits = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (const Ray &ray : rays) {
+		hits += trace(blas, ray, [](const void *, size_t, bool) {}) < 1e30f;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	CacheLevels cache;
+	size_t nodes = 0;
+	for (const Ray &ray : rays) {
+		trace(blas, ray, [&](const void *ptr, size_t bytes, bool is_node) {
+			nodes += is_node;
+			cache.touch(ptr, bytes);
+		});
+	}
+
+	double n = rays.size();
+	return { seconds * 1e9 / n, cache.l1.misses / n, cache.l2.misses / n, nodes / n, hits / n };
+}
+
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::fprintf(stderr, "usage: %s <scene> [--builder=median|sah|lbvh]\n", argv[0]);
+		return 1;
+	}
+
+	BvhBuilder builder = BvhBuilder::binned_sah;
+	for (int i = 2; i < argc; i++) {
+		if (std::strcmp(argv[i], "--builder=median") == 0) {
+			builder = BvhBuilder::median;
+		} else if (std::strcmp(argv[i], "--builder=lbvh") == 0) {
+			builder = BvhBuilder::lbvh;
+		}
+	}
+
+	std::ifstream in(argv[1]);
+	Scene scene = read_scene(in);
+
+	std::printf("%-10s %10s %12s %12s %12s %8s\n", "layout", "ns/ray", "nodes/ray", "L1 miss/ray", "L2 miss/ray", "hits");
+	for (BvhLayout layout : { BvhLayout::build_order, BvhLayout::depth_first, BvhLayout::breadth_first, BvhLayout::van_emde_boas, BvhLayout::treelets }) {
+		Result r = measure(scene, builder, layout);
+		std::printf("%-10s %10.1f %12.1f %12.2f %12.2f %7.1f%%\n", to_string(layout), r.ns_per_ray, r.nodes, r.l1_misses, r.l2_misses, r.hit_rate * 100);
+	}
+
+	return 0;
+}
@@ -0,0 +1,185 @@
+// Compares the cost of the former dispatch (std::variant switch + virtual
+// intersection_t) with the static per-type loops used by Scene.
+//
+// usage: bench_dispatch [primitive count] [ray count]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <variant>
+#include <vector>
+
+#include "primitives.h"
+
+using std::size_t;
+
+namespace {
+
+///////////////////////////////////////////////////////////////////////////////
+// former layout: vtable pointer in every record, variant index switch
+
+struct VirtualPrimitive {
+	glm::vec3 position;
+	glm::quat rotation;
+	glm::vec3 color;
+
+	virtual ~VirtualPrimitive() = default;
+
+	virtual std::optional<float> intersection_t(const Ray &ray) const = 0;
+
+	std::optional<std::pair<float, glm::vec3>> intersect(const Ray &ray) const {
+		Ray transformed_ray = (ray - position).rotate(glm::conjugate(rotation));
+
+		auto t = intersection_t(transformed_ray);
+		if (!t.has_value()) {
+			return {};
+		}
+
+		return std::make_pair(t.value(), color);
+	}
+};
+
+template <typename T>
+struct Virtual : VirtualPrimitive {
+	T shape;
+
+	Virtual(const T &_shape) : shape(_shape) {
+		position = shape.position;
+		rotation = shape.rotation;
+		color = shape.color;
+	}
+
+	std::optional<float> intersection_t(const Ray &ray) const override {
+		return shape.intersection_t(ray);
+	}
+};
+
+using VirtualVariant = std::variant<Virtual<Plane>, Virtual<Ellipsoid>, Virtual<Box>>;
+
+///////////////////////////////////////////////////////////////////////////////
+// inputs
+
+struct Inputs {
+	TypedVectors<PrimitiveTypes> primitives;
+	std::vector<VirtualVariant> variants;
+	std::vector<Ray> rays;
+};
+
+Inputs make_inputs(size_t primitive_count, size_t ray_count, bool fast_paths) {
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> pos(-10.f, 10.f), size(0.1f, 1.f), unit(-1.f, 1.f), col(0.f, 1.f);
+
+	auto random_rotation = [&]() {
+		return glm::normalize(glm::quat(unit(rng), unit(rng), unit(rng), unit(rng)));
+	};
+
+	Inputs in;
+	for (size_t i = 0; i < primitive_count; i++) {
+		auto place = [&](auto pr) {
+			pr.position = glm::vec3(pos(rng), pos(rng), pos(rng));
+			pr.rotation = random_rotation();
+			pr.color = glm::vec3(col(rng), col(rng), col(rng));
+
+			// the former path always ran the general transform
+			in.variants.push_back(Virtual<decltype(pr)>(pr));
+
+			pr.classify();
+			if (!fast_paths) {
+				pr.fast_path = FastPath::none;
+			}
+			in.primitives.get<decltype(pr)>().push_back(pr);
+		};
+
+		switch (i % 3) {
+		case 0: place(Plane(glm::vec3(unit(rng), unit(rng), unit(rng)))); break;
+		case 1: place(Ellipsoid(glm::vec3(size(rng), size(rng), size(rng)))); break;
+		case 2: place(Box(glm::vec3(size(rng), size(rng), size(rng)))); break;
+		}
+	}
+
+	for (size_t i = 0; i < ray_count; i++) {
+		glm::vec3 d = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)));
+		in.rays.push_back({ glm::vec3(pos(rng), pos(rng), pos(rng)), d });
+	}
+
+	return in;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// the two dispatch loops
+
+float closest_variant(const std::vector<VirtualVariant> &prs, const Ray &ray) {
+	float best = INFINITY;
+	for (const auto &pr : prs) {
+		std::optional<std::pair<float, glm::vec3>> intersection;
+
+		switch (pr.index()) {
+		case 0: intersection = std::get<0>(pr).intersect(ray); break;
+		case 1: intersection = std::get<1>(pr).intersect(ray); break;
+		case 2: intersection = std::get<2>(pr).intersect(ray); break;
+		}
+
+		if (intersection.has_value() && intersection.value().first < best) {
+			best = intersection.value().first;
+		}
+	}
+
+	return best;
+}
+
+float closest_static(const TypedVectors<PrimitiveTypes> &prs, const Ray &ray) {
+	float best = INFINITY;
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		for (const T &pr : prs.get<T>()) {
+			auto intersection = intersect(pr, ray);
+			if (intersection.has_value() && intersection.value().first < best) {
+				best = intersection.value().first;
+			}
+		}
+	});
+
+	return best;
+}
+
+template <typename F>
+void run(const char *name, size_t tests, F &&f) {
+	auto start = std::chrono::steady_clock::now();
+	double checksum = f();
+	auto finish = std::chrono::steady_clock::now();
+
+	double ns = std::chrono::duration<double, std::nano>(finish - start).count();
+	std::printf("%-28s %8.2f ns/test  %10.3f Mtests/s  (checksum %.3f)\n",
+		name, ns / tests, tests / ns * 1e3, checksum);
+}
+
+}
+
+int main(int argc, char **argv) {
+	size_t primitive_count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 3000;
+	size_t ray_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000;
+
+	Inputs general = make_inputs(primitive_count, ray_count, false);
+	Inputs fast = make_inputs(primitive_count, ray_count, true);
+	size_t tests = primitive_count * ray_count;
+
+	std::printf("%zu primitives x %zu rays\n", primitive_count, ray_count);
+
+	auto sum = [&](auto closest, const auto &prs, const std::vector<Ray> &rays) {
+		double checksum = 0;
+		for (const Ray &ray : rays) {
+			float t = closest(prs, ray);
+			checksum += t == INFINITY ? 0 : t;
+		}
+		return checksum;
+	};
+
+	run("variant + virtual", tests, [&]() { return sum(closest_variant, general.variants, general.rays); });
+	run("static, general kernels", tests, [&]() { return sum(closest_static, general.primitives, general.rays); });
+	run("static, fast paths", tests, [&]() { return sum(closest_static, fast.primitives, fast.rays); });
+
+	return 0;
+}
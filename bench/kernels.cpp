@@ -0,0 +1,310 @@
+// Cost of the intersection kernels on their own: every kernel (general and
+// fast-path variant of each primitive type) gets ray sets that hit, miss or
+// graze its primitives, and mixes of hits and misses in random order to show
+// the hit-rate sensitivity. Each set is run through
+//   scalar    intersect() of primitives.h
+//   compiled  the codegen:: tests on records, as in generated renderers
+//   soa <isa> the batch kernels of kernels.h for every level this CPU
+//             supports
+//
+// usage: bench_kernels [pairs per set] [repetitions]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "codegen.h"
+#include "kernels.h"
+#include "primitives.h"
+
+using std::size_t;
+
+namespace {
+
+const float INF = std::numeric_limits<float>::infinity();
+
+// distance of the ray origins from the primitives they aim at
+const float RAY_DISTANCE = 20;
+
+std::mt19937 rng(42);
+
+float uniform(float lo, float hi) {
+	return std::uniform_real_distribution<float>(lo, hi)(rng);
+}
+
+glm::vec3 random_unit() {
+	glm::vec3 v;
+	do {
+		v = glm::vec3(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
+	} while (glm::dot(v, v) > 1 || glm::dot(v, v) < 1e-4f);
+
+	return glm::normalize(v);
+}
+
+glm::quat random_rotation() {
+	return glm::normalize(glm::quat(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1), uniform(-1, 1)));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// kernels under test
+
+enum class RayKind { hit, miss, grazing };
+
+// one kernel: makes primitives and aims rays at them
+template <typename T>
+struct KernelSpec {
+	const char *name;
+	std::function<T()> make;
+};
+
+// a ray from RAY_DISTANCE away through `target`
+Ray ray_through(const glm::vec3 &target) {
+	glm::vec3 origin = target + random_unit() * RAY_DISTANCE;
+	return { origin, glm::normalize(target - origin) };
+}
+
+// the silhouette along `side` is found by bisection in double, where float
+// itself is not reliable
+template <typename T>
+Ray grazing_ray(const T &pr, const glm::vec3 &origin, const glm::vec3 &side) {
+	auto hits = [&](double offset) {
+		glm::dvec3 target = glm::dvec3(pr.position) + glm::dvec3(side) * offset;
+		RayD ray { glm::dvec3(origin), glm::normalize(target - glm::dvec3(origin)) };
+		return intersect_t(pr, ray).has_value();
+	};
+
+	double lo = 0, hi = RAY_DISTANCE;
+	for (int i = 0; i < 60; i++) {
+		double mid = (lo + hi) / 2;
+		(hits(mid) ? lo : hi) = mid;
+	}
+
+	glm::vec3 target = pr.position + side * float(lo);
+	return { origin, glm::normalize(target - origin) };
+}
+
+template <typename T>
+Ray make_ray(const T &pr, RayKind kind) {
+	if constexpr (std::is_same_v<T, Plane>) {
+		// rays towards the plane hit, rays away from it miss, rays almost
+		// parallel to it graze
+		glm::vec3 tangent = glm::normalize(glm::cross(pr.normal, random_unit()));
+		glm::vec3 point = pr.position + tangent * uniform(-5, 5);
+
+		if (kind == RayKind::grazing) {
+			glm::vec3 d = glm::normalize(tangent + pr.normal * 1e-4f);
+			return { point + pr.normal * 1e-3f - d * RAY_DISTANCE, d };
+		}
+
+		glm::vec3 d = glm::normalize(pr.normal * (kind == RayKind::hit ? -1.f : 1.f) + tangent * uniform(-1, 1));
+		return { point + pr.normal * RAY_DISTANCE, d };
+	} else {
+		if (kind == RayKind::hit) {
+			return ray_through(pr.position);
+		}
+
+		glm::vec3 origin = pr.position + random_unit() * RAY_DISTANCE;
+		glm::vec3 side = glm::normalize(glm::cross(pr.position - origin, random_unit()));
+
+		if (kind == RayKind::miss) {
+			return { origin, glm::normalize(pr.position + side * 4.f - origin) };
+		}
+
+		return grazing_ray(pr, origin, side);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// compiled records, as emitted by scene_codegen
+
+codegen::GeneralPlane record(const Plane &pr) {
+	return { pr.position, pr.normal, pr.color };
+}
+
+codegen::GeneralEllipsoid record(const Ellipsoid &pr) {
+	return { pr.position, glm::conjugate(pr.rotation), pr.axes, pr.color };
+}
+
+codegen::GeneralBox record(const Box &pr) {
+	return { pr.position, glm::conjugate(pr.rotation), pr.semi_axes, pr.color };
+}
+
+// the fast paths have their own records
+template <typename T>
+void test_record(const T &pr, const Ray &ray, Hit &best) {
+	if constexpr (std::is_same_v<T, Ellipsoid>) {
+		if (pr.fast_path == FastPath::sphere) {
+			return codegen::test(ray, best, codegen::Sphere { pr.position, pr.axes.x, pr.color });
+		}
+	} else if constexpr (std::is_same_v<T, Box>) {
+		if (pr.fast_path == FastPath::aabb) {
+			return codegen::test(ray, best, codegen::Aabb { pr.position, pr.semi_axes, pr.color });
+		}
+	} else if (pr.fast_path == FastPath::axis_plane) {
+		switch (pr.axis) {
+		case 0: return codegen::test(ray, best, codegen::AxisPlane<0> { pr.position.x, pr.color });
+		case 1: return codegen::test(ray, best, codegen::AxisPlane<1> { pr.position.y, pr.color });
+		case 2: return codegen::test(ray, best, codegen::AxisPlane<2> { pr.position.z, pr.color });
+		}
+	}
+
+	codegen::test(ray, best, record(pr));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// runs
+
+template <typename T>
+struct PairSet {
+	std::string name;
+	std::vector<T> primitives;
+	std::vector<Ray> rays;
+};
+
+// fastest of `repetitions` runs
+template <typename F>
+double time_ns(size_t repetitions, F &&f) {
+	double best = INF;
+	for (size_t r = 0; r < repetitions; r++) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	return best;
+}
+
+void report(const char *kernel, const std::string &set, const char *path, size_t tests, double ns, size_t hits) {
+	std::printf("%-18s %-12s %-11s %8.2f ns/test %10.2f Mtests/s  %5.1f%% hits\n",
+		kernel, set.c_str(), path, ns / tests, tests / ns * 1e3, 100.0 * hits / tests);
+}
+
+template <typename T>
+void run_set(const char *kernel, const PairSet<T> &set, size_t repetitions) {
+	size_t n = set.rays.size(), hits = 0;
+	volatile float sink = 0;
+
+	double ns = time_ns(repetitions, [&]() {
+		hits = 0;
+		for (size_t i = 0; i < n; i++) {
+			auto intersection = intersect(set.primitives[i], set.rays[i]);
+			hits += intersection.has_value();
+			sink = sink + (intersection.has_value() ? intersection->first : 0.f);
+		}
+	});
+	report(kernel, set.name, "scalar", n, ns, hits);
+
+	ns = time_ns(repetitions, [&]() {
+		hits = 0;
+		for (size_t i = 0; i < n; i++) {
+			Hit best;
+			test_record(set.primitives[i], set.rays[i], best);
+			hits += best.t != INF;
+			sink = sink + (best.t != INF ? best.t : 0.f);
+		}
+	});
+	report(kernel, set.name, "compiled", n, ns, hits);
+
+	std::vector<KernelBatch> batches((n + KernelBatch::SIZE - 1) / KernelBatch::SIZE);
+	for (size_t i = 0; i < n; i++) {
+		KernelBatch &b = batches[i / KernelBatch::SIZE];
+		load_pair(b, b.size++, set.rays[i], set.primitives[i]);
+	}
+
+	// every primitive of a set takes the same path
+	for (const Kernels *kernels : { &kernels_scalar, &kernels_sse42, &kernels_avx2, &kernels_avx512 }) {
+		if (kernels->isa > detect_isa() || set.primitives.empty()) {
+			continue;
+		}
+
+		BatchKernel soa = batch_kernel(*kernels, set.primitives[0]);
+		ns = time_ns(repetitions, [&]() {
+			for (KernelBatch &b : batches) {
+				soa(b);
+			}
+		});
+
+		hits = 0;
+		for (const KernelBatch &b : batches) {
+			for (size_t k = 0; k < b.size; k++) {
+				hits += b.t[k] != INF;
+			}
+		}
+		report(kernel, set.name, ("soa " + std::string(to_string(kernels->isa))).c_str(), n, ns, hits);
+	}
+}
+
+template <typename T>
+void run_kernel(const KernelSpec<T> &spec, size_t pairs, size_t repetitions) {
+	auto make_set = [&](const std::string &name, auto kind_of) {
+		PairSet<T> set { name, {}, {} };
+		for (size_t i = 0; i < pairs; i++) {
+			set.primitives.push_back(spec.make());
+			set.rays.push_back(make_ray(set.primitives.back(), kind_of(i)));
+		}
+		return set;
+	};
+
+	run_set(spec.name, make_set("hit", [](size_t) { return RayKind::hit; }), repetitions);
+	run_set(spec.name, make_set("miss", [](size_t) { return RayKind::miss; }), repetitions);
+	run_set(spec.name, make_set("grazing", [](size_t) { return RayKind::grazing; }), repetitions);
+
+	// hits and misses in random order, branches cannot be predicted
+	for (int percent : { 25, 50, 75 }) {
+		run_set(spec.name, make_set("mixed " + std::to_string(percent) + "%", [&](size_t) {
+			return uniform(0, 100) < percent ? RayKind::hit : RayKind::miss;
+		}), repetitions);
+	}
+
+	std::printf("\n");
+}
+
+template <typename T>
+T placed(T pr, bool rotated) {
+	pr.position = glm::vec3(uniform(-10, 10), uniform(-10, 10), uniform(-10, 10));
+	pr.rotation = rotated ? random_rotation() : glm::quat(1.f, 0.f, 0.f, 0.f);
+	pr.color = glm::vec3(uniform(0, 1), uniform(0, 1), uniform(0, 1));
+	pr.classify();
+	return pr;
+}
+
+glm::vec3 random_size() {
+	return glm::vec3(uniform(0.1f, 1), uniform(0.1f, 1), uniform(0.1f, 1));
+}
+
+// a positive decimal count, 0 for anything else
+size_t parse_count(const char *s) {
+	char *end;
+	unsigned long long n = std::strtoull(s, &end, 10);
+	return *s >= '0' && *s <= '9' && *end == '\0' ? n : 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+	size_t pairs = argc > 1 ? parse_count(argv[1]) : 1 << 16;
+	size_t repetitions = argc > 2 ? parse_count(argv[2]) : 5;
+
+	if (argc > 3 || pairs == 0 || repetitions == 0) {
+		std::fprintf(stderr, "usage: %s [pairs per set] [repetitions], both positive\n", argv[0]);
+		return 1;
+	}
+
+	std::printf("%zu pairs per set, fastest of %zu runs, cpu supports %s\n\n", pairs, repetitions, to_string(detect_isa()));
+
+	run_kernel(KernelSpec<Plane> { "plane", [&]() { return placed(Plane(random_unit()), true); } }, pairs, repetitions);
+	run_kernel(KernelSpec<Plane> { "plane, axis", [&]() { return placed(Plane(glm::vec3(0.f, 1.f, 0.f)), false); } }, pairs, repetitions);
+	run_kernel(KernelSpec<Ellipsoid> { "ellipsoid", [&]() { return placed(Ellipsoid(random_size()), true); } }, pairs, repetitions);
+	run_kernel(KernelSpec<Ellipsoid> { "ellipsoid, sphere", [&]() {
+		return placed(Ellipsoid(glm::vec3(uniform(0.1f, 1))), false);
+	} }, pairs, repetitions);
+	run_kernel(KernelSpec<Box> { "box", [&]() { return placed(Box(random_size()), true); } }, pairs, repetitions);
+	run_kernel(KernelSpec<Box> { "box, aabb", [&]() { return placed(Box(random_size()), false); } }, pairs, repetitions);
+
+	return 0;
+}
@@ -0,0 +1,528 @@
+// End-to-end benchmark of main's default pipeline, run in-process over the
+// scenes of a corpus at several resolutions and thread counts: read_scene,
+// the BVH build, render_scene and write_image are timed separately, along
+// with primary rays per second and the peak RSS of each configuration.
+// Built with RAYTRACING_STATS, primitive tests per second of the render are
+// recorded too, and built with RAYTRACING_ALLOC_TRACKING, the allocations of
+// the last repetition's render, which are the steady state's.
+//
+// usage: bench_runner [scene files] [--corpus=bench/corpus.txt --scenes=<dir>]
+//                     [--max-count=N] [--filter=<substring>]
+//                     [--resolutions=320x240,...] [--threads=1,2,4,...]
+//                     [--repetitions=N] [--out=<results.json>]
+//                     [--baseline=<results.json>] [--noise=0.1]
+//
+// Scenes of the corpus are looked up as <dir>/<name>.txt, missing ones and
+// ones generated with more than --max-count primitives are skipped
+// (scene_gen --corpus writes them). Every phase time is the fastest
+// of the repetitions.
+//
+// Strong scaling efficiency compares a configuration with the one of the
+// fewest threads at the same resolution: t(n0) * n0 / (t(n) * n). Weak
+// scaling runs keep the pixels per thread of the first resolution, with
+// its height multiplied by the thread count, and compare render times.
+//
+// With --baseline, phases slower than the baseline's by more than the noise
+// fraction (and by more than a millisecond) are reported and the exit
+// status is 2.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "accel.h"
+#include "alloc_tracking.h"
+#include "image.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "scene.h"
+#include "stats.h"
+
+namespace {
+
+const double MIN_REGRESSION_MS = 1;
+
+const char *const PHASES[] = { "parse", "build", "render", "encode" };
+const size_t PHASE_COUNT = 4;
+
+struct SceneFile {
+	std::string name, path;
+	size_t count = 0; // primitives generated, 0 if unknown
+};
+
+struct Config {
+	size_t width, height, threads;
+	bool weak;
+};
+
+struct Run {
+	std::string scene;
+	size_t primitives = 0;
+	Config config;
+
+	double ms[PHASE_COUNT] = {}; // fastest of the repetitions
+	double spread = 0;           // (slowest - fastest) / fastest total
+	uint64_t render_tests = 0;   // zero unless counted
+	uint64_t render_allocations = 0, forbidden_allocations = 0;
+	size_t peak_rss_kb = 0;
+	bool rss_reset = false;      // false if peak_rss_kb is the process-wide peak
+
+	double strong_efficiency = 0, weak_efficiency = 0; // 0 when not applicable
+
+	double total_ms() const {
+		double total = 0;
+		for (double t : ms) {
+			total += t;
+		}
+
+		return total;
+	}
+
+	double rays_per_second() const {
+		return ms[2] > 0 ? config.width * config.height / (ms[2] * 1e-3) : 0;
+	}
+
+	double tests_per_second() const {
+		return ms[2] > 0 ? render_tests / (ms[2] * 1e-3) : 0;
+	}
+};
+
+std::vector<size_t> parse_list(const char *s) {
+	std::vector<size_t> result;
+	for (const char *p = s; *p; ) {
+		char *end;
+		result.push_back(std::strtoull(p, &end, 10));
+		p = *end == ',' ? end + 1 : end + std::strlen(end);
+	}
+
+	return result;
+}
+
+bool parse_resolutions(const char *s, std::vector<std::pair<size_t, size_t>> &result) {
+	std::istringstream in(s);
+	std::string item;
+	while (std::getline(in, item, ',')) {
+		size_t w, h;
+		if (std::sscanf(item.c_str(), "%zux%zu", &w, &h) != 2 || w == 0 || h == 0) {
+			return false;
+		}
+
+		result.push_back({ w, h });
+	}
+
+	return !result.empty();
+}
+
+// entries of a corpus in order, see bench/corpus.txt
+std::vector<SceneFile> read_corpus(const char *path, const std::string &dir) {
+	std::vector<SceneFile> entries;
+	std::ifstream in(path);
+	std::string line, name, option;
+
+	while (std::getline(in, line)) {
+		std::istringstream words(line.substr(0, line.find('#')));
+		if (!(words >> name)) {
+			continue;
+		}
+
+		SceneFile entry { name, dir + "/" + name + ".txt" };
+		while (words >> option) {
+			if (option.compare(0, 8, "--count=") == 0) {
+				entry.count = std::strtoull(option.c_str() + 8, nullptr, 10);
+			}
+		}
+
+		entries.push_back(entry);
+	}
+
+	return entries;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// peak RSS
+
+// resets the kernel's peak RSS of the process to the current RSS, false if
+// this kernel does not support it
+bool reset_peak_rss() {
+	std::ofstream clear_refs("/proc/self/clear_refs");
+	clear_refs << "5";
+	clear_refs.flush();
+
+	return bool(clear_refs);
+}
+
+size_t peak_rss_kb() {
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) {
+			return std::strtoull(line.c_str() + 6, nullptr, 10);
+		}
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// one configuration
+
+double elapsed_ms(std::chrono::steady_clock::time_point &start) {
+	auto now = std::chrono::steady_clock::now();
+	double ms = std::chrono::duration<double>(now - start).count() * 1e3;
+	start = now;
+
+	return ms;
+}
+
+// the phases of main without options, the image is encoded into memory
+bool measure(const SceneFile &file, const Config &config, size_t repetitions, Run &run) {
+	set_thread_count(config.threads);
+
+	run.scene = file.name;
+	run.config = config;
+	run.rss_reset = reset_peak_rss();
+
+	double fastest_total = 0, slowest_total = 0;
+	for (size_t rep = 0; rep < repetitions; rep++) {
+		double ms[PHASE_COUNT];
+		auto start = std::chrono::steady_clock::now();
+
+		std::ifstream in(file.path);
+		if (!in) {
+			std::fprintf(stderr, "e: cannot open %s\n", file.path.c_str());
+			return false;
+		}
+
+		Scene scene = read_scene(in);
+		scene.width = config.width;
+		scene.height = config.height;
+		ms[0] = elapsed_ms(start);
+
+		TwoLevelBVH accel(scene);
+		ms[1] = elapsed_ms(start);
+
+		StatCounters before = collect_stats();
+		AllocCounts allocs_before = collect_allocations();
+		start = std::chrono::steady_clock::now();
+
+		Image image = render_scene(scene, accel);
+		ms[2] = elapsed_ms(start);
+
+		StatCounters counted = collect_stats();
+		counted -= before;
+		run.render_tests = counted.total_tests();
+
+		AllocCounts allocs = collect_allocations();
+		allocs -= allocs_before;
+		run.render_allocations = allocs.allocations + allocs.maps;
+		run.forbidden_allocations += allocs.forbidden;
+
+		std::ostringstream out;
+		write_image(image, out);
+		ms[3] = elapsed_ms(start);
+
+		double total = 0;
+		for (size_t p = 0; p < PHASE_COUNT; p++) {
+			run.ms[p] = rep == 0 ? ms[p] : std::min(run.ms[p], ms[p]);
+			total += ms[p];
+		}
+
+		fastest_total = rep == 0 ? total : std::min(fastest_total, total);
+		slowest_total = std::max(slowest_total, total);
+		run.primitives = scene.primitives.size();
+	}
+
+	run.spread = fastest_total > 0 ? (slowest_total - fastest_total) / fastest_total : 0;
+	run.peak_rss_kb = peak_rss_kb();
+
+	return true;
+}
+
+void compute_scaling(std::vector<Run> &runs) {
+	for (Run &run : runs) {
+		const Run *reference = nullptr;
+		for (const Run &other : runs) {
+			bool comparable = other.scene == run.scene && other.config.weak == run.config.weak
+				&& (run.config.weak || (other.config.width == run.config.width && other.config.height == run.config.height));
+
+			if (comparable && (!reference || other.config.threads < reference->config.threads)) {
+				reference = &other;
+			}
+		}
+
+		double ref_threads = reference->config.threads, threads = run.config.threads;
+		if (run.config.weak) {
+			// the same pixels per thread, so the same time if scaling perfectly
+			run.weak_efficiency = reference->ms[2] / run.ms[2];
+		} else {
+			run.strong_efficiency = reference->total_ms() * ref_threads / (run.total_ms() * threads);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// results
+
+std::string key(const Run &run) {
+	return run.scene + " " + std::to_string(run.config.width) + "x" + std::to_string(run.config.height)
+		+ " " + std::to_string(run.config.threads) + (run.config.weak ? " weak" : "");
+}
+
+// one run per line, so that baselines can be read back line by line
+void write_json(std::ostream &out, const std::vector<Run> &runs, size_t repetitions) {
+	out << "{\n";
+	out << "\t\"isa\": \"" << to_string(active_kernels().isa) << "\",\n";
+	out << "\t\"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+	out << "\t\"repetitions\": " << repetitions << ",\n";
+	out << "\t\"runs\": [\n";
+
+	for (size_t i = 0; i < runs.size(); i++) {
+		const Run &r = runs[i];
+		out << "\t\t{ \"key\": \"" << key(r) << "\", \"scene\": \"" << r.scene << "\", \"primitives\": " << r.primitives
+			<< ", \"width\": " << r.config.width << ", \"height\": " << r.config.height
+			<< ", \"threads\": " << r.config.threads << ", \"weak\": " << (r.config.weak ? "true" : "false");
+
+		for (size_t p = 0; p < PHASE_COUNT; p++) {
+			out << ", \"" << PHASES[p] << "_ms\": " << r.ms[p];
+		}
+
+		out << ", \"total_ms\": " << r.total_ms() << ", \"spread\": " << r.spread
+			<< ", \"rays_per_s\": " << r.rays_per_second();
+
+		if (STATS_ENABLED) {
+			out << ", \"tests_per_s\": " << r.tests_per_second();
+		}
+
+		if (ALLOC_TRACKING_ENABLED) {
+			out << ", \"render_allocations\": " << r.render_allocations << ", \"forbidden_allocations\": " << r.forbidden_allocations;
+		}
+
+		out << ", \"peak_rss_kb\": " << r.peak_rss_kb << ", \"peak_rss_reset\": " << (r.rss_reset ? "true" : "false");
+
+		if (r.config.weak) {
+			out << ", \"weak_efficiency\": " << r.weak_efficiency;
+		} else {
+			out << ", \"strong_efficiency\": " << r.strong_efficiency;
+		}
+
+		out << " }" << (i + 1 < runs.size() ? "," : "") << "\n";
+	}
+
+	out << "\t]\n}\n";
+}
+
+// the number after "name": in a line of write_json, or -1
+double json_number(const std::string &line, const std::string &name) {
+	size_t pos = line.find("\"" + name + "\": ");
+	return pos == std::string::npos ? -1 : std::strtod(line.c_str() + pos + name.size() + 4, nullptr);
+}
+
+std::string json_string(const std::string &line, const std::string &name) {
+	size_t pos = line.find("\"" + name + "\": \"");
+	if (pos == std::string::npos) {
+		return "";
+	}
+
+	size_t begin = pos + name.size() + 5;
+	return line.substr(begin, line.find('"', begin) - begin);
+}
+
+// phase times of a results file by run key
+std::map<std::string, std::vector<double>> read_baseline(const char *path, bool &ok) {
+	std::map<std::string, std::vector<double>> result;
+	std::ifstream in(path);
+	ok = bool(in);
+
+	std::string line;
+	while (std::getline(in, line)) {
+		std::string k = json_string(line, "key");
+		if (k.empty()) {
+			continue;
+		}
+
+		std::vector<double> &ms = result[k];
+		for (size_t p = 0; p < PHASE_COUNT; p++) {
+			ms.push_back(json_number(line, std::string(PHASES[p]) + "_ms"));
+		}
+	}
+
+	return result;
+}
+
+// number of regressions
+size_t compare(const std::vector<Run> &runs, const std::map<std::string, std::vector<double>> &baseline, double noise) {
+	size_t regressions = 0, compared = 0;
+
+	for (const Run &run : runs) {
+		auto it = baseline.find(key(run));
+		if (it == baseline.end()) {
+			continue;
+		}
+
+		compared++;
+		for (size_t p = 0; p < PHASE_COUNT; p++) {
+			double base = it->second[p], now = run.ms[p];
+			if (base < 0) {
+				continue;
+			}
+
+			if (now > base * (1 + noise) && now - base > MIN_REGRESSION_MS) {
+				std::fprintf(stderr, "w: regression: %s %s %.2f ms -> %.2f ms (%+.1f%%)\n",
+					key(run).c_str(), PHASES[p], base, now, (now / base - 1) * 100);
+				regressions++;
+			} else if (now < base * (1 - noise) && base - now > MIN_REGRESSION_MS) {
+				std::fprintf(stderr, "i: improvement: %s %s %.2f ms -> %.2f ms (%+.1f%%)\n",
+					key(run).c_str(), PHASES[p], base, now, (now / base - 1) * 100);
+			}
+		}
+	}
+
+	std::fprintf(stderr, "i: %zu of %zu runs compared with the baseline, %zu regressions\n", compared, runs.size(), regressions);
+	return regressions;
+}
+
+}
+
+int main(int argc, char **argv) {
+	std::vector<SceneFile> scenes;
+	const char *corpus = nullptr, *out_path = nullptr, *baseline_path = nullptr;
+	std::string scene_dir = ".", filter;
+	size_t max_count = 0, repetitions = 3;
+	double noise = 0.1;
+	std::vector<std::pair<size_t, size_t>> resolutions;
+	std::vector<size_t> threads = { 1 };
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strncmp(argv[i], "--corpus=", 9) == 0) {
+			corpus = argv[i] + 9;
+		} else if (std::strncmp(argv[i], "--scenes=", 9) == 0) {
+			scene_dir = argv[i] + 9;
+		} else if (std::strncmp(argv[i], "--max-count=", 12) == 0) {
+			max_count = std::strtoull(argv[i] + 12, nullptr, 10);
+		} else if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+			filter = argv[i] + 9;
+		} else if (std::strncmp(argv[i], "--resolutions=", 14) == 0) {
+			if (!parse_resolutions(argv[i] + 14, resolutions)) {
+				std::fprintf(stderr, "e: bad resolutions %s\n", argv[i] + 14);
+				return 1;
+			}
+		} else if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+			threads = parse_list(argv[i] + 10);
+		} else if (std::strncmp(argv[i], "--repetitions=", 14) == 0) {
+			repetitions = std::max<size_t>(1, std::strtoull(argv[i] + 14, nullptr, 10));
+		} else if (std::strncmp(argv[i], "--out=", 6) == 0) {
+			out_path = argv[i] + 6;
+		} else if (std::strncmp(argv[i], "--baseline=", 11) == 0) {
+			baseline_path = argv[i] + 11;
+		} else if (std::strncmp(argv[i], "--noise=", 8) == 0) {
+			noise = std::strtod(argv[i] + 8, nullptr);
+		} else {
+			std::string path = argv[i], name = path.substr(path.find_last_of('/') + 1);
+			scenes.push_back({ name.substr(0, name.rfind('.')), path });
+		}
+	}
+
+	if (corpus) {
+		for (const SceneFile &entry : read_corpus(corpus, scene_dir)) {
+			if (max_count > 0 && entry.count > max_count) {
+				std::fprintf(stderr, "i: %s: %zu primitives, skipped\n", entry.name.c_str(), entry.count);
+			} else if (!std::ifstream(entry.path)) {
+				std::fprintf(stderr, "i: %s: not generated, skipped\n", entry.name.c_str());
+			} else {
+				scenes.push_back(entry);
+			}
+		}
+	}
+
+	if (!filter.empty()) {
+		scenes.erase(std::remove_if(scenes.begin(), scenes.end(), [&](const SceneFile &s) {
+			return s.name.find(filter) == std::string::npos;
+		}), scenes.end());
+	}
+
+	std::sort(threads.begin(), threads.end());
+	threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+	if (resolutions.empty()) {
+		resolutions.push_back({ 320, 240 });
+	}
+
+	if (scenes.empty() || threads.empty() || threads[0] == 0) {
+		std::fprintf(stderr, "usage: %s [scene files] [--corpus=<file> --scenes=<dir>] [options], see the source\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<Config> configs;
+	for (auto [w, h] : resolutions) {
+		for (size_t t : threads) {
+			configs.push_back({ w, h, t, false });
+		}
+	}
+
+	if (threads.size() > 1) {
+		for (size_t t : threads) {
+			configs.push_back({ resolutions[0].first, resolutions[0].second * t, t, true });
+		}
+	}
+
+	std::vector<Run> runs;
+	for (const SceneFile &file : scenes) {
+		for (const Config &config : configs) {
+			Run run;
+			if (!measure(file, config, repetitions, run)) {
+				return 1;
+			}
+
+			std::fprintf(stderr, "i: %-36s %9.2f parse %9.2f build %9.2f render %7.2f encode ms, %6.2f Mrays/s, %8.2f Mtests/s, %7zu MB peak\n",
+				key(run).c_str(), run.ms[0], run.ms[1], run.ms[2], run.ms[3], run.rays_per_second() * 1e-6,
+				run.tests_per_second() * 1e-6, run.peak_rss_kb >> 10);
+
+			if (run.forbidden_allocations > 0) {
+				std::fprintf(stderr, "w: %s allocated %llu times while rendering pixels\n",
+					key(run).c_str(), (unsigned long long)run.forbidden_allocations);
+			}
+
+			runs.push_back(run);
+		}
+	}
+
+	compute_scaling(runs);
+
+	if (out_path) {
+		std::ofstream out(out_path);
+		write_json(out, runs, repetitions);
+		if (!out) {
+			std::fprintf(stderr, "e: cannot write %s\n", out_path);
+			return 1;
+		}
+	} else {
+		write_json(std::cout, runs, repetitions);
+	}
+
+	if (baseline_path) {
+		bool ok;
+		auto baseline = read_baseline(baseline_path, ok);
+		if (!ok) {
+			std::fprintf(stderr, "e: cannot read %s\n", baseline_path);
+			return 1;
+		}
+
+		if (compare(runs, baseline, noise) > 0) {
+			return 2;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+struct AABB {
+	glm::vec3 lo = glm::vec3(std::numeric_limits<float>::infinity());
+	glm::vec3 hi = glm::vec3(-std::numeric_limits<float>::infinity());
+
+	AABB() = default;
+
+	AABB(glm::vec3 _lo, glm::vec3 _hi) : lo(_lo), hi(_hi) {}
+
+	bool empty() const {
+		return lo.x > hi.x || lo.y > hi.y || lo.z > hi.z;
+	}
+
+	void extend(glm::vec3 p) {
+		lo = glm::min(lo, p);
+		hi = glm::max(hi, p);
+	}
+
+	void extend(const AABB &other) {
+		lo = glm::min(lo, other.lo);
+		hi = glm::max(hi, other.hi);
+	}
+
+	glm::vec3 center() const {
+		return (lo + hi) * 0.5f;
+	}
+
+	float surface_area() const {
+		if (empty()) {
+			return 0;
+		}
+
+		glm::vec3 e = hi - lo;
+		return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	// bounds of this box after rotating it about the origin and translating it
+	AABB transformed(const glm::quat &rotation, glm::vec3 translation) const {
+		glm::mat3 r = glm::mat3_cast(rotation);
+		glm::vec3 c = r * center() + translation;
+		glm::vec3 e = glm::abs(r[0]) * (hi.x - lo.x) * 0.5f
+			+ glm::abs(r[1]) * (hi.y - lo.y) * 0.5f
+			+ glm::abs(r[2]) * (hi.z - lo.z) * 0.5f;
+
+		return { c - e, c + e };
+	}
+};
+
+// ray with precomputed reciprocal direction for slab tests
+struct RayInv {
+	glm::vec3 o, inv_d;
+
+	RayInv() = default;
+
+	RayInv(glm::vec3 _o, glm::vec3 d) : o(_o) {
+		// keep the reciprocal finite so that 0 * inv_d never produces NaN
+		for (int i = 0; i < 3; i++) {
+			if (std::abs(d[i]) < 1e-30f) {
+				d[i] = std::copysign(1e-30f, d[i]);
+			}
+		}
+
+		inv_d = 1.f / d;
+	}
+};
+
+// distance to the box along the ray clamped to [0, t_max], or infinity on miss
+inline float slab_entry(const AABB &box, const RayInv &ray, float t_max) {
+	glm::vec3 t1 = (box.lo - ray.o) * ray.inv_d;
+	glm::vec3 t2 = (box.hi - ray.o) * ray.inv_d;
+
+	glm::vec3 t_near = glm::min(t1, t2);
+	glm::vec3 t_far = glm::max(t1, t2);
+
+	float enter = std::max({ t_near.x, t_near.y, t_near.z, 0.f });
+	float exit = std::min({ t_far.x, t_far.y, t_far.z, t_max });
+
+	return enter <= exit ? enter : std::numeric_limits<float>::infinity();
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh8.h"
+#include "grid.h"
+#include "lazy_bvh.h"
+#include "packet.h"
+#include "primitives.h"
+#include "scene.h"
+
+using std::size_t;
+using std::uint32_t;
+
+struct Hit {
+	float t = std::numeric_limits<float>::infinity();
+	glm::vec3 color;
+};
+
+// closest-hit queries against a whole scene, root primitives and instances
+struct Accelerator {
+	virtual ~Accelerator() = default;
+
+	virtual std::optional<Hit> closest_hit(const Ray &ray) const = 0;
+};
+
+struct BvhOptions {
+	BvhBuilder builder = BvhBuilder::binned_sah;
+	bool wide = false; // collapse into 8-ary quantized nodes for traversal
+	BvhLayout layout = BvhLayout::treelets;
+	bool lazy = false; // split nodes when rays first reach them, ignores wide and layout
+	bool grid = false; // uniform grids instead of BVHs, ignores all of the above
+};
+
+enum class HierarchyKind { binary, wide, lazy, grid };
+
+// a binary BVH, the wide BVH collapsed from it, a lazily built one or a
+// uniform grid; all traverse with the contract of BVH::traverse
+struct Hierarchy {
+	HierarchyKind kind = HierarchyKind::binary;
+	BVH binary;
+	BVH8 wide;
+	LazyBVH lazy;
+	UniformGrid grid;
+	float sah = 0; // of the binary BVH, which is dropped once collapsed
+
+	void build(const std::vector<AABB> &bounds, const BvhOptions &options);
+
+	bool empty() const;
+
+	AABB bounds() const;
+
+	size_t node_count() const; // grid cells for grids
+
+	size_t node_bytes() const;
+
+	// items of the leaves in traversal order, or null for grids, which list
+	// items once per overlapped cell
+	std::vector<uint32_t> *leaf_items();
+
+	template <typename TestItem>
+	void traverse(const RayInv &ray, float &t_max, TestItem &&test_item) const {
+		switch (kind) {
+		case HierarchyKind::binary: binary.traverse(ray, t_max, test_item); break;
+		case HierarchyKind::wide:   wide.traverse(ray, t_max, test_item); break;
+		case HierarchyKind::lazy:   lazy.traverse(ray, t_max, test_item); break;
+		case HierarchyKind::grid:   grid.traverse(ray, t_max, test_item); break;
+		}
+	}
+};
+
+// bottom level: a BVH over one primitive set in its own space; planes are
+// unbounded and are tested for every ray that reaches the set
+struct Blas {
+	const TypedVectors<PrimitiveTypes> *primitives = nullptr;
+	Hierarchy bvh;
+	std::vector<uint32_t> refs; // per BVH item: type index << 30 | primitive index
+
+	// copy of the primitives in leaf order, so that a leaf reads consecutive
+	// records; used unless the layout is build_order
+	TypedVectors<PrimitiveTypes> packed;
+
+	Blas() = default;
+
+	// primitives may point into packed, a copy or move would share it
+	Blas(const Blas &) = delete;
+
+	Blas &operator = (const Blas &) = delete;
+
+	void build(const TypedVectors<PrimitiveTypes> &_primitives, const BvhOptions &options);
+
+	bool has_unbounded() const;
+
+	AABB bounds() const;
+
+	// moves the primitives into `packed`, which primitives then points to
+	void pack();
+
+	// replaces best with closer hits
+	void intersect(const Ray &ray, Hit &best) const;
+
+	// the part of intersect that tests the planes
+	void intersect_unbounded(const Ray &ray, Hit &best) const;
+
+	// closer hits of a bounded primitive for one ray of a packet
+	void intersect_item(uint32_t item, RayPacket &packet, size_t i) const;
+};
+
+struct BvhBuildStats {
+	BvhOptions options;
+	double seconds = 0;
+	size_t nodes = 0, node_bytes = 0;
+	float root_sah_cost = 0, top_sah_cost = 0;
+};
+
+// top level: a BVH over instances, each one with its transform over a shared
+// Blas; arrays are traversed through an implicit hierarchy over their copy
+// index ranges instead of being expanded
+struct TwoLevelBVH : Accelerator {
+	const Scene &scene;
+
+	Blas root;
+	std::vector<Blas> prototypes;       // constructed in place, one per prototype
+
+	Hierarchy top;                      // over bounded instances
+	std::vector<uint32_t> top_instances; // top BVH item -> instance index
+	std::vector<uint32_t> unbounded;    // instances of prototypes with planes
+
+	BvhBuildStats build_stats;
+
+	explicit TwoLevelBVH(const Scene &_scene, const BvhOptions &options = {});
+
+	// of all hierarchies; grows during rendering when they are lazy
+	size_t node_count() const;
+
+	size_t node_bytes() const;
+
+	std::optional<Hit> closest_hit(const Ray &ray) const override;
+
+	// replaces best with closer hits; nodes behind a best that is already
+	// known, such as an occluder hit, are culled
+	void intersect(const Ray &ray, Hit &best) const;
+
+	// the part of intersect that is not about root primitives
+	void intersect_instances(const Ray &ray, Hit &best) const;
+
+	// fills in t and color of every ray of the packet; packets only cull
+	// binary BVHs, other hierarchies are traversed ray by ray
+	void closest_hits(RayPacket &packet) const;
+
+	void intersect_instance(const Instance &inst, const Ray &ray, Hit &best) const;
+};
+
+// bounds of all copies of an instance, in the instance's space
+AABB instance_local_bounds(const Instance &inst, const AABB &prototype_bounds);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+using std::size_t;
+using std::uint64_t;
+
+// Heap and mmap accounting. With the RAYTRACING_ALLOC_TRACKING build option
+// the global operator new and delete and mmap are replaced by counting
+// versions; without it nothing is replaced, the counts stay zero and the
+// scopes below are empty.
+#ifdef RAYTRACING_ALLOC_TRACKING
+constexpr bool ALLOC_TRACKING_ENABLED = true;
+#else
+constexpr bool ALLOC_TRACKING_ENABLED = false;
+#endif
+
+struct AllocCounts {
+	uint64_t allocations = 0, bytes = 0, frees = 0;
+	uint64_t maps = 0, mapped_bytes = 0;
+
+	// allocations and maps made inside a NoAllocScope
+	uint64_t forbidden = 0;
+
+	AllocCounts &operator += (const AllocCounts &other);
+
+	AllocCounts &operator -= (const AllocCounts &other);
+};
+
+// counts of every thread so far
+AllocCounts collect_allocations();
+
+// size of the first forbidden allocation, 0 if there was none
+size_t first_forbidden_allocation();
+
+namespace alloc_tracking {
+
+// depth of NoAllocScopes on the calling thread, 0 in AllowAllocScopes
+extern thread_local int no_alloc_depth;
+
+}
+
+// marks work that must not allocate, the renderers' per-pixel loops
+struct NoAllocScope {
+	NoAllocScope() {
+		if constexpr (ALLOC_TRACKING_ENABLED) {
+			alloc_tracking::no_alloc_depth++;
+		}
+	}
+
+	~NoAllocScope() {
+		if constexpr (ALLOC_TRACKING_ENABLED) {
+			alloc_tracking::no_alloc_depth--;
+		}
+	}
+
+	NoAllocScope(const NoAllocScope&) = delete;
+	NoAllocScope &operator = (const NoAllocScope&) = delete;
+};
+
+// lifts an enclosing NoAllocScope for caches that are meant to grow while
+// rendering, such as lazy BVH expansion and out-of-core page-ins
+struct AllowAllocScope {
+	int saved = 0;
+
+	AllowAllocScope() {
+		if constexpr (ALLOC_TRACKING_ENABLED) {
+			saved = alloc_tracking::no_alloc_depth;
+			alloc_tracking::no_alloc_depth = 0;
+		}
+	}
+
+	~AllowAllocScope() {
+		if constexpr (ALLOC_TRACKING_ENABLED) {
+			alloc_tracking::no_alloc_depth = saved;
+		}
+	}
+
+	AllowAllocScope(const AllowAllocScope&) = delete;
+	AllowAllocScope &operator = (const AllowAllocScope&) = delete;
+};
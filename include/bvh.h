@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "aabb.h"
+#include "huge_pages.h"
+#include "stats.h"
+
+using std::size_t;
+using std::uint32_t;
+
+struct BVHNode {
+	AABB bounds;
+	uint32_t left_first; // left child (right one follows it) or first item of a leaf
+	uint32_t count;      // number of items in a leaf, 0 for inner nodes
+
+	bool is_leaf() const {
+		return count > 0;
+	}
+};
+
+enum class BvhBuilder {
+	median,     // object median split, serial
+	binned_sah, // task-parallel binned surface area heuristic
+	lbvh        // Morton codes sorted with a parallel radix sort
+};
+
+const char *to_string(BvhBuilder builder);
+
+// node orders produced by BVH::reorder; every order but build_order keeps
+// sibling pairs on one 64-byte cache line
+enum class BvhLayout {
+	build_order,   // as the builder handed out the nodes
+	depth_first,
+	breadth_first,
+	van_emde_boas, // recursive top half / bottom halves split of the tree
+	treelets       // page-sized treelets grown by largest surface area
+};
+
+const char *to_string(BvhLayout layout);
+
+// inverse of to_string
+std::optional<BvhLayout> parse_bvh_layout(const char *name);
+
+struct NoNodeHook {
+	void operator () (const BVHNode &) const {}
+};
+
+// binary BVH over opaque items; item ids are indices into the bounds array
+// passed to build, leaves refer to ranges of `items`
+struct BVH {
+	static const uint32_t MAX_LEAF_SIZE = 4;
+	static const uint32_t MAX_SAH_LEAF_SIZE = 16; // when splitting costs more
+	static const uint32_t MAX_DEPTH = 60;         // traversal stack is 64 deep
+
+	std::vector<BVHNode, HugePageAllocator<BVHNode>> nodes;
+	std::vector<uint32_t> items;
+
+	void build(const std::vector<AABB> &bounds, BvhBuilder builder = BvhBuilder::binned_sah);
+
+	// permutes nodes into the given layout and items into leaf order
+	void reorder(BvhLayout layout);
+
+	// expected cost of a ray through the root, in units of one node test
+	float sah_cost() const;
+
+	bool empty() const {
+		return nodes.empty();
+	}
+
+	AABB bounds() const {
+		return empty() ? AABB() : nodes[0].bounds;
+	}
+
+	// calls test_item(item, t_max) for items whose leaves the ray reaches
+	// before t_max, nearest child first; test_item may lower t_max;
+	// on_node sees every node whose bounds are read
+	template <typename TestItem, typename OnNode = NoNodeHook>
+	void traverse(const RayInv &ray, float &t_max, TestItem &&test_item, OnNode &&on_node = {}) const;
+};
+
+// BVH::traverse over bare arrays, for nodes that do not live in a BVH
+template <typename TestItem, typename OnNode = NoNodeHook>
+void traverse_bvh(
+	const BVHNode *nodes, const uint32_t *items, const RayInv &ray, float &t_max,
+	TestItem &&test_item, OnNode &&on_node = {}
+) {
+	const float INF = std::numeric_limits<float>::infinity();
+
+	on_node(nodes[0]);
+	if (slab_entry(nodes[0].bounds, ray, t_max) == INF) {
+		return;
+	}
+
+	struct Entry {
+		uint32_t node;
+		float t;
+	};
+
+	Entry stack[64];
+	size_t top = 0;
+	uint32_t cur = 0;
+
+	while (true) {
+		const BVHNode &node = nodes[cur];
+		count_node_visit();
+
+		if (node.is_leaf()) {
+			for (uint32_t i = node.left_first; i < node.left_first + node.count; i++) {
+				test_item(items[i], t_max);
+			}
+		} else {
+			uint32_t near = node.left_first, far = node.left_first + 1;
+			on_node(nodes[near]);
+			on_node(nodes[far]);
+
+			float t_near = slab_entry(nodes[near].bounds, ray, t_max);
+			float t_far = slab_entry(nodes[far].bounds, ray, t_max);
+
+			if (t_far < t_near) {
+				std::swap(near, far);
+				std::swap(t_near, t_far);
+			}
+
+			if (t_near != INF) {
+				if (t_far != INF) {
+					stack[top++] = { far, t_far };
+				}
+
+				cur = near;
+				continue;
+			}
+		}
+
+		// pop, skipping subtrees that are now behind the closest hit
+		bool found = false;
+		while (top > 0) {
+			Entry e = stack[--top];
+			if (e.t <= t_max) {
+				cur = e.node;
+				found = true;
+				break;
+			}
+		}
+
+		if (!found) {
+			return;
+		}
+	}
+}
+
+template <typename TestItem, typename OnNode>
+void BVH::traverse(const RayInv &ray, float &t_max, TestItem &&test_item, OnNode &&on_node) const {
+	if (!empty()) {
+		traverse_bvh(nodes.data(), items.data(), ray, t_max, test_item, on_node);
+	}
+}
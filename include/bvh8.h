@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "stats.h"
+
+using std::size_t;
+using std::int8_t;
+using std::uint8_t;
+using std::uint32_t;
+
+// Eight children per node, child bounds quantized to 8 bits per plane on a
+// power-of-two grid anchored at the node's lower corner, stored per plane
+// (SoA) so that one AVX2 slab test covers all children.
+struct BVH8Node {
+	glm::vec3 origin;
+	int8_t exponent[3];  // grid step along each axis is 2^exponent
+	uint8_t child_count;
+	uint8_t inner_mask;  // bit i: child i is a node, otherwise a leaf
+
+	uint32_t child_base; // inner children are consecutive nodes from here
+	uint32_t item_base;  // leaf children's items are consecutive from here
+
+	uint8_t child_offset[8]; // from child_base or from item_base
+	uint8_t leaf_count[8];
+
+	uint8_t lo_x[8], lo_y[8], lo_z[8];
+	uint8_t hi_x[8], hi_y[8], hi_z[8];
+};
+
+// bit i of the result is set when the ray enters child i before t_max,
+// t_enter[i] is the entry distance of such children
+using BVH8ChildTest = uint32_t (*)(const BVH8Node &node, const RayInv &ray, float t_max, float *t_enter);
+
+uint32_t bvh8_intersect_children_scalar(const BVH8Node &node, const RayInv &ray, float t_max, float *t_enter);
+
+// only safe to call when the CPU supports AVX2
+uint32_t bvh8_intersect_children_avx2(const BVH8Node &node, const RayInv &ray, float t_max, float *t_enter);
+
+struct BVH8 {
+	// keeps the item offsets of a node's leaves within 8 bits, 7 * 32 < 256;
+	// larger binary leaves are split over chained nodes
+	static const uint32_t MAX_LEAF_SIZE = 32;
+
+	// levels of chained nodes below a binary leaf, each one splits its items
+	// 8 ways until at most 8 * MAX_LEAF_SIZE are left: 2^32 / 2^8 = 8^8
+	static const uint32_t MAX_CHAIN_DEPTH = 8;
+
+	std::vector<BVH8Node, HugePageAllocator<BVH8Node>> nodes;
+	std::vector<uint32_t> items;
+	AABB root_bounds;
+	BVH8ChildTest intersect_children = bvh8_intersect_children_scalar;
+
+	// collapses a binary BVH, takes the child test of the active kernels
+	void build(const BVH &bvh);
+
+	bool empty() const {
+		return nodes.empty();
+	}
+
+	AABB bounds() const {
+		return root_bounds;
+	}
+
+	// same contract as BVH::traverse
+	template <typename TestItem>
+	void traverse(const RayInv &ray, float &t_max, TestItem &&test_item) const;
+};
+
+template <typename TestItem>
+void BVH8::traverse(const RayInv &ray, float &t_max, TestItem &&test_item) const {
+	const float INF = std::numeric_limits<float>::infinity();
+
+	if (empty() || slab_entry(root_bounds, ray, t_max) == INF) {
+		return;
+	}
+
+	// count == 0 marks an inner node
+	struct Entry {
+		uint32_t index, count;
+		float t;
+	};
+
+	// every level leaves at most 7 siblings behind, binary levels fold into
+	// fewer wide ones and the chained nodes come on top
+	const size_t STACK_SIZE = 8 * (BVH::MAX_DEPTH + MAX_CHAIN_DEPTH);
+	Entry stack[STACK_SIZE];
+	size_t top = 0;
+	stack[top++] = { 0, 0, 0.f };
+
+	while (top > 0) {
+		Entry e = stack[--top];
+		if (e.t > t_max) {
+			continue;
+		}
+
+		if (e.count > 0) {
+			for (uint32_t i = e.index; i < e.index + e.count; i++) {
+				test_item(items[i], t_max);
+			}
+			continue;
+		}
+
+		const BVH8Node &node = nodes[e.index];
+		count_node_visit();
+
+		float t_enter[8];
+		uint32_t mask = intersect_children(node, ray, t_max, t_enter);
+
+		// push farthest first so that the nearest child is popped next
+		Entry hits[8];
+		size_t hit_count = 0;
+		for (; mask != 0; mask &= mask - 1) {
+			int c = __builtin_ctz(mask);
+
+			Entry h;
+			if (node.inner_mask >> c & 1) {
+				h = { node.child_base + node.child_offset[c], 0, t_enter[c] };
+			} else {
+				h = { node.item_base + node.child_offset[c], node.leaf_count[c], t_enter[c] };
+			}
+
+			size_t j = hit_count++;
+			for (; j > 0 && hits[j - 1].t < h.t; j--) {
+				hits[j] = hits[j - 1];
+			}
+			hits[j] = h;
+		}
+
+		assert(top + hit_count <= STACK_SIZE);
+		for (size_t i = 0; i < hit_count; i++) {
+			stack[top++] = hits[i];
+		}
+	}
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "accel.h"
+#include "primitives.h"
+
+// Support for renderers generated by scene_codegen. The generator turns every
+// root primitive of a scene into a constexpr description below and emits one
+// call per primitive to the matching test, so that the compiler can fold the
+// constants into the unrolled visibility test. The tests repeat the float
+// steps of primitives.cpp one by one, a generated renderer draws the same
+// image as the generic one.
+namespace codegen {
+
+struct Sphere {
+	glm::vec3 position;
+	float radius;
+	glm::vec3 color;
+};
+
+struct Aabb {
+	glm::vec3 position, semi_axes, color;
+};
+
+// the plane's position along its axis
+template <int Axis>
+struct AxisPlane {
+	float offset;
+	glm::vec3 color;
+};
+
+struct GeneralPlane {
+	glm::vec3 position, normal, color;
+};
+
+// rotations are stored conjugated, ready to take rays to local space
+struct GeneralEllipsoid {
+	glm::vec3 position;
+	glm::quat conj_rotation;
+	glm::vec3 axes, color;
+};
+
+struct GeneralBox {
+	glm::vec3 position;
+	glm::quat conj_rotation;
+	glm::vec3 semi_axes, color;
+};
+
+constexpr float INF = std::numeric_limits<float>::infinity();
+constexpr float PARALLEL_EPS = std::numeric_limits<float>::epsilon();
+
+inline void closer(Hit &best, float t, const glm::vec3 &color) {
+	if (t < best.t) {
+		best.t = t;
+		best.color = color;
+	}
+}
+
+inline float least_positive_from_two(float a, float b) {
+	if (a - b > 0) {
+		std::swap(a, b);
+	}
+
+	return a > 0 ? a : (b > 0 ? b : INF);
+}
+
+inline float least_positive_root(float a, float b, float c) {
+	float d = b * b - 4 * a * c;
+	if (d < 0) {
+		return INF;
+	}
+
+	float sd = std::sqrt(d);
+	return least_positive_from_two((-b + sd) / a / 2, (-b - sd) / a / 2);
+}
+
+// slab test of a box centered at the local origin
+inline float slabs(const Ray &ray, const glm::vec3 &semi_axes) {
+	glm::vec3 ts1 = (semi_axes - ray.o) / ray.d;
+	glm::vec3 ts2 = (-semi_axes - ray.o) / ray.d;
+
+	float t1 = std::max({ std::min(ts1.x, ts2.x), std::min(ts1.y, ts2.y), std::min(ts1.z, ts2.z) });
+	float t2 = std::min({ std::max(ts1.x, ts2.x), std::max(ts1.y, ts2.y), std::max(ts1.z, ts2.z) });
+
+	return t1 > t2 ? INF : least_positive_from_two(t1, t2);
+}
+
+inline void test(const Ray &ray, Hit &best, const Sphere &pr) {
+	glm::vec3 o = ray.o - pr.position;
+
+	float a = glm::dot(ray.d, ray.d);
+	float b = 2 * glm::dot(o, ray.d);
+	float c = glm::dot(o, o) - pr.radius * pr.radius;
+
+	closer(best, least_positive_root(a, b, c), pr.color);
+}
+
+inline void test(const Ray &ray, Hit &best, const Aabb &pr) {
+	closer(best, slabs(ray - pr.position, pr.semi_axes), pr.color);
+}
+
+template <int Axis>
+inline void test(const Ray &ray, Hit &best, const AxisPlane<Axis> &pr) {
+	float d_axis = ray.d[Axis];
+	if (std::abs(d_axis) < PARALLEL_EPS) {
+		return;
+	}
+
+	float t = (pr.offset - ray.o[Axis]) / d_axis;
+	if (t > 0) {
+		closer(best, t, pr.color);
+	}
+}
+
+inline void test(const Ray &ray, Hit &best, const GeneralPlane &pr) {
+	float d_normal = glm::dot(ray.d, pr.normal);
+	if (std::abs(d_normal) < PARALLEL_EPS) {
+		return;
+	}
+
+	float t = -glm::dot(ray.o - pr.position, pr.normal) / d_normal;
+	if (t > 0) {
+		closer(best, t, pr.color);
+	}
+}
+
+inline void test(const Ray &ray, Hit &best, const GeneralEllipsoid &pr) {
+	Ray local = (ray - pr.position).rotate(pr.conj_rotation);
+
+	float a = glm::dot(local.d / pr.axes, local.d / pr.axes);
+	float b = 2 * glm::dot(local.o / pr.axes, local.d / pr.axes);
+	float c = glm::dot(local.o / pr.axes, local.o / pr.axes) - 1;
+
+	closer(best, least_positive_root(a, b, c), pr.color);
+}
+
+inline void test(const Ray &ray, Hit &best, const GeneralBox &pr) {
+	closer(best, slabs((ray - pr.position).rotate(pr.conj_rotation), pr.semi_axes), pr.color);
+}
+
+}
+
+// defined by the generated source: the closest root primitive hit, and the
+// scene file the primitives were taken from
+void generated_closest_hit(const Ray &ray, Hit &best);
+
+extern const char *const GENERATED_FROM;
+extern const size_t GENERATED_PRIMITIVES;
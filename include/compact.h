@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "dispatch.h"
+#include "primitives.h"
+#include "scene.h"
+
+using std::size_t;
+using std::uint16_t;
+using std::uint32_t;
+
+// Compact primitive storage for scenes with many millions of primitives.
+//
+// Each primitive is split into a 16-byte placement record (float position and
+// a smallest-three quantized rotation) and a shape record (type parameters and
+// an index into a palette of deduplicated colors). Types are implicit, every
+// type has its own arrays. That is 32 bytes per primitive with float
+// parameters and 24 bytes with half-precision ones.
+//
+// Tolerances: positions and colors are exact, identity rotations are exact,
+// other rotations are off by at most ~0.1 degree, half-precision parameters
+// have a relative error of at most 2^-11.
+
+enum class CompactPrecision { full, half };
+
+// 2 bits for the index of the largest component, 10 bits for each other one
+uint32_t encode_rotation(const glm::quat &rotation);
+
+glm::quat decode_rotation(uint32_t code);
+
+const uint32_t IDENTITY_ROTATION_CODE = (3u << 30) | (511u << 20) | (511u << 10) | 511u;
+
+struct alignas(16) CompactPlacement {
+	glm::vec3 position;
+	uint32_t rotation;
+};
+
+struct alignas(16) CompactShape {
+	glm::vec3 params;
+	uint32_t color;
+};
+
+struct alignas(8) CompactHalfShape {
+	uint16_t params[3];
+	uint16_t color;
+};
+
+// T only tags the list, the records themselves are type-agnostic
+template <typename T, typename Shape>
+struct CompactList {
+	std::vector<CompactPlacement> placements;
+	std::vector<Shape> shapes;
+
+	size_t size() const {
+		return placements.size();
+	}
+
+	bool empty() const {
+		return placements.empty();
+	}
+};
+
+struct ColorKeyHash {
+	size_t operator () (const std::array<uint32_t, 3> &key) const;
+};
+
+template <typename Shape>
+struct CompactStore {
+	template <typename T>
+	using ListOf = CompactList<T, Shape>;
+
+	PerType<ListOf, PrimitiveTypes> lists;
+	std::vector<glm::vec3> palette;
+
+	// bit pattern of a color -> its palette index, only used while adding
+	std::unordered_map<std::array<uint32_t, 3>, uint32_t, ColorKeyHash> palette_index;
+
+	// fails when the palette outgrows the shape's color index
+	bool add(const AnyPrimitive &primitive);
+
+	size_t size() const;
+
+	size_t bytes() const;
+
+	std::optional<std::pair<float, uint32_t>> closest_hit(const Ray &ray) const;
+
+	glm::vec3 get_pixel_color(const Scene &scene, size_t x, size_t y) const;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+using std::size_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// compile-time type lists used for static dispatch over primitive types
+
+template <typename... Ts>
+struct TypeList {
+	static constexpr size_t size = sizeof...(Ts);
+};
+
+template <typename T>
+struct TypeTag {
+	using type = T;
+};
+
+template <typename T, typename List>
+struct type_index;
+
+template <typename T, typename... Ts>
+struct type_index<T, TypeList<T, Ts...>> : std::integral_constant<size_t, 0> {};
+
+template <typename T, typename U, typename... Ts>
+struct type_index<T, TypeList<U, Ts...>>
+	: std::integral_constant<size_t, 1 + type_index<T, TypeList<Ts...>>::value> {};
+
+template <typename T, typename List>
+constexpr size_t type_index_v = type_index<T, List>::value;
+
+// calls f(TypeTag<T>{}) for every T in the list, in order
+template <typename... Ts, typename F>
+void for_each_type(TypeList<Ts...>, F &&f) {
+	(f(TypeTag<Ts>{}), ...);
+}
+
+// calls f(TypeTag<T>{}) for the T at the given runtime index of the list
+template <typename... Ts, typename F>
+void visit_type_index(TypeList<Ts...>, size_t index, F &&f) {
+	((index == type_index_v<Ts, TypeList<Ts...>> ? f(TypeTag<Ts>{}) : void()), ...);
+}
+
+// bit i of a type mask stands for the i-th type of the list
+template <typename T, typename List>
+constexpr unsigned type_bit = 1u << type_index_v<T, List>;
+
+template <typename List>
+constexpr unsigned full_type_mask = (1u << List::size) - 1;
+
+template <typename List>
+struct variant_of;
+
+template <typename... Ts>
+struct variant_of<TypeList<Ts...>> {
+	using type = std::variant<Ts...>;
+};
+
+template <typename List>
+using variant_of_t = typename variant_of<List>::type;
+
+///////////////////////////////////////////////////////////////////////////////
+// one container per type, so that every loop over it is monomorphic
+
+template <template <typename> class Holder, typename List>
+struct PerType;
+
+template <template <typename> class Holder, typename... Ts>
+struct PerType<Holder, TypeList<Ts...>> {
+	using types = TypeList<Ts...>;
+
+	std::tuple<Holder<Ts>...> items;
+
+	template <typename T>
+	Holder<T> &get() {
+		return std::get<Holder<T>>(items);
+	}
+
+	template <typename T>
+	const Holder<T> &get() const {
+		return std::get<Holder<T>>(items);
+	}
+
+	size_t size() const {
+		return (get<Ts>().size() + ... + 0);
+	}
+
+	unsigned presence_mask() const {
+		return ((get<Ts>().empty() ? 0u : type_bit<Ts, types>) | ... | 0u);
+	}
+};
+
+template <typename T>
+using VectorOf = std::vector<T>;
+
+template <typename List>
+using TypedVectors = PerType<VectorOf, List>;
+
+///////////////////////////////////////////////////////////////////////////////
+// runtime mask -> compile-time mask
+
+// table[mask] = Make::template value<mask>, for every mask of the list
+template <typename List, typename Make, unsigned... Masks>
+constexpr auto make_mask_table(std::integer_sequence<unsigned, Masks...>) {
+	using Value = decltype(Make::template value<0>);
+	return std::array<Value, sizeof...(Masks)> { Make::template value<Masks>... };
+}
+
+template <typename List, typename Make>
+constexpr auto make_mask_table() {
+	return make_mask_table<List, Make>(std::make_integer_sequence<unsigned, full_type_mask<List> + 1>{});
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "aabb.h"
+#include "stats.h"
+
+using std::size_t;
+using std::uint32_t;
+
+// Uniform grid over item bounds, every cell lists the items overlapping it.
+// The resolution aims at DENSITY cells per item, in cubes as far as the
+// extent allows.
+struct UniformGrid {
+	static constexpr float DENSITY = 2.f;
+	static const uint32_t MAX_RESOLUTION = 1024; // per axis
+	static const size_t MAX_CELLS = 1 << 24;
+
+	AABB box;
+	glm::uvec3 resolution = glm::uvec3(0, 0, 0);
+	glm::vec3 cell_size, inv_cell_size;
+	std::vector<uint32_t> cell_begin; // cell c lists items[cell_begin[c], cell_begin[c + 1])
+	std::vector<uint32_t> items;
+
+	// counts overlaps, then scatters into the prefix-summed cells, both in
+	// parallel over the items
+	void build(const std::vector<AABB> &bounds);
+
+	bool empty() const {
+		return items.empty();
+	}
+
+	AABB bounds() const {
+		return box;
+	}
+
+	size_t cell_count() const {
+		return cell_begin.empty() ? 0 : cell_begin.size() - 1;
+	}
+
+	size_t bytes() const {
+		return (cell_begin.size() + items.size()) * sizeof(uint32_t);
+	}
+
+	// same contract as BVH::traverse: cells are walked front to back with
+	// 3D-DDA; a small per-ray mailbox skips most items already tested in an
+	// earlier cell
+	template <typename TestItem>
+	void traverse(const RayInv &ray, float &t_max, TestItem &&test_item) const;
+};
+
+template <typename TestItem>
+void UniformGrid::traverse(const RayInv &ray, float &t_max, TestItem &&test_item) const {
+	const float INF = std::numeric_limits<float>::infinity();
+
+	if (empty()) {
+		return;
+	}
+
+	float t = slab_entry(box, ray, t_max);
+	if (t == INF) {
+		return;
+	}
+
+	// direct-mapped, so an item is at worst tested again, never skipped
+	const uint32_t MAILBOX_SIZE = 16;
+	uint32_t mailbox[MAILBOX_SIZE];
+	std::fill(mailbox, mailbox + MAILBOX_SIZE, ~0u);
+
+	glm::ivec3 cell, step, end;
+	glm::vec3 t_next, t_delta;
+	glm::vec3 d = 1.f / ray.inv_d;
+
+	for (int a = 0; a < 3; a++) {
+		float p = (ray.o[a] + t * d[a] - box.lo[a]) * inv_cell_size[a];
+		cell[a] = std::min(std::max((int)std::floor(p), 0), (int)resolution[a] - 1);
+
+		if (ray.inv_d[a] >= 0) {
+			step[a] = 1;
+			end[a] = resolution[a];
+			t_next[a] = (box.lo[a] + (cell[a] + 1) * cell_size[a] - ray.o[a]) * ray.inv_d[a];
+		} else {
+			step[a] = -1;
+			end[a] = -1;
+			t_next[a] = (box.lo[a] + cell[a] * cell_size[a] - ray.o[a]) * ray.inv_d[a];
+		}
+
+		t_delta[a] = cell_size[a] * std::abs(ray.inv_d[a]);
+	}
+
+	while (true) {
+		size_t c = ((size_t)cell.z * resolution.y + cell.y) * resolution.x + cell.x;
+		count_node_visit();
+
+		for (uint32_t i = cell_begin[c]; i < cell_begin[c + 1]; i++) {
+			uint32_t item = items[i];
+			uint32_t &slot = mailbox[item % MAILBOX_SIZE];
+
+			if (slot != item) {
+				slot = item;
+				test_item(item, t_max);
+			}
+		}
+
+		int a = t_next.x < t_next.y ? (t_next.x < t_next.z ? 0 : 2) : (t_next.y < t_next.z ? 1 : 2);
+
+		// hits found so far are closer than anything beyond this cell
+		if (t_next[a] >= t_max) {
+			return;
+		}
+
+		cell[a] += step[a];
+		if (cell[a] == end[a]) {
+			return;
+		}
+
+		t_next[a] += t_delta[a];
+	}
+}
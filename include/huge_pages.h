@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+using std::size_t;
+
+// Allocates arrays of at least HUGE_PAGE_SIZE aligned to and rounded up to
+// huge pages, with transparent huge pages requested for them; smaller arrays
+// are cache-line aligned.
+void *huge_page_alloc(size_t bytes);
+
+void huge_page_free(void *ptr, size_t bytes);
+
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+const size_t CACHE_LINE_SIZE = 64;
+
+template <typename T>
+struct HugePageAllocator {
+	using value_type = T;
+
+	HugePageAllocator() = default;
+
+	template <typename U>
+	HugePageAllocator(const HugePageAllocator<U> &) {}
+
+	T *allocate(size_t n) {
+		return static_cast<T*>(huge_page_alloc(n * sizeof(T)));
+	}
+
+	void deallocate(T *ptr, size_t n) {
+		huge_page_free(ptr, n * sizeof(T));
+	}
+
+	template <typename U>
+	bool operator == (const HugePageAllocator<U> &) const {
+		return true;
+	}
+
+	template <typename U>
+	bool operator != (const HugePageAllocator<U> &) const {
+		return false;
+	}
+};
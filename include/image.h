@@ -1,12 +1,24 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include <glm/glm.hpp>
 
+#include "alloc_tracking.h"
+#include "parallel.h"
 #include "scene.h"
+#include "stats.h"
+#include "trace.h"
 
 using std::size_t;
+using std::uint64_t;
 
 struct Image {
 	size_t width, height;
@@ -14,9 +26,132 @@ struct Image {
 
 	Image(size_t _width, size_t _height);
 
+	Image(const Image &) = delete;
+
+	Image(Image &&other);
+
+	Image &operator = (const Image &) = delete;
+
+	Image &operator = (Image &&other);
+
 	~Image();
 };
 
-Image render_scene(const Scene &scene);
+///////////////////////////////////////////////////////////////////////////////
+// per-pixel cost
+
+// primitive tests need the RAYTRACING_STATS build option, cycles are read
+// from the time stamp counter (nanoseconds where there is none)
+enum class CostMetric { tests, cycles };
+
+const char *to_string(CostMetric metric);
+
+std::optional<CostMetric> parse_cost_metric(const char *name);
+
+struct PixelCosts {
+	CostMetric metric = CostMetric::cycles;
+	size_t width = 0, height = 0;
+	std::vector<float> cost; // row-major, top row first
+};
+
+// while set, render_image records the cost of every pixel_color call into
+// costs; null stops recording
+void record_pixel_costs(PixelCosts *costs);
+
+PixelCosts *pixel_costs();
+
+inline uint64_t cost_clock(CostMetric metric) {
+	if (metric == CostMetric::tests) {
+		return thread_stats().total_tests();
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// <prefix>.ppm in false color, cheap blue to expensive red, scaled to the
+// 99th percentile so that pixels hit by interrupts do not wash it out, and
+// the raw costs as <prefix>.pfm; false if a file cannot be written
+bool write_pixel_costs(const PixelCosts &costs, const std::string &prefix);
+
+///////////////////////////////////////////////////////////////////////////////
+// rendering
+
+const size_t RENDER_TILE = 32;
+
+template <typename PixelColor>
+void render_tile(Image &result, size_t x0, size_t y0, size_t x1, size_t y1, const PixelColor &pixel_color, PixelCosts *costs) {
+	NoAllocScope no_alloc;
+
+	if (costs) {
+		for (size_t i = y0; i < y1; i++) {
+			for (size_t j = x0; j < x1; j++) {
+				uint64_t start = cost_clock(costs->metric);
+				result.data[i][j] = pixel_color(j, i);
+				costs->cost[i * result.width + j] = cost_clock(costs->metric) - start;
+			}
+		}
+
+		return;
+	}
+
+	for (size_t i = y0; i < y1; i++) {
+		for (size_t j = x0; j < x1; j++) {
+			result.data[i][j] = pixel_color(j, i);
+		}
+	}
+}
+
+// pixel_color(x, y) is called for every pixel of a width x height image, so
+// it must be safe to call concurrently: the image is split into tiles that
+// the pool's threads take in row-major order as they finish their previous
+// ones
+template <typename PixelColor>
+Image render_image(size_t width, size_t height, const PixelColor &pixel_color) {
+	Image result(width, height);
+
+	PixelCosts *costs = pixel_costs();
+	if (costs) {
+		costs->width = width;
+		costs->height = height;
+		costs->cost.assign(width * height, 0.f);
+	}
+
+	size_t tiles_x = (width + RENDER_TILE - 1) / RENDER_TILE;
+	size_t tiles = tiles_x * ((height + RENDER_TILE - 1) / RENDER_TILE);
+	std::atomic<size_t> next_tile { 0 };
+
+	parallel_chunks(tiles, std::min(thread_pool().size(), tiles), [&](size_t, size_t, size_t) {
+		for (size_t tile; (tile = next_tile++) < tiles; ) {
+			TraceScope scope("tile", "render", tile);
+
+			size_t x0 = tile % tiles_x * RENDER_TILE, y0 = tile / tiles_x * RENDER_TILE;
+			render_tile(result, x0, y0, std::min(x0 + RENDER_TILE, width), std::min(y0 + RENDER_TILE, height), pixel_color, costs);
+		}
+	});
+
+	return result;
+}
+
+// brute force, Scene::get_pixel_color for every pixel in the given precision
+Image render_scene(const Scene &scene, Precision precision = Precision::f32);
+
+struct Accelerator;
+
+Image render_scene(const Scene &scene, const Accelerator &accel);
+
+struct TwoLevelBVH;
+
+struct OcclusionBuffer;
+
+// every pixel's traversal starts from its occluder hit, so that nodes behind
+// the occluders are culled
+Image render_scene(const Scene &scene, const TwoLevelBVH &accel, const OcclusionBuffer &occlusion);
+
+// primary rays traced in 16x16 tile packets
+Image render_scene_packets(const Scene &scene, const TwoLevelBVH &accel);
 
 void write_image(const Image &img, std::ostream &out);
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "bvh8.h"
+#include "scene.h"
+
+using std::size_t;
+using std::uint8_t;
+
+// Instruction set levels the hot kernels are built for, in increasing order.
+// One binary runs everywhere: every level lives in its own translation unit
+// compiled with that level's flags, and the best level the CPU supports is
+// picked on first use. The intersection kernels take batches of pairs and
+// cover every path of primitives.cpp, the wavefront renderer goes through
+// them; the per-ray intersect_t that the BVH leaves, grid cells and brute
+// force call one primitive at a time is compiled once with the build's flags.
+enum class Isa { scalar, sse42, avx2, avx512 };
+
+const char *to_string(Isa isa);
+
+// "scalar", "sse4.2", "avx2" or "avx512"
+std::optional<Isa> parse_isa(const char *name);
+
+// highest level supported by this CPU and OS
+Isa detect_isa();
+
+// camera of Scene::generate_ray_to_pixel as plain floats
+struct RayGenParams {
+	float tan_fov[2];
+	size_t width, height;
+	float right[3], up[3], forward[3];
+};
+
+RayGenParams ray_gen_params(const Scene &scene);
+
+// structure-of-arrays batch of (ray, primitive) pairs: ray origins o, ray
+// directions d, primitive positions p, primitive sizes s (sphere radius in
+// s[0], ellipsoid axes, box semi-axes, plane normal) and the conjugate
+// rotation q (x, y, z, w) of general ellipsoids and boxes; axis planes only
+// use the axis' component of o, d and p, in o[0], d[0] and p[0]. t receives
+// the least positive hit or infinity
+struct KernelBatch {
+	static constexpr size_t SIZE = 256;
+
+	size_t size = 0;
+	alignas(64) float o[3][SIZE], d[3][SIZE], p[3][SIZE], s[3][SIZE], q[4][SIZE], t[SIZE];
+};
+
+using BatchKernel = void (*)(KernelBatch &batch);
+
+struct Kernels {
+	Isa isa;
+
+	// directions of the primary rays of pixels x0 .. x0 + n - 1 in row y,
+	// bit-identical to Scene::generate_ray_to_pixel
+	void (*generate_directions)(const RayGenParams &params, size_t y, size_t x0, size_t n, float *dx, float *dy, float *dz);
+
+	// the paths of primitives.cpp, bit-identical to intersect_t for
+	// primitives classified as such
+	BatchKernel intersect_axis_planes, intersect_planes;
+	BatchKernel intersect_spheres, intersect_ellipsoids;
+	BatchKernel intersect_aabbs, intersect_boxes;
+
+	// child slab test of BVH8 nodes
+	BVH8ChildTest bvh8_children;
+
+	// n floats -> round(v * 255), clamped to 0 .. 255
+	void (*quantize)(const float *in, size_t n, uint8_t *out);
+};
+
+extern const Kernels kernels_scalar, kernels_sse42, kernels_avx2, kernels_avx512;
+
+// kernels of the selected level, detect_isa() unless overridden
+const Kernels &active_kernels();
+
+// overrides the detected level, false if the CPU does not support it
+bool select_isa(Isa isa);
+
+// the kernel of the primitive's path, and slot i of its batch filled with the
+// pair; only for callers outside the kernel units
+inline BatchKernel batch_kernel(const Kernels &kernels, const Plane &pr) {
+	return pr.fast_path == FastPath::axis_plane ? kernels.intersect_axis_planes : kernels.intersect_planes;
+}
+
+inline BatchKernel batch_kernel(const Kernels &kernels, const Ellipsoid &pr) {
+	return pr.fast_path == FastPath::sphere ? kernels.intersect_spheres : kernels.intersect_ellipsoids;
+}
+
+inline BatchKernel batch_kernel(const Kernels &kernels, const Box &pr) {
+	return pr.fast_path == FastPath::aabb ? kernels.intersect_aabbs : kernels.intersect_boxes;
+}
+
+inline void load_pair(KernelBatch &batch, size_t i, const Ray &ray, const Plane &pr) {
+	if (pr.fast_path == FastPath::axis_plane) {
+		batch.o[0][i] = ray.o[pr.axis];
+		batch.d[0][i] = ray.d[pr.axis];
+		batch.p[0][i] = pr.position[pr.axis];
+		return;
+	}
+
+	for (int axis = 0; axis < 3; axis++) {
+		batch.o[axis][i] = ray.o[axis];
+		batch.d[axis][i] = ray.d[axis];
+		batch.p[axis][i] = pr.position[axis];
+		batch.s[axis][i] = pr.normal[axis];
+	}
+}
+
+// sizes and the conjugate rotation of ellipsoids and boxes
+template <typename T>
+void load_pair(KernelBatch &batch, size_t i, const Ray &ray, const T &pr, const glm::vec3 &size) {
+	for (int axis = 0; axis < 3; axis++) {
+		batch.o[axis][i] = ray.o[axis];
+		batch.d[axis][i] = ray.d[axis];
+		batch.p[axis][i] = pr.position[axis];
+		batch.s[axis][i] = size[axis];
+	}
+
+	if (pr.fast_path == FastPath::none) {
+		batch.q[0][i] = -pr.rotation.x;
+		batch.q[1][i] = -pr.rotation.y;
+		batch.q[2][i] = -pr.rotation.z;
+		batch.q[3][i] = pr.rotation.w;
+	}
+}
+
+inline void load_pair(KernelBatch &batch, size_t i, const Ray &ray, const Ellipsoid &pr) {
+	load_pair(batch, i, ray, pr, pr.axes);
+}
+
+inline void load_pair(KernelBatch &batch, size_t i, const Ray &ray, const Box &pr) {
+	load_pair(batch, i, ray, pr, pr.semi_axes);
+}
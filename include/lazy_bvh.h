@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "stats.h"
+
+using std::size_t;
+using std::uint32_t;
+
+// A node starts out pending, as a leaf over its whole item range, and is split
+// the first time a ray reaches it. left_first and count of a pending node are
+// only read by the thread that expands it; others read them after seeing
+// state == ready.
+struct LazyNode {
+	enum : uint32_t { pending, expanding, ready };
+
+	AABB bounds;
+	uint32_t left_first;
+	uint32_t count;
+	uint32_t depth;
+	std::atomic<uint32_t> state { pending };
+
+	bool is_leaf() const {
+		return count > 0;
+	}
+};
+
+// binary BVH whose top EAGER_DEPTH levels are built up front and the rest on
+// demand during traversal; several threads may traverse it at once, each node
+// is expanded exactly once
+struct LazyBVH {
+	static const uint32_t EAGER_DEPTH = 6;
+
+	LazyBVH() = default;
+
+	// only while no traversal is running
+	LazyBVH(LazyBVH &&other) noexcept;
+
+	LazyBVH &operator = (LazyBVH &&other) noexcept;
+
+	void build(const std::vector<AABB> &bounds);
+
+	bool empty() const {
+		return item_bounds.empty();
+	}
+
+	AABB bounds() const {
+		return empty() ? AABB() : nodes[0].bounds;
+	}
+
+	// nodes created so far
+	size_t node_count() const {
+		return empty() ? 0 : next_node.load(std::memory_order_relaxed);
+	}
+
+	// same contract as BVH::traverse
+	template <typename TestItem>
+	void traverse(const RayInv &ray, float &t_max, TestItem &&test_item) const;
+
+private:
+	// expansion happens inside const traversals
+	mutable std::unique_ptr<LazyNode[]> nodes;
+	mutable std::vector<uint32_t> items;
+	mutable std::atomic<uint32_t> next_node { 0 };
+	std::vector<AABB> item_bounds;
+
+	// waits for the node to be ready, expanding it if no one else is
+	const LazyNode &expanded(uint32_t index) const;
+
+	void expand(LazyNode &node) const;
+
+	void expand_eagerly(uint32_t index) const;
+};
+
+template <typename TestItem>
+void LazyBVH::traverse(const RayInv &ray, float &t_max, TestItem &&test_item) const {
+	const float INF = std::numeric_limits<float>::infinity();
+
+	if (empty() || slab_entry(nodes[0].bounds, ray, t_max) == INF) {
+		return;
+	}
+
+	struct Entry {
+		uint32_t node;
+		float t;
+	};
+
+	Entry stack[64];
+	size_t top = 0;
+	uint32_t cur = 0;
+
+	while (true) {
+		const LazyNode &node = expanded(cur);
+		count_node_visit();
+
+		if (node.is_leaf()) {
+			for (uint32_t i = node.left_first; i < node.left_first + node.count; i++) {
+				test_item(items[i], t_max);
+			}
+		} else {
+			uint32_t near = node.left_first, far = node.left_first + 1;
+
+			float t_near = slab_entry(nodes[near].bounds, ray, t_max);
+			float t_far = slab_entry(nodes[far].bounds, ray, t_max);
+
+			if (t_far < t_near) {
+				std::swap(near, far);
+				std::swap(t_near, t_far);
+			}
+
+			if (t_near != INF) {
+				if (t_far != INF) {
+					stack[top++] = { far, t_far };
+				}
+
+				cur = near;
+				continue;
+			}
+		}
+
+		bool found = false;
+		while (top > 0) {
+			Entry e = stack[--top];
+			if (e.t <= t_max) {
+				cur = e.node;
+				found = true;
+				break;
+			}
+		}
+
+		if (!found) {
+			return;
+		}
+	}
+}
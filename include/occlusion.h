@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "aabb.h"
+#include "accel.h"
+#include "scene.h"
+
+using std::size_t;
+
+// Screen rectangle of pixels, inclusive.
+struct PixelRect {
+	int x0, y0, x1, y1;
+};
+
+// Hierarchical depth buffer of a few large, near occluders. Level 0 holds the
+// occluder hit of every pixel's primary ray, as the ray parameter t; every
+// further level keeps the largest t of 2x2 cells below it, infinity where a
+// pixel is not covered. Since a primary ray's t equals the depth coordinate
+// of the camera basis (right, -up, forward), a box whose nearest corner lies
+// beyond the largest t over its screen rectangle is hidden at every pixel.
+struct OcclusionBuffer {
+	static constexpr size_t MAX_OCCLUDERS = 32;
+	static constexpr int MIN_OCCLUDER_PIXELS = 256;
+
+	const Scene &scene;
+	glm::mat3 to_camera; // world offset from the camera -> (t * xc, t * yc, t)
+
+	std::vector<Hit> pixels;
+	std::vector<std::vector<float>> levels;
+	size_t occluders = 0;
+
+	// picks the root planes and the bounded root primitives with the largest
+	// screen rectangles, then casts every pixel's ray against them
+	explicit OcclusionBuffer(const Scene &_scene);
+
+	const Hit &pixel(size_t x, size_t y) const {
+		return pixels[y * scene.width + x];
+	}
+
+	// screen rectangle and nearest depth of a box, empty when part of it lies
+	// behind the camera
+	std::optional<std::pair<PixelRect, float>> project(const AABB &box) const;
+
+	// true only when no primary ray can reach the box before an occluder
+	bool hides(const AABB &box) const;
+
+	// largest occluder t over the rectangle, at most 3x3 cells are read
+	float max_depth(PixelRect rect) const;
+};
+
+struct CullStats {
+	size_t occluders = 0, tested = 0, culled = 0;
+};
+
+// copy of the scene without root primitives the buffer hides; instances are
+// kept as they are
+Scene cull_occluded(const Scene &scene, const OcclusionBuffer &buffer, CullStats &stats);
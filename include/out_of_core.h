@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "accel.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "primitives.h"
+#include "scene.h"
+
+using std::size_t;
+using std::uint32_t;
+using std::uint64_t;
+
+// One spatially clustered chunk of the root primitives in the chunk file:
+// its BVH nodes, the primitive refs in leaf order, then the records of every
+// bounded type, each section 64-byte aligned.
+struct ChunkInfo {
+	AABB bounds;
+	uint64_t offset = 0, bytes = 0; // page aligned in the file
+	uint32_t node_count = 0, ref_count = 0;
+	uint32_t type_counts[PrimitiveTypes::size] = {};
+};
+
+// the resident part of an out-of-core scene
+struct ChunkIndex {
+	std::string path;
+	std::vector<ChunkInfo> chunks;
+	BVH top;                 // over chunk bounds
+	TypedVectors<PrimitiveTypes> resident; // unbounded primitives
+	uint64_t file_bytes = 0;
+};
+
+struct OutOfCoreOptions {
+	std::string path;                   // chunk file, a spill file is made next to it
+	size_t memory_budget = 256 << 20;   // for mapped chunks
+	size_t chunk_primitives = 1 << 15;  // target chunk size
+	BvhBuilder builder = BvhBuilder::binned_sah;
+};
+
+// Receives the root primitives while the scene is read and writes them to a
+// spill file; finish sorts them into chunks along a Morton curve over their
+// centroids and builds and writes the BVH of every chunk. Only one chunk is
+// held in memory at a time.
+struct ChunkWriter {
+	OutOfCoreOptions options;
+	int spill_fd = -1;
+	std::vector<char> buffer;
+	uint64_t spilled = 0;
+	AABB centroid_bounds;
+	TypedVectors<PrimitiveTypes> resident;
+	bool failed = false;
+
+	explicit ChunkWriter(const OutOfCoreOptions &_options);
+
+	~ChunkWriter();
+
+	ChunkWriter(const ChunkWriter &) = delete;
+
+	ChunkWriter &operator = (const ChunkWriter &) = delete;
+
+	void add(const AnyPrimitive &pr);
+
+	void flush();
+
+	// empty on I/O errors, which are reported on stderr
+	std::optional<ChunkIndex> finish();
+};
+
+struct OutOfCoreStats {
+	size_t page_ins = 0, evictions = 0, hits = 0;
+	uint64_t paged_in_bytes = 0, peak_mapped_bytes = 0;
+};
+
+// Root primitives from memory-mapped chunks, instances from a resident
+// TwoLevelBVH. Chunks are mapped when a ray first reaches them and unmapped
+// least recently used first once the mapped bytes exceed the budget; chunks
+// still in use by a traversal stay mapped until it is done.
+struct OutOfCoreBVH : Accelerator {
+	struct Mapping {
+		void *base = nullptr;
+		size_t length = 0;
+
+		~Mapping();
+	};
+
+	ChunkIndex index;
+	TwoLevelBVH instances;
+	size_t memory_budget;
+	int fd = -1;
+
+	OutOfCoreBVH(const Scene &scene, ChunkIndex _index, const OutOfCoreOptions &options);
+
+	~OutOfCoreBVH();
+
+	// the chunk file could not be opened or a chunk could not be mapped,
+	// reported once on stderr; rays then miss everything and the rendered
+	// image must be discarded
+	bool failed() const {
+		return io_failed.load(std::memory_order_relaxed);
+	}
+
+	std::optional<Hit> closest_hit(const Ray &ray) const override;
+
+	OutOfCoreStats stats() const;
+
+private:
+	struct Entry {
+		std::shared_ptr<const Mapping> mapping;
+		std::list<uint32_t>::iterator lru;
+	};
+
+	mutable std::mutex mutex;
+	mutable std::unordered_map<uint32_t, Entry> mapped;
+	mutable std::list<uint32_t> lru; // most recently used first
+	mutable uint64_t mapped_bytes = 0;
+	mutable OutOfCoreStats counters;
+	mutable std::atomic<bool> io_failed { false };
+
+	std::shared_ptr<const Mapping> acquire(uint32_t chunk) const;
+
+	void intersect_chunk(const ChunkInfo &info, const char *base, const Ray &ray, const RayInv &ray_inv, Hit &best) const;
+};
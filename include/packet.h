@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include <glm/glm.hpp>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "primitives.h"
+
+using std::size_t;
+using std::uint32_t;
+
+// primary rays of one screen tile, all leaving the camera position
+struct RayPacket {
+	static const size_t TILE = 16;
+	static const size_t MAX_SIZE = TILE * TILE;
+
+	glm::vec3 origin;
+	size_t size = 0;
+
+	glm::vec3 d[MAX_SIZE];
+	RayInv inv[MAX_SIZE];
+	float t[MAX_SIZE];       // closest hit so far, infinity for none
+	glm::vec3 color[MAX_SIZE];
+
+	// per-axis interval of the reciprocal directions, and the largest t,
+	// bounding the whole packet for the interval tests
+	glm::vec3 inv_d_lo, inv_d_hi;
+	float t_max_bound;
+
+	explicit RayPacket(glm::vec3 _origin) : origin(_origin) {}
+
+	void add(glm::vec3 dir) {
+		d[size] = dir;
+		inv[size] = RayInv(origin, dir);
+		t[size] = std::numeric_limits<float>::infinity();
+		size++;
+	}
+
+	Ray ray(size_t i) const {
+		return { origin, d[i] };
+	}
+
+	// to be called once all rays are added
+	void finish() {
+		inv_d_lo = inv_d_hi = inv[0].inv_d;
+		for (size_t i = 1; i < size; i++) {
+			inv_d_lo = glm::min(inv_d_lo, inv[i].inv_d);
+			inv_d_hi = glm::max(inv_d_hi, inv[i].inv_d);
+		}
+
+		update_t_max_bound();
+	}
+
+	void update_t_max_bound() {
+		t_max_bound = 0;
+		for (size_t i = 0; i < size; i++) {
+			t_max_bound = std::max(t_max_bound, t[i]);
+		}
+	}
+};
+
+// Interval arithmetic version of slab_entry for a whole packet: false only if
+// no ray of the packet can enter the box before its t. Each slab distance is
+// linear in the reciprocal direction, so its extremes over the packet are
+// found at the ends of the per-axis interval.
+inline bool packet_may_enter(const AABB &box, const RayPacket &packet) {
+	float enter = 0, exit = packet.t_max_bound;
+
+	for (int a = 0; a < 3; a++) {
+		float lo = box.lo[a] - packet.origin[a], hi = box.hi[a] - packet.origin[a];
+		float p0 = lo * packet.inv_d_lo[a], p1 = lo * packet.inv_d_hi[a];
+		float p2 = hi * packet.inv_d_lo[a], p3 = hi * packet.inv_d_hi[a];
+
+		enter = std::max(enter, std::min({ p0, p1, p2, p3 }));
+		exit = std::min(exit, std::max({ p0, p1, p2, p3 }));
+	}
+
+	return enter <= exit;
+}
+
+// Closest-hit traversal of a whole packet. Rays before `first` are known to
+// miss the current subtree. A node is accepted for the rest of the packet as
+// soon as the first of those rays hits it, culled when the interval test fails,
+// and otherwise `first` moves on to the next ray that hits it.
+// test_item(item, ray index) is called for the rays that reach a leaf.
+template <typename TestItem>
+void traverse_packet(const BVH &bvh, RayPacket &packet, TestItem &&test_item) {
+	const float INF = std::numeric_limits<float>::infinity();
+
+	if (bvh.empty() || packet.size == 0) {
+		return;
+	}
+
+	auto first_hit = [&](const AABB &box, size_t first) {
+		if (slab_entry(box, packet.inv[first], packet.t[first]) != INF) {
+			return first;
+		}
+
+		if (!packet_may_enter(box, packet)) {
+			return packet.size;
+		}
+
+		for (size_t i = first + 1; i < packet.size; i++) {
+			if (slab_entry(box, packet.inv[i], packet.t[i]) != INF) {
+				return i;
+			}
+		}
+
+		return packet.size;
+	};
+
+	struct Entry {
+		uint32_t node;
+		uint32_t first;
+	};
+
+	Entry stack[64];
+	size_t top = 0;
+
+	uint32_t cur = 0;
+	size_t first = first_hit(bvh.nodes[0].bounds, 0);
+	if (first == packet.size) {
+		return;
+	}
+
+	glm::vec3 mean_d = packet.d[0] + packet.d[packet.size - 1];
+
+	while (true) {
+		const BVHNode &node = bvh.nodes[cur];
+
+		// per ray the packet carries through the node, as BVH::traverse
+		// counts per ray
+		count_node_visit(packet.size - first);
+
+		if (node.is_leaf()) {
+			for (size_t i = first; i < packet.size; i++) {
+				if (slab_entry(node.bounds, packet.inv[i], packet.t[i]) == INF) {
+					continue;
+				}
+
+				for (uint32_t k = node.left_first; k < node.left_first + node.count; k++) {
+					test_item(bvh.items[k], i);
+				}
+			}
+
+			packet.update_t_max_bound();
+		} else {
+			uint32_t near = node.left_first, far = node.left_first + 1;
+			if (glm::dot(bvh.nodes[far].bounds.center() - bvh.nodes[near].bounds.center(), mean_d) < 0) {
+				std::swap(near, far);
+			}
+
+			size_t near_first = first_hit(bvh.nodes[near].bounds, first);
+			size_t far_first = first_hit(bvh.nodes[far].bounds, first);
+
+			if (far_first < packet.size) {
+				stack[top++] = { far, (uint32_t)far_first };
+			}
+
+			if (near_first < packet.size) {
+				cur = near;
+				first = near_first;
+				continue;
+			}
+		}
+
+		// entries were pushed before the rays behind them found closer hits,
+		// so they are tested again
+		bool found = false;
+		while (top > 0) {
+			Entry e = stack[--top];
+			first = first_hit(bvh.nodes[e.node].bounds, e.first);
+			if (first < packet.size) {
+				cur = e.node;
+				found = true;
+				break;
+			}
+		}
+
+		if (!found) {
+			return;
+		}
+	}
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+using std::size_t;
+
+// Fixed set of worker threads with one shared FIFO queue. Waiting for tasks
+// is done by running queued ones, so tasks may spawn and wait for subtasks.
+struct ThreadPool {
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> queue;
+	std::mutex mutex;
+	std::condition_variable has_work;
+	bool stopping = false;
+
+	// `threads` counts the calling thread, so threads - 1 workers are started
+	explicit ThreadPool(size_t threads);
+
+	~ThreadPool();
+
+	size_t size() const;
+
+	void submit(std::function<void()> task);
+
+	// runs one queued task on the calling thread, false if there was none
+	bool run_one();
+};
+
+// process-wide pool used by builders and renderers
+ThreadPool &thread_pool();
+
+// recreates the process-wide pool, 0 means one thread per hardware thread
+void set_thread_count(size_t threads);
+
+// tasks spawned into the pool that can be waited for together
+struct TaskGroup {
+	ThreadPool &pool;
+	std::atomic<size_t> pending { 0 };
+
+	explicit TaskGroup(ThreadPool &_pool) : pool(_pool) {}
+
+	~TaskGroup() {
+		wait();
+	}
+
+	template <typename F>
+	void spawn(F &&f) {
+		pending++;
+		pool.submit([this, f = std::forward<F>(f)]() mutable {
+			{
+				TraceScope scope("task", "pool");
+				f();
+			}
+			pending--;
+		});
+	}
+
+	void wait() {
+		while (pending > 0) {
+			if (!pool.run_one()) {
+				std::this_thread::yield();
+			}
+		}
+	}
+};
+
+// f(chunk, chunk_begin, chunk_end) for `chunks` nearly equal parts of
+// [0, n), all but the first one run as pool tasks
+template <typename F>
+void parallel_chunks(size_t n, size_t chunks, F &&f) {
+	if (chunks <= 1) {
+		f(size_t(0), size_t(0), n);
+		return;
+	}
+
+	TaskGroup group(thread_pool());
+	for (size_t c = 1; c < chunks; c++) {
+		group.spawn([&f, n, chunks, c]() {
+			f(c, n * c / chunks, n * (c + 1) / chunks);
+		});
+	}
+
+	f(size_t(0), size_t(0), n / chunks);
+	group.wait();
+}
+
+// number of chunks parallel_for splits n elements into
+size_t chunk_count(size_t n, size_t grain);
+
+// f(chunk_begin, chunk_end) over [begin, end) split into chunks of at least
+// `grain` elements, one chunk per thread at most
+template <typename F>
+void parallel_for(size_t begin, size_t end, size_t grain, F &&f) {
+	size_t n = end > begin ? end - begin : 0;
+	if (n == 0) {
+		return;
+	}
+
+	parallel_chunks(n, chunk_count(n, grain), [&](size_t, size_t b, size_t e) {
+		f(begin + b, begin + e);
+	});
+}
+
+// stable LSD radix sort of keys, values are permuted along with them
+void parallel_radix_sort(std::vector<std::uint64_t> &keys, std::vector<std::uint32_t> &values);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::size_t;
+using std::uint64_t;
+
+// Hardware counters of every thread through perf_event_open, for --perf.
+// Counters that the kernel, the CPU or the permissions (perf_event_paranoid)
+// do not allow are left out and reported as unavailable, so --perf only
+// ever loses columns; elsewhere than Linux none are available.
+
+enum class PerfEvent { cycles, instructions, l1d_misses, llc_misses, branch_misses };
+
+const size_t PERF_EVENTS = 5;
+
+const char *to_string(PerfEvent event);
+
+struct PerfValues {
+	// scaled up by enabled / running time if the kernel multiplexed them
+	uint64_t counts[PERF_EVENTS] = {};
+	bool available[PERF_EVENTS] = {};
+
+	uint64_t operator [] (PerfEvent event) const {
+		return counts[(size_t)event];
+	}
+
+	bool has(PerfEvent event) const {
+		return available[(size_t)event];
+	}
+
+	bool any() const;
+
+	PerfValues &operator += (const PerfValues &other);
+
+	PerfValues &operator -= (const PerfValues &other);
+};
+
+// opens the counters of the calling thread, and from then on of every pool
+// thread when it runs its next task; false, with the reason on stderr, if
+// none can be opened
+bool start_perf_counters();
+
+bool perf_counters_started();
+
+// opens the calling thread's counters if started and not open yet
+void perf_thread_attach();
+
+// sum over every thread that had counters, including exited ones
+PerfValues read_perf_counters();
+
+struct ThreadPerf {
+	std::string name;
+	PerfValues values;
+};
+
+std::vector<ThreadPerf> read_perf_counters_per_thread();
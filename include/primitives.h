@@ -1,38 +1,77 @@
 #pragma once
 
 #include <optional>
+#include <type_traits>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
-struct Ray {
-	glm::vec3 o, d;
+#include "aabb.h"
+#include "dispatch.h"
+#include "stats.h"
 
-	Ray operator - (const glm::vec3 &vec) const;
+// Ray in scalar precision S. Primitives are stored in float, intersection
+// code is templated on S and instantiated for float and double in
+// primitives.cpp, so that double is only paid where it is asked for.
+template <typename S>
+struct RayT {
+	using vec3 = glm::vec<3, S>;
 
-	Ray rotate(const glm::quat &rot) const;
+	vec3 o, d;
+
+	RayT operator - (const vec3 &vec) const;
+
+	RayT rotate(const glm::qua<S> &rot) const;
 };
 
+using Ray = RayT<float>;
+using RayD = RayT<double>;
+
+template <typename S, typename U>
+RayT<S> precision_cast(const RayT<U> &ray) {
+	return { typename RayT<S>::vec3(ray.o), typename RayT<S>::vec3(ray.d) };
+}
+
+// a ray within this relative distance of a surface's silhouette, or a plane's
+// tangent, is grazing: float may flip its hit or miss
+template <typename S>
+constexpr S GRAZING_EPS = S(1e-4);
+
+// specialized kernels chosen at load time; `none` means the general
+// quaternion transform followed by intersection_t in local space. Both take
+// an optional `grazing` distance that is lowered, hit or miss, to the t where
+// the ray grazes the surface (see GRAZING_EPS).
+enum class FastPath { none, sphere, aabb, axis_plane };
+
+// common placement data; there are no virtual functions, every concrete type
+// provides intersection_t (local space) and fast_intersection_t (world space)
+// and is dispatched statically through intersect() below
 struct Primitive {
 	glm::vec3 position = glm::vec3(0.f, 0.f, 0.f);
 	glm::quat rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
 	glm::vec3 color = glm::vec3(0.f, 0.f, 0.f);
-
-	virtual std::optional<float> intersection_t(const Ray &ray) const = 0;
+	FastPath fast_path = FastPath::none;
 
 	Primitive();
 
-	std::optional<std::pair<float, glm::vec3>> intersect(const Ray &ray) const;
+	bool has_identity_rotation() const;
 };
 
 struct Plane : Primitive {
 	glm::vec3 normal;
+	int axis = -1;
 
 	Plane();
 
 	Plane(glm::vec3 _normal);
 
-	std::optional<float> intersection_t(const Ray &ray) const override;
+	void classify();
+
+	template <typename S>
+	std::optional<S> intersection_t(const RayT<S> &ray, S *grazing = nullptr) const;
+
+	template <typename S>
+	std::optional<S> fast_intersection_t(const RayT<S> &ray, S *grazing = nullptr) const;
 };
 
 struct Ellipsoid : Primitive {
@@ -42,7 +81,15 @@ struct Ellipsoid : Primitive {
 
 	Ellipsoid(glm::vec3 _axes);
 
-	std::optional<float> intersection_t(const Ray &ray) const override;
+	void classify();
+
+	template <typename S>
+	std::optional<S> intersection_t(const RayT<S> &ray, S *grazing = nullptr) const;
+
+	template <typename S>
+	std::optional<S> fast_intersection_t(const RayT<S> &ray, S *grazing = nullptr) const;
+
+	AABB bounds() const;
 };
 
 struct Box : Primitive {
@@ -52,5 +99,53 @@ struct Box : Primitive {
 
 	Box(glm::vec3 _semi_axes);
 
-	std::optional<float> intersection_t(const Ray &ray) const override;
+	void classify();
+
+	template <typename S>
+	std::optional<S> intersection_t(const RayT<S> &ray, S *grazing = nullptr) const;
+
+	template <typename S>
+	std::optional<S> fast_intersection_t(const RayT<S> &ray, S *grazing = nullptr) const;
+
+	AABB bounds() const;
 };
+
+using PrimitiveTypes = TypeList<Plane, Ellipsoid, Box>;
+
+using AnyPrimitive = variant_of_t<PrimitiveTypes>;
+
+static_assert(PrimitiveTypes::size <= StatCounters::TYPE_SLOTS);
+
+// planes are infinite and never go into acceleration structures
+template <typename T>
+constexpr bool is_bounded_v = !std::is_same_v<T, Plane>;
+
+// expects classify() to have been called, planes rely on their rotation being
+// baked into the normal
+template <typename T, typename S>
+std::optional<S> intersect_t(const T &primitive, const RayT<S> &ray, S *grazing = nullptr) {
+	static_assert(std::is_base_of_v<Primitive, T>);
+
+	std::optional<S> t;
+	if (primitive.fast_path != FastPath::none) {
+		t = primitive.fast_intersection_t(ray, grazing);
+	} else if constexpr (std::is_same_v<T, Plane>) {
+		t = primitive.intersection_t(ray - typename RayT<S>::vec3(primitive.position), grazing);
+	} else {
+		glm::qua<S> conj_rotation = glm::conjugate(glm::qua<S>(primitive.rotation));
+		t = primitive.intersection_t((ray - typename RayT<S>::vec3(primitive.position)).rotate(conj_rotation), grazing);
+	}
+
+	count_test(type_index_v<T, PrimitiveTypes>, t.has_value());
+	return t;
+}
+
+template <typename T, typename S>
+std::optional<std::pair<S, glm::vec3>> intersect(const T &primitive, const RayT<S> &ray, S *grazing = nullptr) {
+	auto t = intersect_t(primitive, ray, grazing);
+	if (!t.has_value()) {
+		return {};
+	}
+
+	return std::make_pair(t.value(), primitive.color);
+}
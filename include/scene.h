@@ -1,17 +1,69 @@
 #pragma once
 
 #include <cstddef>
+#include <functional>
 #include <iosfwd>
 #include <optional>
-#include <variant>
+#include <string>
 #include <vector>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 
 #include "primitives.h"
 
 using std::size_t;
 
+// number of primitives routed to each specialized kernel by read_scene
+struct FastPathStats {
+	size_t spheres = 0, aabbs = 0, axis_planes = 0, general = 0;
+};
+
+// shared geometry in its own space, placed in the world by instances
+struct Prototype {
+	std::string name;
+	TypedVectors<PrimitiveTypes> primitives;
+};
+
+enum class InstanceLayout { grid, ring };
+
+// one placement of a prototype, or a procedural array of copies of it; an
+// array costs the same as a single instance no matter how many copies it has
+struct Instance {
+	size_t prototype;
+	glm::vec3 position = glm::vec3(0.f, 0.f, 0.f);
+	glm::quat rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
+	std::optional<glm::vec3> color; // overrides the prototype's colors
+
+	// grid: counts.x * counts.y * counts.z copies `spacing` apart;
+	// ring: counts.x copies on a circle of `radius` around the local y axis,
+	// each turned to keep facing outwards
+	InstanceLayout layout = InstanceLayout::grid;
+	glm::uvec3 counts = glm::uvec3(1, 1, 1);
+	glm::vec3 spacing = glm::vec3(0.f, 0.f, 0.f);
+	float radius = 0;
+
+	size_t copies() const;
+
+	// linear copy number -> per-axis copy index
+	glm::uvec3 copy_index(size_t i) const;
+
+	// instance-space ray -> space of the copy with the given index
+	template <typename S>
+	RayT<S> to_copy_space(const RayT<S> &ray, glm::uvec3 index) const;
+};
+
+// Scalar type of the brute-force pipeline. refined traces in float and redoes
+// a pixel in double when its nearest hit is within a relative 1e-5 of the
+// next hit or of a grazed surface, the cases where float flips pixels; the
+// cost of double is only paid there.
+enum class Precision { f32, f64, refined };
+
+// "float", "double" or "refined"
+const char *to_string(Precision precision);
+
+std::optional<Precision> parse_precision(const char *name);
+
 struct Scene {
 	size_t width, height;
 	glm::vec3 bg_color;
@@ -19,11 +71,42 @@ struct Scene {
 	glm::vec3 camera_position, camera_right, camera_up, camera_forward;
 	glm::vec2 tan_fov;
 
-	std::vector<std::variant<Plane, Ellipsoid, Box>> primitives;
+	TypedVectors<PrimitiveTypes> primitives;
+	std::vector<Prototype> prototypes;
+	std::vector<Instance> instances;
+	FastPathStats fast_paths;
 
-	Ray generate_ray_to_pixel(size_t x, size_t y) const;
+	template <typename S = float>
+	RayT<S> generate_ray_to_pixel(size_t x, size_t y) const;
 
+	// brute force over every primitive of every type and every instance copy
 	glm::vec3 get_pixel_color(size_t x, size_t y) const;
+
+	// same in precision S, with the per-type loops over Scene::primitives of
+	// types outside Mask compiled out
+	template <unsigned Mask, typename S = float>
+	glm::vec3 get_pixel_color_for(size_t x, size_t y) const;
+
+	// Precision::refined variant of get_pixel_color_for
+	template <unsigned Mask>
+	glm::vec3 get_pixel_color_refined(size_t x, size_t y) const;
+
+	using PixelColorFn = glm::vec3 (Scene::*)(size_t, size_t) const;
+
+	// get_pixel_color_for<> instantiated for the types present in this scene
+	PixelColorFn specialized_pixel_color(Precision precision = Precision::f32) const;
 };
 
+// Besides NEW_PRIMITIVE blocks, the format has
+//   NEW_PROTOTYPE <name> ... END_PROTOTYPE   primitives in prototype space
+//   NEW_INSTANCE <name>                      places a prototype, takes
+//                                            POSITION, ROTATION and COLOR
+//   GRID <nx> <ny> <nz> <dx> <dy> <dz>       turns the instance into a grid
+//   RING <count> <radius>                    or into a ring around local y
 Scene read_scene(std::istream &in);
+
+// receives every classified primitive instead of Scene::primitives, so that
+// other stores can be filled without holding the whole scene twice
+using PrimitiveSink = std::function<void(const AnyPrimitive &)>;
+
+Scene read_scene(std::istream &in, const PrimitiveSink &sink);
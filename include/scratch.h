@@ -0,0 +1,11 @@
+#pragma once
+
+// Per-thread arena for a renderer's temporary buffers, one T per thread kept
+// from render to render. Buffers are cleared rather than freed, so they only
+// grow, and a thread that has rendered a scene once renders it again without
+// allocating.
+template <typename T>
+T &thread_scratch() {
+	thread_local T scratch;
+	return scratch;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "alloc_tracking.h"
+#include "perf_counters.h"
+
+using std::size_t;
+using std::uint64_t;
+
+// Hot-path counters for --stats. With the RAYTRACING_STATS build option the
+// count_* calls below increment counters of the calling thread, which are
+// summed when read; without it they are empty and compile away, so that the
+// renderers are the same code as without instrumentation.
+#ifdef RAYTRACING_STATS
+constexpr bool STATS_ENABLED = true;
+#else
+constexpr bool STATS_ENABLED = false;
+#endif
+
+struct StatCounters {
+	// slots of per-type counters, by index in PrimitiveTypes
+	static const size_t TYPE_SLOTS = 4;
+
+	uint64_t rays = 0;
+	uint64_t node_visits = 0;
+	uint64_t tests[TYPE_SLOTS] = {}, hits[TYPE_SLOTS] = {};
+
+	uint64_t total_tests() const;
+
+	uint64_t total_hits() const;
+
+	StatCounters &operator += (const StatCounters &other);
+
+	StatCounters &operator -= (const StatCounters &other);
+};
+
+// the calling thread's counters
+StatCounters &thread_stats();
+
+// sum over every thread so far, including threads that have exited
+StatCounters collect_stats();
+
+// number of threads that have counted something
+size_t stats_thread_count();
+
+inline void count_rays(uint64_t n = 1) {
+	if constexpr (STATS_ENABLED) {
+		thread_stats().rays += n;
+	}
+}
+
+inline void count_node_visit(uint64_t n = 1) {
+	if constexpr (STATS_ENABLED) {
+		thread_stats().node_visits += n;
+	}
+}
+
+inline void count_test(size_t type, bool hit) {
+	if constexpr (STATS_ENABLED) {
+		StatCounters &st = thread_stats();
+		st.tests[type]++;
+		st.hits[type] += hit;
+	}
+}
+
+inline void count_tests(size_t type, uint64_t tests, uint64_t hits) {
+	if constexpr (STATS_ENABLED) {
+		StatCounters &st = thread_stats();
+		st.tests[type] += tests;
+		st.hits[type] += hits;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// pipeline phases
+
+struct PhaseStats {
+	std::string name;
+	double seconds = 0;
+	StatCounters counters; // counted during the phase, zero if compiled out
+	PerfValues perf; // hardware counters of all threads, with --perf
+	AllocCounts allocs; // zero without allocation tracking
+	uint64_t rays = 0; // counted, or estimated by the caller without counters
+};
+
+// Wall time and counters of consecutive pipeline phases, recorded when
+// enabled; phases also go to the timeline while tracing.
+struct PhaseRecorder {
+	bool enabled = false;
+	bool perf = false; // read hardware counters, once start_perf_counters succeeded
+	std::vector<PhaseStats> phases;
+
+	std::chrono::steady_clock::time_point start;
+	StatCounters at_start;
+	PerfValues perf_at_start;
+	AllocCounts allocs_at_start;
+
+	const char *current = nullptr; // a string literal
+	uint64_t trace_begin = 0;
+
+	void begin(const char *name);
+
+	void end();
+
+	// rays of the named phases that were not counted, for per-ray figures
+	void estimate_rays(const char *name, uint64_t rays);
+
+	// one row per phase on the given stream, with per-type test names
+	void print_table(std::ostream &out, const std::vector<std::string> &type_names) const;
+
+	// hardware counters per phase, then per thread over the whole run
+	void print_perf_table(std::ostream &out) const;
+
+	void write_json(std::ostream &out, const std::vector<std::string> &type_names) const;
+};
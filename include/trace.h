@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+using std::size_t;
+using std::uint64_t;
+
+// Timeline of pipeline phases, render tiles, pool tasks and I/O for --trace.
+// Every thread appends complete events to its own ring buffer, a single
+// writer with no locks, and the buffers are exported as Chrome trace-event
+// JSON once the work is done. While tracing is off, an event costs one
+// relaxed load.
+
+struct TraceEvent {
+	const char *name, *category; // string literals
+	uint64_t begin_ns, end_ns;
+	int64_t arg;                 // -1 if none, the tile index for tiles
+};
+
+extern std::atomic<bool> tracing;
+
+void start_tracing();
+
+void stop_tracing();
+
+// nanoseconds since start_tracing
+uint64_t trace_clock();
+
+void trace_event(const char *name, const char *category, uint64_t begin_ns, uint64_t end_ns, int64_t arg = -1);
+
+// names the calling thread in the timeline
+void trace_thread_name(const char *name);
+
+// records the enclosing scope as one event
+struct TraceScope {
+	const char *name, *category;
+	int64_t arg;
+	uint64_t begin_ns;
+	bool active;
+
+	TraceScope(const char *_name, const char *_category, int64_t _arg = -1)
+		: name(_name), category(_category), arg(_arg), active(tracing.load(std::memory_order_relaxed)) {
+		begin_ns = active ? trace_clock() : 0;
+	}
+
+	TraceScope(const TraceScope &) = delete;
+
+	TraceScope &operator = (const TraceScope &) = delete;
+
+	~TraceScope() {
+		if (active) {
+			trace_event(name, category, begin_ns, trace_clock(), arg);
+		}
+	}
+};
+
+// traceEvents of every thread, with thread names as metadata events
+void write_chrome_trace(std::ostream &out);
+
+// per thread: time inside tiles and idle time during the render phases,
+// then the longest tile and the tail from the first thread running out of
+// tiles to the last tile finishing
+void print_trace_summary(std::ostream &out);
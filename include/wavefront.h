@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+
+#include "accel.h"
+#include "image.h"
+#include "scene.h"
+
+using std::size_t;
+
+struct WavefrontStats {
+	size_t batches = 0, rounds = 0;
+	size_t work_items[PrimitiveTypes::size] = {}; // per primitive type
+};
+
+// Traces primary rays in batches instead of one pixel at a time. Each round,
+// every unfinished ray of the batch walks the root BVH until it reaches a
+// leaf and appends a (ray, primitive) work item per leaf primitive to the
+// queue of the primitive's type; the queues are then intersected with the
+// SIMD kernels of active_kernels(), fast-path and general items gathered in
+// separate batches, and the rays resume from their saved traversal stacks
+// with the closer hits. Planes are queued for every ray in the first round,
+// instances are traced per ray afterwards. A queue that fills up is
+// intersected right away, so the per-thread buffers have a fixed size and
+// batches run in a NoAllocScope. Batches are spread over the thread pool, one
+// wavefront and one set of buffers per thread. Only binary root BVHs are
+// streamed, other hierarchies fall back to render_scene.
+Image render_scene_wavefront(const Scene &scene, const TwoLevelBVH &accel, WavefrontStats &stats);
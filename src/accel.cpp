@@ -0,0 +1,460 @@
+#include "accel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include <glm/gtc/constants.hpp>
+
+#include "trace.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// hierarchy
+
+void Hierarchy::build(const std::vector<AABB> &bounds, const BvhOptions &options) {
+	TraceScope scope("hierarchy", "build");
+
+	if (options.grid) {
+		kind = HierarchyKind::grid;
+		grid.build(bounds);
+		return;
+	}
+
+	if (options.lazy) {
+		kind = HierarchyKind::lazy;
+		lazy.build(bounds);
+		return;
+	}
+
+	binary.build(bounds, options.builder);
+	binary.reorder(options.layout);
+	sah = binary.sah_cost();
+
+	kind = HierarchyKind::binary;
+	if (options.wide) {
+		kind = HierarchyKind::wide;
+		wide.build(binary);
+		binary = BVH();
+	}
+}
+
+bool Hierarchy::empty() const {
+	switch (kind) {
+	case HierarchyKind::binary: return binary.empty();
+	case HierarchyKind::wide:   return wide.empty();
+	case HierarchyKind::lazy:   return lazy.empty();
+	case HierarchyKind::grid:   return grid.empty();
+	}
+
+	return true;
+}
+
+AABB Hierarchy::bounds() const {
+	switch (kind) {
+	case HierarchyKind::binary: return binary.bounds();
+	case HierarchyKind::wide:   return wide.bounds();
+	case HierarchyKind::lazy:   return lazy.bounds();
+	case HierarchyKind::grid:   return grid.bounds();
+	}
+
+	return AABB();
+}
+
+size_t Hierarchy::node_count() const {
+	switch (kind) {
+	case HierarchyKind::binary: return binary.nodes.size();
+	case HierarchyKind::wide:   return wide.nodes.size();
+	case HierarchyKind::lazy:   return lazy.node_count();
+	case HierarchyKind::grid:   return grid.cell_count();
+	}
+
+	return 0;
+}
+
+size_t Hierarchy::node_bytes() const {
+	switch (kind) {
+	case HierarchyKind::binary: return binary.nodes.size() * sizeof(BVHNode);
+	case HierarchyKind::wide:   return wide.nodes.size() * sizeof(BVH8Node);
+	case HierarchyKind::lazy:   return lazy.node_count() * sizeof(LazyNode);
+	case HierarchyKind::grid:   return grid.bytes();
+	}
+
+	return 0;
+}
+
+std::vector<uint32_t> *Hierarchy::leaf_items() {
+	switch (kind) {
+	case HierarchyKind::binary: return &binary.items;
+	case HierarchyKind::wide:   return &wide.items;
+	default:                    return nullptr;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// bottom level
+
+const uint32_t REF_INDEX_MASK = (1u << 30) - 1;
+
+void Blas::build(const TypedVectors<PrimitiveTypes> &_primitives, const BvhOptions &options) {
+	primitives = &_primitives;
+	refs.clear();
+
+	std::vector<AABB> bounds;
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr (is_bounded_v<T>) {
+			const auto &list = primitives->get<T>();
+			for (size_t i = 0; i < list.size(); i++) {
+				refs.push_back((uint32_t)type_index_v<T, PrimitiveTypes> << 30 | (uint32_t)i);
+				bounds.push_back(list[i].bounds());
+			}
+		}
+	});
+
+	bvh.build(bounds, options);
+
+	if (options.layout != BvhLayout::build_order && bvh.leaf_items()) {
+		pack();
+	}
+}
+
+void Blas::pack() {
+	std::vector<uint32_t> &items = *bvh.leaf_items();
+
+	packed = TypedVectors<PrimitiveTypes>();
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr (!is_bounded_v<T>) {
+			packed.get<T>() = primitives->get<T>();
+		}
+	});
+
+	// items become the identity, refs follow them into the packed lists
+	std::vector<uint32_t> packed_refs(items.size());
+	for (size_t i = 0; i < items.size(); i++) {
+		uint32_t ref = refs[items[i]];
+
+		visit_type_index(PrimitiveTypes{}, ref >> 30, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+
+			auto &list = packed.get<T>();
+			packed_refs[i] = (ref & ~REF_INDEX_MASK) | (uint32_t)list.size();
+			list.push_back(primitives->get<T>()[ref & REF_INDEX_MASK]);
+		});
+
+		items[i] = i;
+	}
+
+	refs.swap(packed_refs);
+	primitives = &packed;
+}
+
+bool Blas::has_unbounded() const {
+	bool result = false;
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr (!is_bounded_v<T>) {
+			result = result || !primitives->get<T>().empty();
+		}
+	});
+
+	return result;
+}
+
+AABB Blas::bounds() const {
+	return bvh.bounds();
+}
+
+void Blas::intersect_unbounded(const Ray &ray, Hit &best) const {
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr (!is_bounded_v<T>) {
+			for (const T &pr : primitives->get<T>()) {
+				auto t = intersect_t(pr, ray);
+				if (t.has_value() && t.value() < best.t) {
+					best.t = t.value();
+					best.color = pr.color;
+				}
+			}
+		}
+	});
+}
+
+void Blas::intersect(const Ray &ray, Hit &best) const {
+	intersect_unbounded(ray, best);
+
+	bvh.traverse(RayInv(ray.o, ray.d), best.t, [&](uint32_t item, float &t_max) {
+		uint32_t ref = refs[item];
+
+		visit_type_index(PrimitiveTypes{}, ref >> 30, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+
+			if constexpr (is_bounded_v<T>) {
+				const T &pr = primitives->get<T>()[ref & REF_INDEX_MASK];
+
+				auto t = intersect_t(pr, ray);
+				if (t.has_value() && t.value() < t_max) {
+					t_max = t.value();
+					best.color = pr.color;
+				}
+			}
+		});
+	});
+}
+
+void Blas::intersect_item(uint32_t item, RayPacket &packet, size_t i) const {
+	uint32_t ref = refs[item];
+
+	visit_type_index(PrimitiveTypes{}, ref >> 30, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr (is_bounded_v<T>) {
+			const T &pr = primitives->get<T>()[ref & REF_INDEX_MASK];
+
+			auto t = intersect_t(pr, packet.ray(i));
+			if (t.has_value() && t.value() < packet.t[i]) {
+				packet.t[i] = t.value();
+				packet.color[i] = pr.color;
+			}
+		}
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// copy ranges of instance arrays
+
+namespace {
+
+const size_t COPIES_PER_LEAF = 2;
+
+// half-open per-axis range of copy indices, only x is used by rings
+struct CopyRange {
+	glm::uvec3 lo, hi;
+
+	size_t size() const {
+		glm::uvec3 n = hi - lo;
+		return (size_t)n.x * n.y * n.z;
+	}
+};
+
+AABB ring_arc_bounds(float radius, float angle_lo, float angle_hi) {
+	AABB result;
+	auto add = [&](float angle) {
+		result.extend(glm::vec3(radius * std::cos(angle), 0.f, radius * std::sin(angle)));
+	};
+
+	add(angle_lo);
+	add(angle_hi);
+	for (int k = 0; k <= 4; k++) {
+		float angle = k * glm::half_pi<float>();
+		if (angle_lo < angle && angle < angle_hi) {
+			add(angle);
+		}
+	}
+
+	return result;
+}
+
+AABB range_bounds(const Instance &inst, const AABB &proto, const CopyRange &range) {
+	if (inst.layout == InstanceLayout::grid) {
+		glm::vec3 a = inst.spacing * glm::vec3(range.lo);
+		glm::vec3 b = inst.spacing * glm::vec3(range.hi - 1u);
+
+		return { proto.lo + glm::min(a, b), proto.hi + glm::max(a, b) };
+	}
+
+	// copies turn around y, bound the prototype by a sphere about its origin
+	float step = 2 * glm::pi<float>() / inst.counts.x;
+	AABB arc = ring_arc_bounds(inst.radius, step * range.lo.x, step * (range.hi.x - 1));
+	float r = glm::length(glm::max(glm::abs(proto.lo), glm::abs(proto.hi)));
+
+	return { arc.lo - r, arc.hi + r };
+}
+
+void intersect_copies(
+	const Instance &inst, const Blas &blas, const Ray &ray, const RayInv &ray_inv,
+	const CopyRange &range, Hit &best
+) {
+	const float INF = std::numeric_limits<float>::infinity();
+
+	if (slab_entry(range_bounds(inst, blas.bounds(), range), ray_inv, best.t) == INF) {
+		return;
+	}
+
+	if (range.size() <= COPIES_PER_LEAF) {
+		for (unsigned z = range.lo.z; z < range.hi.z; z++) {
+			for (unsigned y = range.lo.y; y < range.hi.y; y++) {
+				for (unsigned x = range.lo.x; x < range.hi.x; x++) {
+					blas.intersect(inst.to_copy_space(ray, glm::uvec3(x, y, z)), best);
+				}
+			}
+		}
+
+		return;
+	}
+
+	glm::uvec3 n = range.hi - range.lo;
+	int axis = n.x >= n.y ? (n.x >= n.z ? 0 : 2) : (n.y >= n.z ? 1 : 2);
+	unsigned mid = range.lo[axis] + n[axis] / 2;
+
+	CopyRange first = range, second = range;
+	first.hi[axis] = mid;
+	second.lo[axis] = mid;
+
+	if (inst.layout == InstanceLayout::grid && inst.spacing[axis] * ray.d[axis] < 0) {
+		std::swap(first, second);
+	}
+
+	intersect_copies(inst, blas, ray, ray_inv, first, best);
+	intersect_copies(inst, blas, ray, ray_inv, second, best);
+}
+
+}
+
+AABB instance_local_bounds(const Instance &inst, const AABB &prototype_bounds) {
+	return range_bounds(inst, prototype_bounds, { glm::uvec3(0, 0, 0), inst.counts });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// top level
+
+TwoLevelBVH::TwoLevelBVH(const Scene &_scene, const BvhOptions &options) : scene(_scene), prototypes(_scene.prototypes.size()) {
+	auto start = std::chrono::steady_clock::now();
+
+	root.build(scene.primitives, options);
+
+	for (size_t i = 0; i < prototypes.size(); i++) {
+		prototypes[i].build(scene.prototypes[i].primitives, options);
+	}
+
+	std::vector<AABB> bounds;
+	for (size_t i = 0; i < scene.instances.size(); i++) {
+		const Instance &inst = scene.instances[i];
+		const Blas &blas = prototypes[inst.prototype];
+
+		if (blas.has_unbounded()) {
+			unbounded.push_back(i);
+		} else if (!blas.bvh.empty()) {
+			AABB local = instance_local_bounds(inst, blas.bounds());
+			bounds.push_back(local.transformed(inst.rotation, inst.position));
+			top_instances.push_back(i);
+		}
+	}
+
+	top.build(bounds, options);
+
+	build_stats.options = options;
+	build_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	build_stats.nodes = node_count();
+	build_stats.node_bytes = node_bytes();
+	build_stats.root_sah_cost = root.bvh.sah;
+	build_stats.top_sah_cost = top.sah;
+}
+
+size_t TwoLevelBVH::node_count() const {
+	size_t result = root.bvh.node_count() + top.node_count();
+	for (const Blas &blas : prototypes) {
+		result += blas.bvh.node_count();
+	}
+
+	return result;
+}
+
+size_t TwoLevelBVH::node_bytes() const {
+	size_t result = root.bvh.node_bytes() + top.node_bytes();
+	for (const Blas &blas : prototypes) {
+		result += blas.bvh.node_bytes();
+	}
+
+	return result;
+}
+
+void TwoLevelBVH::intersect_instance(const Instance &inst, const Ray &ray, Hit &best) const {
+	const Blas &blas = prototypes[inst.prototype];
+	Ray local = (ray - inst.position).rotate(glm::conjugate(inst.rotation));
+	float before = best.t;
+
+	if (blas.has_unbounded()) {
+		for (size_t i = 0; i < inst.copies(); i++) {
+			blas.intersect(inst.to_copy_space(local, inst.copy_index(i)), best);
+		}
+	} else {
+		CopyRange all { glm::uvec3(0, 0, 0), inst.counts };
+		intersect_copies(inst, blas, local, RayInv(local.o, local.d), all, best);
+	}
+
+	if (inst.color.has_value() && best.t < before) {
+		best.color = inst.color.value();
+	}
+}
+
+void TwoLevelBVH::intersect(const Ray &ray, Hit &best) const {
+	root.intersect(ray, best);
+	intersect_instances(ray, best);
+}
+
+void TwoLevelBVH::intersect_instances(const Ray &ray, Hit &best) const {
+	for (uint32_t i : unbounded) {
+		intersect_instance(scene.instances[i], ray, best);
+	}
+
+	top.traverse(RayInv(ray.o, ray.d), best.t, [&](uint32_t item, float &) {
+		intersect_instance(scene.instances[top_instances[item]], ray, best);
+	});
+}
+
+std::optional<Hit> TwoLevelBVH::closest_hit(const Ray &ray) const {
+	Hit best;
+	intersect(ray, best);
+
+	if (best.t == std::numeric_limits<float>::infinity()) {
+		return {};
+	}
+
+	return best;
+}
+
+void TwoLevelBVH::closest_hits(RayPacket &packet) const {
+	if (root.bvh.kind != HierarchyKind::binary || top.kind != HierarchyKind::binary) {
+		for (size_t i = 0; i < packet.size; i++) {
+			auto hit = closest_hit(packet.ray(i));
+			if (hit.has_value()) {
+				packet.t[i] = hit.value().t;
+				packet.color[i] = hit.value().color;
+			}
+		}
+
+		return;
+	}
+
+	for (size_t i = 0; i < packet.size; i++) {
+		Hit best;
+		Ray ray = packet.ray(i);
+
+		root.intersect_unbounded(ray, best);
+		for (uint32_t k : unbounded) {
+			intersect_instance(scene.instances[k], ray, best);
+		}
+
+		packet.t[i] = best.t;
+		packet.color[i] = best.color;
+	}
+
+	packet.finish();
+
+	traverse_packet(root.bvh.binary, packet, [&](uint32_t item, size_t i) {
+		root.intersect_item(item, packet, i);
+	});
+
+	traverse_packet(top.binary, packet, [&](uint32_t item, size_t i) {
+		Hit best { packet.t[i], packet.color[i] };
+		intersect_instance(scene.instances[top_instances[item]], packet.ray(i), best);
+
+		packet.t[i] = best.t;
+		packet.color[i] = best.color;
+	});
+}
@@ -0,0 +1,150 @@
+#include "alloc_tracking.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef RAYTRACING_ALLOC_TRACKING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+AllocCounts &AllocCounts::operator += (const AllocCounts &other) {
+	allocations += other.allocations;
+	bytes += other.bytes;
+	frees += other.frees;
+	maps += other.maps;
+	mapped_bytes += other.mapped_bytes;
+	forbidden += other.forbidden;
+
+	return *this;
+}
+
+AllocCounts &AllocCounts::operator -= (const AllocCounts &other) {
+	allocations -= other.allocations;
+	bytes -= other.bytes;
+	frees -= other.frees;
+	maps -= other.maps;
+	mapped_bytes -= other.mapped_bytes;
+	forbidden -= other.forbidden;
+
+	return *this;
+}
+
+thread_local int alloc_tracking::no_alloc_depth = 0;
+
+namespace {
+
+// plain atomics rather than per-thread counters, the hooks must not
+// allocate and run before any thread_local could be constructed
+struct AtomicCounts {
+	std::atomic<uint64_t> allocations { 0 }, bytes { 0 }, frees { 0 };
+	std::atomic<uint64_t> maps { 0 }, mapped_bytes { 0 };
+	std::atomic<uint64_t> forbidden { 0 };
+	std::atomic<size_t> first_forbidden { 0 };
+};
+
+// constant-initialized, usable from allocations of static constructors
+AtomicCounts counts;
+
+[[maybe_unused]] void check_scope(size_t size) {
+	if (alloc_tracking::no_alloc_depth > 0) {
+		counts.forbidden.fetch_add(1, std::memory_order_relaxed);
+
+		size_t none = 0;
+		counts.first_forbidden.compare_exchange_strong(none, size, std::memory_order_relaxed);
+	}
+}
+
+}
+
+AllocCounts collect_allocations() {
+	AllocCounts result;
+	result.allocations = counts.allocations.load(std::memory_order_relaxed);
+	result.bytes = counts.bytes.load(std::memory_order_relaxed);
+	result.frees = counts.frees.load(std::memory_order_relaxed);
+	result.maps = counts.maps.load(std::memory_order_relaxed);
+	result.mapped_bytes = counts.mapped_bytes.load(std::memory_order_relaxed);
+	result.forbidden = counts.forbidden.load(std::memory_order_relaxed);
+
+	return result;
+}
+
+size_t first_forbidden_allocation() {
+	return counts.first_forbidden.load(std::memory_order_relaxed);
+}
+
+#ifdef RAYTRACING_ALLOC_TRACKING
+
+///////////////////////////////////////////////////////////////////////////////
+// hooks
+
+namespace {
+
+void *tracked_alloc(size_t size, size_t alignment) {
+	counts.allocations.fetch_add(1, std::memory_order_relaxed);
+	counts.bytes.fetch_add(size, std::memory_order_relaxed);
+	check_scope(size);
+
+	size = size > 0 ? size : 1;
+	if (alignment <= alignof(std::max_align_t)) {
+		return std::malloc(size);
+	}
+
+	// aligned_alloc wants a multiple of the alignment
+	return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void tracked_free(void *p) {
+	if (p) {
+		counts.frees.fetch_add(1, std::memory_order_relaxed);
+		std::free(p);
+	}
+}
+
+void *tracked_new(size_t size, size_t alignment) {
+	void *p = tracked_alloc(size, alignment);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+
+	return p;
+}
+
+}
+
+void *operator new(size_t size) { return tracked_new(size, 0); }
+void *operator new[](size_t size) { return tracked_new(size, 0); }
+void *operator new(size_t size, std::align_val_t al) { return tracked_new(size, (size_t)al); }
+void *operator new[](size_t size, std::align_val_t al) { return tracked_new(size, (size_t)al); }
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept { return tracked_alloc(size, 0); }
+void *operator new[](size_t size, const std::nothrow_t&) noexcept { return tracked_alloc(size, 0); }
+void *operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return tracked_alloc(size, (size_t)al); }
+void *operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return tracked_alloc(size, (size_t)al); }
+
+void operator delete(void *p) noexcept { tracked_free(p); }
+void operator delete[](void *p) noexcept { tracked_free(p); }
+void operator delete(void *p, size_t) noexcept { tracked_free(p); }
+void operator delete[](void *p, size_t) noexcept { tracked_free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete(void *p, const std::nothrow_t&) noexcept { tracked_free(p); }
+void operator delete[](void *p, const std::nothrow_t&) noexcept { tracked_free(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t&) noexcept { tracked_free(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t&) noexcept { tracked_free(p); }
+
+// interposes the C library's mmap for the program's own calls, malloc's
+// internal maps are already counted as allocations
+extern "C" void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	counts.maps.fetch_add(1, std::memory_order_relaxed);
+	counts.mapped_bytes.fetch_add(length, std::memory_order_relaxed);
+	check_scope(length);
+
+	return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+#endif
@@ -0,0 +1,546 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+
+#include "parallel.h"
+
+const float SAH_TRAVERSAL_COST = 1.f;
+const float SAH_INTERSECTION_COST = 1.f;
+
+namespace {
+
+// ranges at least this big are binned / split with parallel tasks
+const uint32_t PARALLEL_RANGE = 1 << 15;
+const uint32_t TASK_RANGE = 1 << 12;
+
+const int SAH_BINS = 16;
+
+int largest_axis(glm::vec3 extent) {
+	return extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+}
+
+// state shared by all builders; nodes are preallocated for the worst case and
+// handed out in sibling pairs so that subtrees can be built concurrently
+struct Builder {
+	BVH &bvh;
+	const std::vector<AABB> &bounds;
+	std::vector<glm::vec3> centroids;
+	std::atomic<uint32_t> node_count { 1 };
+
+	Builder(BVH &_bvh, const std::vector<AABB> &_bounds) : bvh(_bvh), bounds(_bounds) {
+		size_t n = bounds.size();
+
+		bvh.items.resize(n);
+		std::iota(bvh.items.begin(), bvh.items.end(), 0);
+		bvh.nodes.assign(std::max<size_t>(2 * n, 1), {});
+
+		centroids.resize(n);
+		parallel_for(0, n, PARALLEL_RANGE, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				centroids[i] = bounds[i].center();
+			}
+		});
+	}
+
+	void finish() {
+		bvh.nodes.resize(node_count);
+	}
+
+	uint32_t alloc_pair() {
+		return node_count.fetch_add(2);
+	}
+
+	// node and centroid bounds of items [begin, end)
+	std::pair<AABB, AABB> range_bounds(uint32_t begin, uint32_t end) const {
+		std::mutex mutex;
+		AABB node_bounds, centroid_bounds;
+
+		parallel_for(begin, end, PARALLEL_RANGE, [&](size_t b, size_t e) {
+			AABB nb, cb;
+			for (size_t i = b; i < e; i++) {
+				nb.extend(bounds[bvh.items[i]]);
+				cb.extend(centroids[bvh.items[i]]);
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			node_bounds.extend(nb);
+			centroid_bounds.extend(cb);
+		});
+
+		return { node_bounds, centroid_bounds };
+	}
+
+	void make_leaf(uint32_t node, uint32_t begin, uint32_t end) {
+		bvh.nodes[node].left_first = begin;
+		bvh.nodes[node].count = end - begin;
+	}
+
+	uint32_t median_split(uint32_t begin, uint32_t end, int axis) {
+		uint32_t mid = begin + (end - begin) / 2;
+		std::nth_element(
+			bvh.items.begin() + begin, bvh.items.begin() + mid, bvh.items.begin() + end,
+			[&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; }
+		);
+
+		return mid;
+	}
+
+	// builds both children of node, the first one as a task for big ranges
+	template <typename BuildChild>
+	void split(uint32_t node, uint32_t begin, uint32_t mid, uint32_t end, uint32_t depth, BuildChild &&build_child) {
+		uint32_t left = alloc_pair();
+		bvh.nodes[node].left_first = left;
+		bvh.nodes[node].count = 0;
+
+		if (end - begin >= TASK_RANGE) {
+			TaskGroup group(thread_pool());
+			group.spawn([&]() { build_child(left, begin, mid, depth + 1); });
+			build_child(left + 1, mid, end, depth + 1);
+			group.wait();
+		} else {
+			build_child(left, begin, mid, depth + 1);
+			build_child(left + 1, mid, end, depth + 1);
+		}
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// object median
+
+void build_median(Builder &b, uint32_t node, uint32_t begin, uint32_t end, uint32_t depth) {
+	auto [node_bounds, centroid_bounds] = b.range_bounds(begin, end);
+	b.bvh.nodes[node].bounds = node_bounds;
+
+	glm::vec3 extent = centroid_bounds.hi - centroid_bounds.lo;
+	int axis = largest_axis(extent);
+
+	if (end - begin <= BVH::MAX_LEAF_SIZE || depth >= BVH::MAX_DEPTH || extent[axis] <= 0) {
+		b.make_leaf(node, begin, end);
+		return;
+	}
+
+	uint32_t mid = b.median_split(begin, end, axis);
+	uint32_t left = b.alloc_pair();
+	b.bvh.nodes[node].left_first = left;
+	b.bvh.nodes[node].count = 0;
+
+	build_median(b, left, begin, mid, depth + 1);
+	build_median(b, left + 1, mid, end, depth + 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// binned SAH
+
+struct Bin {
+	AABB bounds;
+	uint32_t count = 0;
+};
+
+void build_sah(Builder &b, uint32_t node, uint32_t begin, uint32_t end, uint32_t depth) {
+	auto [node_bounds, centroid_bounds] = b.range_bounds(begin, end);
+	b.bvh.nodes[node].bounds = node_bounds;
+
+	uint32_t n = end - begin;
+	glm::vec3 extent = centroid_bounds.hi - centroid_bounds.lo;
+
+	if (n <= BVH::MAX_LEAF_SIZE || depth >= BVH::MAX_DEPTH || extent[largest_axis(extent)] <= 0) {
+		b.make_leaf(node, begin, end);
+		return;
+	}
+
+	glm::vec3 scale = glm::vec3(SAH_BINS) / glm::max(extent, glm::vec3(1e-30f));
+	auto bin_of = [&](uint32_t item, int axis) {
+		int bin = (int)((b.centroids[item][axis] - centroid_bounds.lo[axis]) * scale[axis]);
+		return std::min(bin, SAH_BINS - 1);
+	};
+
+	Bin bins[3][SAH_BINS];
+	std::mutex mutex;
+	parallel_for(begin, end, PARALLEL_RANGE, [&](size_t cb, size_t ce) {
+		Bin local[3][SAH_BINS];
+		for (size_t i = cb; i < ce; i++) {
+			uint32_t item = b.bvh.items[i];
+			for (int axis = 0; axis < 3; axis++) {
+				Bin &bin = local[axis][bin_of(item, axis)];
+				bin.bounds.extend(b.bounds[item]);
+				bin.count++;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int axis = 0; axis < 3; axis++) {
+			for (int i = 0; i < SAH_BINS; i++) {
+				bins[axis][i].bounds.extend(local[axis][i].bounds);
+				bins[axis][i].count += local[axis][i].count;
+			}
+		}
+	});
+
+	// cost of splitting after bin i, relative to the node surface area
+	float best_cost = std::numeric_limits<float>::infinity();
+	int best_axis = -1, best_split = -1;
+	for (int axis = 0; axis < 3; axis++) {
+		float right_cost[SAH_BINS];
+		AABB right;
+		uint32_t right_count = 0;
+		for (int i = SAH_BINS - 1; i > 0; i--) {
+			right.extend(bins[axis][i].bounds);
+			right_count += bins[axis][i].count;
+			right_cost[i] = right.surface_area() * right_count;
+		}
+
+		AABB left;
+		uint32_t left_count = 0;
+		for (int i = 0; i < SAH_BINS - 1; i++) {
+			left.extend(bins[axis][i].bounds);
+			left_count += bins[axis][i].count;
+
+			float cost = left.surface_area() * left_count + right_cost[i + 1];
+			if (left_count > 0 && left_count < n && cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i;
+			}
+		}
+	}
+
+	float area = node_bounds.surface_area();
+	float split_cost = SAH_TRAVERSAL_COST * area + SAH_INTERSECTION_COST * best_cost;
+	float leaf_cost = SAH_INTERSECTION_COST * area * n;
+
+	if (n <= BVH::MAX_SAH_LEAF_SIZE && split_cost >= leaf_cost) {
+		b.make_leaf(node, begin, end);
+		return;
+	}
+
+	uint32_t mid;
+	if (best_axis < 0) {
+		mid = b.median_split(begin, end, largest_axis(extent));
+	} else {
+		auto it = std::partition(b.bvh.items.begin() + begin, b.bvh.items.begin() + end, [&](uint32_t item) {
+			return bin_of(item, best_axis) <= best_split;
+		});
+		mid = it - b.bvh.items.begin();
+	}
+
+	b.split(node, begin, mid, end, depth, [&](uint32_t child, uint32_t cb, uint32_t ce, uint32_t cd) {
+		build_sah(b, child, cb, ce, cd);
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// linear BVH
+
+// spreads the low 21 bits of v to every third bit
+uint64_t spread_bits(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8)  & 0x100f00f00f00f00full;
+	v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2)  & 0x1249249249249249ull;
+	return v;
+}
+
+struct LbvhBuilder {
+	Builder &b;
+	std::vector<uint64_t> codes;
+
+	// splits at the highest bit in which the first and last code differ
+	void build(uint32_t node, uint32_t begin, uint32_t end, uint32_t depth) {
+		uint64_t first = codes[begin], last = codes[end - 1];
+
+		if (end - begin <= BVH::MAX_LEAF_SIZE || depth >= BVH::MAX_DEPTH) {
+			AABB node_bounds;
+			for (uint32_t i = begin; i < end; i++) {
+				node_bounds.extend(b.bounds[b.bvh.items[i]]);
+			}
+
+			b.bvh.nodes[node].bounds = node_bounds;
+			b.make_leaf(node, begin, end);
+			return;
+		}
+
+		uint32_t mid;
+		if (first == last) {
+			mid = begin + (end - begin) / 2;
+		} else {
+			uint64_t bit = 1ull << (63 - __builtin_clzll(first ^ last));
+			mid = std::partition_point(codes.begin() + begin, codes.begin() + end, [&](uint64_t code) {
+				return (code & bit) == 0;
+			}) - codes.begin();
+		}
+
+		b.split(node, begin, mid, end, depth, [&](uint32_t child, uint32_t cb, uint32_t ce, uint32_t cd) {
+			build(child, cb, ce, cd);
+		});
+
+		uint32_t left = b.bvh.nodes[node].left_first;
+		AABB node_bounds = b.bvh.nodes[left].bounds;
+		node_bounds.extend(b.bvh.nodes[left + 1].bounds);
+		b.bvh.nodes[node].bounds = node_bounds;
+	}
+};
+
+void build_lbvh(Builder &b) {
+	uint32_t n = b.bounds.size();
+	AABB centroid_bounds = b.range_bounds(0, n).second;
+	glm::vec3 scale = glm::vec3((1 << 21) - 1) / glm::max(centroid_bounds.hi - centroid_bounds.lo, glm::vec3(1e-30f));
+
+	LbvhBuilder lbvh { b, std::vector<uint64_t>(n) };
+	parallel_for(0, n, PARALLEL_RANGE, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			glm::uvec3 q = glm::uvec3((b.centroids[i] - centroid_bounds.lo) * scale);
+			lbvh.codes[i] = spread_bits(q.x) << 2 | spread_bits(q.y) << 1 | spread_bits(q.z);
+		}
+	});
+
+	parallel_radix_sort(lbvh.codes, b.bvh.items);
+	lbvh.build(0, 0, n, 0);
+}
+
+}
+
+const char *to_string(BvhBuilder builder) {
+	switch (builder) {
+	case BvhBuilder::median:     return "median";
+	case BvhBuilder::binned_sah: return "sah";
+	case BvhBuilder::lbvh:       return "lbvh";
+	}
+
+	return "?";
+}
+
+void BVH::build(const std::vector<AABB> &bounds, BvhBuilder builder) {
+	nodes.clear();
+	items.clear();
+
+	if (bounds.empty()) {
+		return;
+	}
+
+	Builder b(*this, bounds);
+
+	switch (builder) {
+	case BvhBuilder::median:
+		build_median(b, 0, 0, bounds.size(), 0);
+		break;
+
+	case BvhBuilder::binned_sah:
+		build_sah(b, 0, 0, bounds.size(), 0);
+		break;
+
+	case BvhBuilder::lbvh:
+		build_lbvh(b);
+		break;
+	}
+
+	b.finish();
+}
+
+float BVH::sah_cost() const {
+	if (empty() || nodes[0].bounds.surface_area() <= 0) {
+		return 0;
+	}
+
+	float cost = 0;
+	for (const BVHNode &node : nodes) {
+		float area = node.bounds.surface_area();
+		cost += node.is_leaf() ? SAH_INTERSECTION_COST * area * node.count : SAH_TRAVERSAL_COST * area;
+	}
+
+	return cost / nodes[0].bounds.surface_area();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// layout
+
+const char *to_string(BvhLayout layout) {
+	switch (layout) {
+	case BvhLayout::build_order:   return "build";
+	case BvhLayout::depth_first:   return "dfs";
+	case BvhLayout::breadth_first: return "bfs";
+	case BvhLayout::van_emde_boas: return "veb";
+	case BvhLayout::treelets:      return "treelets";
+	}
+
+	return "?";
+}
+
+std::optional<BvhLayout> parse_bvh_layout(const char *name) {
+	for (BvhLayout layout : { BvhLayout::build_order, BvhLayout::depth_first, BvhLayout::breadth_first, BvhLayout::van_emde_boas, BvhLayout::treelets }) {
+		if (std::strcmp(name, to_string(layout)) == 0) {
+			return layout;
+		}
+	}
+
+	return {};
+}
+
+namespace {
+
+// sibling pairs per page-sized treelet
+const size_t TREELET_PAIRS = 4096 / (2 * sizeof(BVHNode));
+
+// Layouts order sibling pairs, named by the index of their left node; the
+// root is alone and stays at index 0.
+struct PairLayout {
+	const BVH &bvh;
+	std::vector<uint32_t> order;
+
+	// child pairs of the pair starting at p
+	void child_pairs(uint32_t p, std::vector<uint32_t> &out) const {
+		for (uint32_t node : { p, p + 1 }) {
+			if (!bvh.nodes[node].is_leaf()) {
+				out.push_back(bvh.nodes[node].left_first);
+			}
+		}
+	}
+
+	float pair_area(uint32_t p) const {
+		return bvh.nodes[p].bounds.surface_area() + bvh.nodes[p + 1].bounds.surface_area();
+	}
+
+	void depth_first(uint32_t p) {
+		order.push_back(p);
+
+		std::vector<uint32_t> children;
+		child_pairs(p, children);
+		for (uint32_t c : children) {
+			depth_first(c);
+		}
+	}
+
+	void breadth_first(uint32_t root) {
+		order.push_back(root);
+		for (size_t i = 0; i < order.size(); i++) {
+			child_pairs(order[i], order);
+		}
+	}
+
+	uint32_t height(uint32_t p) const {
+		std::vector<uint32_t> children;
+		child_pairs(p, children);
+
+		uint32_t h = 0;
+		for (uint32_t c : children) {
+			h = std::max(h, height(c));
+		}
+
+		return h + 1;
+	}
+
+	// pairs exactly `depth` levels below p
+	void pairs_at_depth(uint32_t p, uint32_t depth, std::vector<uint32_t> &out) const {
+		if (depth == 0) {
+			out.push_back(p);
+			return;
+		}
+
+		std::vector<uint32_t> children;
+		child_pairs(p, children);
+		for (uint32_t c : children) {
+			pairs_at_depth(c, depth - 1, out);
+		}
+	}
+
+	// lays out the pairs less than h levels below p
+	void van_emde_boas(uint32_t p, uint32_t h) {
+		if (h == 1) {
+			order.push_back(p);
+			return;
+		}
+
+		uint32_t top = h / 2;
+		van_emde_boas(p, top);
+
+		std::vector<uint32_t> bottoms;
+		pairs_at_depth(p, top, bottoms);
+		for (uint32_t q : bottoms) {
+			van_emde_boas(q, h - top);
+		}
+	}
+
+	// grows each treelet from its root by the largest surface area, which is
+	// proportional to the chance that a ray reaching the root visits a pair;
+	// the leftover frontier seeds the next treelets
+	void treelets(uint32_t root) {
+		std::vector<uint32_t> roots { root };
+
+		for (size_t r = 0; r < roots.size(); r++) {
+			std::vector<uint32_t> frontier { roots[r] };
+
+			for (size_t taken = 0; taken < TREELET_PAIRS && !frontier.empty(); taken++) {
+				auto best = std::max_element(frontier.begin(), frontier.end(), [&](uint32_t a, uint32_t b) {
+					return pair_area(a) < pair_area(b);
+				});
+
+				uint32_t p = *best;
+				frontier.erase(best);
+
+				order.push_back(p);
+				child_pairs(p, frontier);
+			}
+
+			std::sort(frontier.begin(), frontier.end(), [&](uint32_t a, uint32_t b) {
+				return pair_area(a) > pair_area(b);
+			});
+			roots.insert(roots.end(), frontier.begin(), frontier.end());
+		}
+	}
+};
+
+}
+
+void BVH::reorder(BvhLayout layout) {
+	if (layout == BvhLayout::build_order || empty() || nodes[0].is_leaf()) {
+		return;
+	}
+
+	PairLayout pl { *this, {} };
+	uint32_t root_pair = nodes[0].left_first;
+
+	switch (layout) {
+	case BvhLayout::depth_first:   pl.depth_first(root_pair); break;
+	case BvhLayout::breadth_first: pl.breadth_first(root_pair); break;
+	case BvhLayout::van_emde_boas: pl.van_emde_boas(root_pair, pl.height(root_pair)); break;
+	case BvhLayout::treelets:      pl.treelets(root_pair); break;
+	case BvhLayout::build_order:   break;
+	}
+
+	// root at 0, an unused node at 1, pairs from 2 on so that each pair
+	// fills exactly one cache line of the cache-line aligned array
+	std::vector<uint32_t> new_index(nodes.size());
+	for (size_t k = 0; k < pl.order.size(); k++) {
+		new_index[pl.order[k]] = 2 + 2 * k;
+		new_index[pl.order[k] + 1] = 3 + 2 * k;
+	}
+
+	std::vector<BVHNode, HugePageAllocator<BVHNode>> new_nodes(2 + 2 * pl.order.size());
+	new_nodes[0] = nodes[0];
+	new_nodes[1] = { AABB { glm::vec3(0.f), glm::vec3(0.f) }, 0, 0 }; // no area, adds no SAH cost
+	for (size_t k = 0; k < pl.order.size(); k++) {
+		new_nodes[2 + 2 * k] = nodes[pl.order[k]];
+		new_nodes[3 + 2 * k] = nodes[pl.order[k] + 1];
+	}
+
+	// leaves get their items in the new node order
+	std::vector<uint32_t> new_items;
+	new_items.reserve(items.size());
+	for (BVHNode &node : new_nodes) {
+		if (node.is_leaf()) {
+			uint32_t first = new_items.size();
+			new_items.insert(new_items.end(), items.begin() + node.left_first, items.begin() + node.left_first + node.count);
+			node.left_first = first;
+		} else if (&node != &new_nodes[1]) {
+			node.left_first = new_index[node.left_first];
+		}
+	}
+
+	nodes.swap(new_nodes);
+	items.swap(new_items);
+}
@@ -0,0 +1,233 @@
+#include "bvh8.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "kernels.h"
+
+namespace {
+
+struct Collapser {
+	const BVH &bvh;
+	BVH8 &wide;
+
+	bool oversized(const BVHNode &node) const {
+		return node.is_leaf() && node.count > BVH8::MAX_LEAF_SIZE;
+	}
+
+	// fills wide.nodes[wide_index] from the binary subtree under bin_index
+	void collapse(uint32_t bin_index, uint32_t wide_index) {
+		const BVHNode &root = bvh.nodes[bin_index];
+
+		if (oversized(root)) {
+			chain(root.left_first, root.left_first + root.count, root.bounds, wide_index);
+			return;
+		}
+
+		std::vector<uint32_t> children;
+		if (root.is_leaf()) {
+			children.push_back(bin_index);
+		} else {
+			children = { root.left_first, root.left_first + 1 };
+		}
+
+		// open the inner child with the largest area until there are 8
+		while (children.size() < 8) {
+			int best = -1;
+			float best_area = -1;
+			for (size_t i = 0; i < children.size(); i++) {
+				const BVHNode &child = bvh.nodes[children[i]];
+				if (!child.is_leaf() && child.bounds.surface_area() > best_area) {
+					best = i;
+					best_area = child.bounds.surface_area();
+				}
+			}
+
+			if (best < 0) {
+				break;
+			}
+
+			uint32_t opened = children[best];
+			children[best] = bvh.nodes[opened].left_first;
+			children.push_back(bvh.nodes[opened].left_first + 1);
+		}
+
+		std::vector<AABB> child_bounds;
+		for (uint32_t child : children) {
+			child_bounds.push_back(bvh.nodes[child].bounds);
+		}
+
+		BVH8Node node {};
+		quantize(node, root.bounds, child_bounds);
+
+		node.child_base = wide.nodes.size();
+		node.item_base = wide.items.size();
+		node.child_count = children.size();
+
+		std::vector<std::pair<uint32_t, uint32_t>> inner;
+		for (size_t i = 0; i < children.size(); i++) {
+			const BVHNode &child = bvh.nodes[children[i]];
+
+			// oversized leaves become inner children and are chained below
+			if (child.is_leaf() && !oversized(child)) {
+				node.child_offset[i] = wide.items.size() - node.item_base;
+				node.leaf_count[i] = child.count;
+				for (uint32_t j = child.left_first; j < child.left_first + child.count; j++) {
+					wide.items.push_back(bvh.items[j]);
+				}
+			} else {
+				node.inner_mask |= 1 << i;
+				node.child_offset[i] = inner.size();
+				inner.push_back({ children[i], node.child_base + inner.size() });
+			}
+		}
+
+		wide.nodes.resize(wide.nodes.size() + inner.size());
+		wide.nodes[wide_index] = node;
+
+		for (auto [bin_child, wide_child] : inner) {
+			collapse(bin_child, wide_child);
+		}
+	}
+
+	// spreads the items [begin, end) of one binary leaf over an 8-ary tree of
+	// leaves of at most MAX_LEAF_SIZE items, all with the leaf's bounds; the
+	// builders emit such leaves for coincident centroids and at MAX_DEPTH
+	void chain(uint32_t begin, uint32_t end, const AABB &bounds, uint32_t wide_index) {
+		uint32_t n = end - begin;
+		uint32_t part = n <= 8 * BVH8::MAX_LEAF_SIZE ? BVH8::MAX_LEAF_SIZE : (n + 7) / 8;
+
+		std::vector<std::pair<uint32_t, uint32_t>> parts;
+		for (uint32_t b = begin; b < end; b += part) {
+			parts.push_back({ b, std::min(b + part, end) });
+		}
+
+		BVH8Node node {};
+		quantize(node, bounds, std::vector<AABB>(parts.size(), bounds));
+
+		node.child_base = wide.nodes.size();
+		node.item_base = wide.items.size();
+		node.child_count = parts.size();
+
+		std::vector<std::pair<uint32_t, uint32_t>> inner;
+		for (size_t i = 0; i < parts.size(); i++) {
+			auto [b, e] = parts[i];
+
+			if (e - b <= BVH8::MAX_LEAF_SIZE) {
+				node.child_offset[i] = wide.items.size() - node.item_base;
+				node.leaf_count[i] = e - b;
+				wide.items.insert(wide.items.end(), bvh.items.begin() + b, bvh.items.begin() + e);
+			} else {
+				node.inner_mask |= 1 << i;
+				node.child_offset[i] = inner.size();
+				inner.push_back(parts[i]);
+			}
+		}
+
+		wide.nodes.resize(wide.nodes.size() + inner.size());
+		wide.nodes[wide_index] = node;
+
+		for (size_t j = 0; j < inner.size(); j++) {
+			chain(inner[j].first, inner[j].second, bounds, node.child_base + j);
+		}
+	}
+
+	void quantize(BVH8Node &node, const AABB &parent, const std::vector<AABB> &children) {
+		node.origin = parent.lo;
+
+		glm::vec3 step;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = parent.hi[axis] - parent.lo[axis];
+			int e = extent > 0 ? (int)std::ceil(std::log2(extent / 255)) : -126;
+			e = std::clamp(e, -126, 127);
+
+			// the top of the grid rounds, it must still reach the parent
+			while (node.origin[axis] + 255 * std::ldexp(1.f, e) < parent.hi[axis]) {
+				e++;
+			}
+
+			node.exponent[axis] = e;
+			step[axis] = std::ldexp(1.f, e);
+		}
+
+		uint8_t *lo[3] = { node.lo_x, node.lo_y, node.lo_z };
+		uint8_t *hi[3] = { node.hi_x, node.hi_y, node.hi_z };
+
+		for (size_t i = 0; i < children.size(); i++) {
+			const AABB &b = children[i];
+
+			for (int axis = 0; axis < 3; axis++) {
+				// round outwards, then fix up against the decoding arithmetic,
+				// origin + q * step with an exact product and one rounding
+				int q_lo = (int)std::floor((b.lo[axis] - node.origin[axis]) / step[axis]);
+				int q_hi = (int)std::ceil((b.hi[axis] - node.origin[axis]) / step[axis]);
+
+				q_lo = std::clamp(q_lo, 0, 255);
+				q_hi = std::clamp(q_hi, 0, 255);
+				while (q_lo > 0 && node.origin[axis] + q_lo * step[axis] > b.lo[axis]) {
+					q_lo--;
+				}
+				while (q_hi < 255 && node.origin[axis] + q_hi * step[axis] < b.hi[axis]) {
+					q_hi++;
+				}
+
+				assert(node.origin[axis] + q_lo * step[axis] <= b.lo[axis]);
+				assert(node.origin[axis] + q_hi * step[axis] >= b.hi[axis]);
+
+				lo[axis][i] = q_lo;
+				hi[axis][i] = q_hi;
+			}
+		}
+	}
+};
+
+}
+
+uint32_t bvh8_intersect_children_scalar(const BVH8Node &node, const RayInv &ray, float t_max, float *t_enter) {
+	const uint8_t *lo[3] = { node.lo_x, node.lo_y, node.lo_z };
+	const uint8_t *hi[3] = { node.hi_x, node.hi_y, node.hi_z };
+
+	// planes are decoded as quantize checked them and intersected as
+	// slab_entry does, rounding is monotonic so the quantized slabs contain
+	// the exact ones for every ray
+	float step[3];
+	for (int axis = 0; axis < 3; axis++) {
+		step[axis] = std::ldexp(1.f, node.exponent[axis]);
+	}
+
+	uint32_t mask = 0;
+	for (int i = 0; i < node.child_count; i++) {
+		float enter = 0, exit = t_max;
+		for (int axis = 0; axis < 3; axis++) {
+			float t1 = (node.origin[axis] + lo[axis][i] * step[axis] - ray.o[axis]) * ray.inv_d[axis];
+			float t2 = (node.origin[axis] + hi[axis][i] * step[axis] - ray.o[axis]) * ray.inv_d[axis];
+			enter = std::max(enter, std::min(t1, t2));
+			exit = std::min(exit, std::max(t1, t2));
+		}
+
+		if (enter <= exit) {
+			mask |= 1u << i;
+			t_enter[i] = enter;
+		}
+	}
+
+	return mask;
+}
+
+void BVH8::build(const BVH &bvh) {
+	nodes.clear();
+	items.clear();
+	root_bounds = bvh.bounds();
+
+	intersect_children = active_kernels().bvh8_children;
+
+	if (bvh.empty()) {
+		return;
+	}
+
+	items.reserve(bvh.items.size());
+	nodes.resize(1);
+
+	Collapser { bvh, *this }.collapse(0, 0);
+}
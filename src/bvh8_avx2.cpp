@@ -0,0 +1,51 @@
+// Built with -mavx2 -mfma, only reached after a runtime CPU check. Inline
+// functions from headers (glm operators included) are avoided here, their
+// AVX2 copies could otherwise be picked by the linker for other callers.
+
+#include "bvh8.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <immintrin.h>
+
+namespace {
+
+__m256 load_planes(const uint8_t *q) {
+	__m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(q));
+	return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+}
+
+}
+
+uint32_t bvh8_intersect_children_avx2(const BVH8Node &node, const RayInv &ray, float t_max, float *t_enter) {
+	const uint8_t *lo[3] = { node.lo_x, node.lo_y, node.lo_z };
+	const uint8_t *hi[3] = { node.hi_x, node.hi_y, node.hi_z };
+
+	const float *origin = &node.origin.x;
+	const float *o = &ray.o.x;
+	const float *inv_d = &ray.inv_d.x;
+
+	__m256 enter = _mm256_setzero_ps();
+	__m256 exit = _mm256_set1_ps(t_max);
+
+	// the same arithmetic as the scalar test, the fused multiply-add rounds
+	// like origin + q * step because the product is exact
+	for (int axis = 0; axis < 3; axis++) {
+		__m256 step = _mm256_set1_ps(std::ldexp(1.f, node.exponent[axis]));
+		__m256 base = _mm256_set1_ps(origin[axis]);
+		__m256 ro = _mm256_set1_ps(o[axis]);
+		__m256 inv = _mm256_set1_ps(inv_d[axis]);
+
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_fmadd_ps(load_planes(lo[axis]), step, base), ro), inv);
+		__m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_fmadd_ps(load_planes(hi[axis]), step, base), ro), inv);
+
+		enter = _mm256_max_ps(enter, _mm256_min_ps(t1, t2));
+		exit = _mm256_min_ps(exit, _mm256_max_ps(t1, t2));
+	}
+
+	_mm256_storeu_ps(t_enter, enter);
+
+	uint32_t mask = _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+	return mask & ((1u << node.child_count) - 1);
+}
@@ -0,0 +1,220 @@
+#include "compact.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include <glm/gtc/packing.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// rotation
+
+// components other than the largest one are within [-1/sqrt(2), 1/sqrt(2)]
+// and are mapped to [0, 1022] so that zero is exactly representable
+const float ROTATION_SCALE = 511.f * std::sqrt(2.f);
+
+uint32_t encode_rotation(const glm::quat &rotation) {
+	glm::quat q = glm::normalize(rotation);
+	float c[4] = { q.x, q.y, q.z, q.w };
+
+	int largest = 3;
+	for (int i = 2; i >= 0; i--) {
+		if (std::abs(c[i]) > std::abs(c[largest])) {
+			largest = i;
+		}
+	}
+
+	float sign = c[largest] < 0 ? -1.f : 1.f;
+
+	uint32_t code = (uint32_t)largest << 30;
+	int shift = 20;
+	for (int i = 0; i < 4; i++) {
+		if (i == largest) {
+			continue;
+		}
+
+		float v = glm::clamp(sign * c[i] * ROTATION_SCALE, -511.f, 511.f);
+		code |= (uint32_t)(std::lround(v) + 511) << shift;
+		shift -= 10;
+	}
+
+	return code;
+}
+
+glm::quat decode_rotation(uint32_t code) {
+	int largest = code >> 30;
+
+	float c[4];
+	float sum = 0;
+	int shift = 20;
+	for (int i = 0; i < 4; i++) {
+		if (i == largest) {
+			continue;
+		}
+
+		c[i] = ((int)((code >> shift) & 1023u) - 511) / ROTATION_SCALE;
+		sum += c[i] * c[i];
+		shift -= 10;
+	}
+
+	c[largest] = std::sqrt(std::max(0.f, 1 - sum));
+
+	return glm::quat(c[3], c[0], c[1], c[2]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// records
+
+namespace {
+
+template <typename T>
+glm::vec3 params_of(const T &pr) {
+	if constexpr (std::is_same_v<T, Plane>) {
+		return pr.normal;
+	} else if constexpr (std::is_same_v<T, Ellipsoid>) {
+		return pr.axes;
+	} else {
+		return pr.semi_axes;
+	}
+}
+
+template <typename Shape>
+Shape make_shape(glm::vec3 params, uint32_t color) {
+	if constexpr (std::is_same_v<Shape, CompactShape>) {
+		return { params, color };
+	} else {
+		return {
+			{ glm::packHalf1x16(params.x), glm::packHalf1x16(params.y), glm::packHalf1x16(params.z) },
+			(uint16_t)color
+		};
+	}
+}
+
+glm::vec3 unpack_params(const CompactShape &shape) {
+	return shape.params;
+}
+
+glm::vec3 unpack_params(const CompactHalfShape &shape) {
+	return glm::vec3(
+		glm::unpackHalf1x16(shape.params[0]),
+		glm::unpackHalf1x16(shape.params[1]),
+		glm::unpackHalf1x16(shape.params[2])
+	);
+}
+
+// rebuilds a primitive the intersection kernels understand, picking the same
+// fast paths classify() would have picked
+template <typename T>
+T decode_primitive(const CompactPlacement &placement, glm::vec3 params) {
+	T pr;
+	pr.position = placement.position;
+
+	bool identity = placement.rotation == IDENTITY_ROTATION_CODE;
+	if (!identity) {
+		pr.rotation = decode_rotation(placement.rotation);
+	}
+
+	if constexpr (std::is_same_v<T, Plane>) {
+		// rotation is baked into the stored normal
+		pr.normal = params;
+	} else if constexpr (std::is_same_v<T, Ellipsoid>) {
+		pr.axes = params;
+		if (params.x == params.y && params.y == params.z) {
+			pr.fast_path = FastPath::sphere;
+		}
+	} else {
+		pr.semi_axes = params;
+		if (identity) {
+			pr.fast_path = FastPath::aabb;
+		}
+	}
+
+	return pr;
+}
+
+}
+
+size_t ColorKeyHash::operator () (const std::array<uint32_t, 3> &key) const {
+	return (size_t)key[0] * 0x9E3779B97F4A7C15ull ^ (size_t)key[1] * 0xC2B2AE3D27D4EB4Full ^ key[2];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// store
+
+template <typename Shape>
+bool CompactStore<Shape>::add(const AnyPrimitive &primitive) {
+	const Primitive &base = std::visit([](const auto &pr) -> const Primitive& { return pr; }, primitive);
+
+	std::array<uint32_t, 3> key;
+	std::memcpy(key.data(), &base.color, sizeof(key));
+
+	auto it = palette_index.find(key);
+	if (it == palette_index.end()) {
+		if (palette.size() > std::numeric_limits<decltype(Shape::color)>::max()) {
+			return false;
+		}
+
+		it = palette_index.emplace(key, (uint32_t)palette.size()).first;
+		palette.push_back(base.color);
+	}
+
+	std::visit([&](const auto &pr) {
+		using T = std::decay_t<decltype(pr)>;
+
+		auto &list = lists.template get<T>();
+		list.placements.push_back({ pr.position, encode_rotation(pr.rotation) });
+		list.shapes.push_back(make_shape<Shape>(params_of(pr), it->second));
+	}, primitive);
+
+	return true;
+}
+
+template <typename Shape>
+size_t CompactStore<Shape>::size() const {
+	return lists.size();
+}
+
+template <typename Shape>
+size_t CompactStore<Shape>::bytes() const {
+	return size() * (sizeof(CompactPlacement) + sizeof(Shape)) + palette.size() * sizeof(glm::vec3);
+}
+
+template <typename Shape>
+std::optional<std::pair<float, uint32_t>> CompactStore<Shape>::closest_hit(const Ray &ray) const {
+	std::optional<std::pair<float, uint32_t>> ans;
+
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		const auto &list = lists.template get<T>();
+		for (size_t i = 0; i < list.size(); i++) {
+			const Shape &shape = list.shapes[i];
+			T pr = decode_primitive<T>(list.placements[i], unpack_params(shape));
+
+			auto t = intersect_t(pr, ray);
+			if (!t.has_value()) {
+				continue;
+			}
+
+			if (!ans.has_value() || ans.value().first > t.value()) {
+				ans = std::make_pair(t.value(), (uint32_t)shape.color);
+			}
+		}
+	});
+
+	return ans;
+}
+
+template <typename Shape>
+glm::vec3 CompactStore<Shape>::get_pixel_color(const Scene &scene, size_t x, size_t y) const {
+	auto hit = closest_hit(scene.generate_ray_to_pixel(x, y));
+	if (!hit.has_value()) {
+		return scene.bg_color;
+	}
+
+	return palette[hit.value().second];
+}
+
+template struct CompactStore<CompactShape>;
+template struct CompactStore<CompactHalfShape>;
@@ -0,0 +1,111 @@
+#include "grid.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "parallel.h"
+
+namespace {
+
+const size_t GRID_GRAIN = 1 << 14;
+
+}
+
+void UniformGrid::build(const std::vector<AABB> &bounds) {
+	box = AABB();
+	cell_begin.clear();
+	items.clear();
+
+	if (bounds.empty()) {
+		return;
+	}
+
+	struct Partial {
+		AABB box;
+		glm::vec3 extent_sum = glm::vec3(0.f);
+	};
+
+	std::vector<Partial> partials(chunk_count(bounds.size(), GRID_GRAIN));
+	parallel_chunks(bounds.size(), partials.size(), [&](size_t chunk, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			partials[chunk].box.extend(bounds[i]);
+			partials[chunk].extent_sum += bounds[i].hi - bounds[i].lo;
+		}
+	});
+
+	glm::vec3 extent_sum(0.f);
+	for (const Partial &p : partials) {
+		box.extend(p.box);
+		extent_sum += p.extent_sum;
+	}
+
+	// flat scenes get a thin slab instead of a zero volume
+	glm::vec3 extent = box.hi - box.lo;
+	float largest = std::max({ extent.x, extent.y, extent.z, 1e-6f });
+	extent = glm::max(extent, glm::vec3(largest * 1e-3f));
+	box.hi = box.lo + extent;
+
+	// in dense scenes cells smaller than the average item would list each
+	// item many times over, so they are kept at least that big
+	glm::vec3 mean_extent = extent_sum / (float)bounds.size();
+	float cells_per_unit = std::cbrt(DENSITY * bounds.size() / (extent.x * extent.y * extent.z));
+	for (int a = 0; a < 3; a++) {
+		float per_unit = mean_extent[a] > 0 ? std::min(cells_per_unit, 1 / mean_extent[a]) : cells_per_unit;
+		resolution[a] = (uint32_t)std::min(std::max(std::ceil(extent[a] * per_unit), 1.f), (float)MAX_RESOLUTION);
+	}
+
+	while ((size_t)resolution.x * resolution.y * resolution.z > MAX_CELLS) {
+		resolution = glm::max((resolution + 1u) / 2u, glm::uvec3(1, 1, 1));
+	}
+
+	cell_size = extent / glm::vec3(resolution);
+	inv_cell_size = glm::vec3(resolution) / extent;
+
+	size_t cells = (size_t)resolution.x * resolution.y * resolution.z;
+
+	auto for_each_cell = [&](const AABB &b, auto &&f) {
+		glm::ivec3 top = glm::ivec3(resolution) - 1;
+		glm::ivec3 lo = glm::clamp(glm::ivec3(glm::floor((b.lo - box.lo) * inv_cell_size)), glm::ivec3(0), top);
+		glm::ivec3 hi = glm::clamp(glm::ivec3(glm::floor((b.hi - box.lo) * inv_cell_size)), glm::ivec3(0), top);
+
+		for (int z = lo.z; z <= hi.z; z++) {
+			for (int y = lo.y; y <= hi.y; y++) {
+				for (int x = lo.x; x <= hi.x; x++) {
+					f(((size_t)z * resolution.y + y) * resolution.x + x);
+				}
+			}
+		}
+	};
+
+	std::vector<std::atomic<uint32_t>> counts(cells);
+	parallel_for(0, bounds.size(), GRID_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			for_each_cell(bounds[i], [&](size_t c) {
+				counts[c].fetch_add(1, std::memory_order_relaxed);
+			});
+		}
+	});
+
+	cell_begin.resize(cells + 1);
+	cell_begin[0] = 0;
+	for (size_t c = 0; c < cells; c++) {
+		cell_begin[c + 1] = cell_begin[c] + counts[c].load(std::memory_order_relaxed);
+		counts[c].store(cell_begin[c], std::memory_order_relaxed);
+	}
+
+	items.resize(cell_begin[cells]);
+	parallel_for(0, bounds.size(), GRID_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			for_each_cell(bounds[i], [&](size_t c) {
+				items[counts[c].fetch_add(1, std::memory_order_relaxed)] = i;
+			});
+		}
+	});
+
+	// scattering threads race for slots, sorting keeps renders deterministic
+	parallel_for(0, cells, GRID_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t c = begin; c < end; c++) {
+			std::sort(items.begin() + cell_begin[c], items.begin() + cell_begin[c + 1]);
+		}
+	});
+}
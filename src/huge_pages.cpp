@@ -0,0 +1,30 @@
+#include "huge_pages.h"
+
+#include <cstdlib>
+
+#include <sys/mman.h>
+
+void *huge_page_alloc(size_t bytes) {
+	if (bytes < HUGE_PAGE_SIZE) {
+		return ::operator new(bytes, std::align_val_t(CACHE_LINE_SIZE));
+	}
+
+	size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	void *ptr = std::aligned_alloc(HUGE_PAGE_SIZE, rounded);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+
+	// only a hint, the kernel may run without transparent huge pages
+	madvise(ptr, rounded, MADV_HUGEPAGE);
+
+	return ptr;
+}
+
+void huge_page_free(void *ptr, size_t bytes) {
+	if (bytes < HUGE_PAGE_SIZE) {
+		::operator delete(ptr, std::align_val_t(CACHE_LINE_SIZE));
+	} else {
+		std::free(ptr);
+	}
+}
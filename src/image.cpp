@@ -1,8 +1,21 @@
 #include "image.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <utility>
 #include <vector>
 
+#include "accel.h"
+#include "kernels.h"
+#include "occlusion.h"
+#include "parallel.h"
+#include "stats.h"
+#include "trace.h"
+
 using std::size_t;
 using std::uint8_t;
 
@@ -17,37 +30,185 @@ Image::Image(size_t _width, size_t _height) {
 	}
 }
 
+Image::Image(Image &&other) {
+	width = other.width; height = other.height;
+	data = other.data; _raw_data = other._raw_data;
+
+	other.data = nullptr; other._raw_data = nullptr;
+}
+
+Image &Image::operator = (Image &&other) {
+	std::swap(width, other.width); std::swap(height, other.height);
+	std::swap(data, other.data); std::swap(_raw_data, other._raw_data);
+
+	return *this;
+}
+
 Image::~Image() {
 	delete[] _raw_data;
 	delete[] data;
 }
 
-Image render_scene(const Scene &scene) {
+Image render_scene(const Scene &scene, Precision precision) {
+	Scene::PixelColorFn pixel_color = scene.specialized_pixel_color(precision);
+
+	return render_image(scene.width, scene.height, [&](size_t x, size_t y) {
+		return (scene.*pixel_color)(x, y);
+	});
+}
+
+Image render_scene(const Scene &scene, const Accelerator &accel) {
+	return render_image(scene.width, scene.height, [&](size_t x, size_t y) {
+		auto hit = accel.closest_hit(scene.generate_ray_to_pixel(x, y));
+		return hit.has_value() ? hit.value().color : scene.bg_color;
+	});
+}
+
+Image render_scene(const Scene &scene, const TwoLevelBVH &accel, const OcclusionBuffer &occlusion) {
+	return render_image(scene.width, scene.height, [&](size_t x, size_t y) {
+		Hit best = occlusion.pixel(x, y);
+		accel.intersect(scene.generate_ray_to_pixel(x, y), best);
+
+		return best.t != std::numeric_limits<float>::infinity() ? best.color : scene.bg_color;
+	});
+}
+
+Image render_scene_packets(const Scene &scene, const TwoLevelBVH &accel) {
 	Image result(scene.width, scene.height);
+	const size_t TILE = RayPacket::TILE;
+	const Kernels &kernels = active_kernels();
+	RayGenParams params = ray_gen_params(scene);
 
-	for (size_t i = 0; i < scene.height; i++) {
-		for (size_t j = 0; j < scene.width; j++) {
-			result.data[i][j] = scene.get_pixel_color(j, i);
+	// packet tiles are handed out like render_image's tiles
+	size_t tiles_x = (scene.width + TILE - 1) / TILE;
+	size_t tiles = tiles_x * ((scene.height + TILE - 1) / TILE);
+	std::atomic<size_t> next_tile { 0 };
+
+	parallel_chunks(tiles, std::min(thread_pool().size(), tiles), [&](size_t, size_t, size_t) {
+		for (size_t tile; (tile = next_tile++) < tiles; ) {
+			TraceScope scope("tile", "render", tile);
+			NoAllocScope no_alloc;
+
+			size_t tx = tile % tiles_x * TILE, ty = tile / tiles_x * TILE;
+			size_t w = std::min(TILE, scene.width - tx), h = std::min(TILE, scene.height - ty);
+
+			RayPacket packet(scene.camera_position);
+			for (size_t y = ty; y < ty + h; y++) {
+				float dx[TILE], dy[TILE], dz[TILE];
+				kernels.generate_directions(params, y, tx, w, dx, dy, dz);
+				count_rays(w);
+
+				for (size_t i = 0; i < w; i++) {
+					packet.add(glm::vec3(dx[i], dy[i], dz[i]));
+				}
+			}
+
+			accel.closest_hits(packet);
+
+			for (size_t i = 0; i < packet.size; i++) {
+				bool hit = packet.t[i] != std::numeric_limits<float>::infinity();
+				result.data[ty + i / w][tx + i % w] = hit ? packet.color[i] : scene.bg_color;
+			}
 		}
-	}
+	});
 
 	return result;
 }
 
 void write_image(const Image &img, std::ostream &out) {
-	std::vector<uint8_t> img_data; img_data.reserve(img.width * img.height * 3);
-
-	for (size_t i = 0; i < img.height; i++) {
-		for (size_t j = 0; j < img.width; j++) {
-			img_data.push_back((uint8_t)round(img.data[i][j].x * 255));
-			img_data.push_back((uint8_t)round(img.data[i][j].y * 255));
-			img_data.push_back((uint8_t)round(img.data[i][j].z * 255));
-		}
-	}
+	// rows are contiguous vec3s of packed floats
+	static_assert(sizeof(glm::vec3) == 3 * sizeof(float));
+	const float *values = &img._raw_data[0].x;
+	size_t n = img.width * img.height * 3;
 
 	out << "P6" << std::endl;
 	out << img.width << " " << img.height << std::endl;
 	out << 255 << std::endl;
-	out.write(reinterpret_cast<const char*>(img_data.data()), img_data.size() * sizeof(uint8_t));
+
+	// quantized through a fixed buffer rather than a copy of the image
+	const Kernels &kernels = active_kernels();
+	uint8_t block[1 << 14];
+	for (size_t i = 0; i < n; i += sizeof(block)) {
+		size_t count = std::min(n - i, sizeof(block));
+		kernels.quantize(values + i, count, block);
+		out.write(reinterpret_cast<const char*>(block), count);
+	}
 	out.flush();
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// per-pixel cost
+
+namespace {
+
+std::atomic<PixelCosts*> recorded_costs { nullptr };
+
+// blue, cyan, green, yellow, red
+glm::vec3 false_color(float v) {
+	static const glm::vec3 STOPS[] = {
+		{ 0.f, 0.f, 1.f }, { 0.f, 1.f, 1.f }, { 0.f, 1.f, 0.f }, { 1.f, 1.f, 0.f }, { 1.f, 0.f, 0.f }
+	};
+	const size_t LAST = sizeof(STOPS) / sizeof(STOPS[0]) - 1;
+
+	float x = std::min(std::max(v, 0.f), 1.f) * LAST;
+	size_t i = std::min((size_t)x, LAST - 1);
+
+	return glm::mix(STOPS[i], STOPS[i + 1], x - i);
+}
+
+}
+
+const char *to_string(CostMetric metric) {
+	return metric == CostMetric::tests ? "tests" : "cycles";
+}
+
+std::optional<CostMetric> parse_cost_metric(const char *name) {
+	if (std::strcmp(name, "tests") == 0) {
+		return CostMetric::tests;
+	}
+
+	if (std::strcmp(name, "cycles") == 0) {
+		return CostMetric::cycles;
+	}
+
+	return {};
+}
+
+void record_pixel_costs(PixelCosts *costs) {
+	recorded_costs = costs;
+}
+
+PixelCosts *pixel_costs() {
+	return recorded_costs;
+}
+
+bool write_pixel_costs(const PixelCosts &costs, const std::string &prefix) {
+	const float PERCENTILE = 0.99f;
+
+	std::vector<float> sorted = costs.cost;
+	float scale = 0;
+	if (!sorted.empty()) {
+		size_t k = std::min(sorted.size() - 1, (size_t)(sorted.size() * PERCENTILE));
+		std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+		scale = sorted[k];
+	}
+
+	Image heatmap(costs.width, costs.height);
+	for (size_t i = 0; i < costs.height; i++) {
+		for (size_t j = 0; j < costs.width; j++) {
+			heatmap.data[i][j] = false_color(scale > 0 ? costs.cost[i * costs.width + j] / scale : 0);
+		}
+	}
+
+	std::ofstream ppm(prefix + ".ppm");
+	write_image(heatmap, ppm);
+
+	// grayscale portable float map, little-endian, bottom row first
+	std::ofstream pfm(prefix + ".pfm", std::ios::binary);
+	pfm << "Pf\n" << costs.width << " " << costs.height << "\n-1.0\n";
+	for (size_t i = costs.height; i-- > 0; ) {
+		pfm.write(reinterpret_cast<const char*>(&costs.cost[i * costs.width]), costs.width * sizeof(float));
+	}
+
+	return bool(ppm) && bool(pfm);
+}
@@ -0,0 +1,89 @@
+#include "kernels.h"
+
+#include <atomic>
+#include <cstring>
+
+// the scalar level is this unit itself, built with the baseline flags
+#include "kernels_impl.h"
+
+const Kernels kernels_scalar = {
+	Isa::scalar,
+	generate_directions,
+	intersect_axis_planes, intersect_planes,
+	intersect_spheres, intersect_ellipsoids,
+	intersect_aabbs, intersect_boxes,
+	bvh8_intersect_children_scalar,
+	quantize,
+};
+
+namespace {
+
+const char *const ISA_NAMES[] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+const Kernels *const ISA_KERNELS[] = { &kernels_scalar, &kernels_sse42, &kernels_avx2, &kernels_avx512 };
+
+std::atomic<const Kernels*> selected { nullptr };
+
+}
+
+RayGenParams ray_gen_params(const Scene &scene) {
+	return {
+		{ scene.tan_fov.x, scene.tan_fov.y },
+		scene.width, scene.height,
+		{ scene.camera_right.x, scene.camera_right.y, scene.camera_right.z },
+		{ scene.camera_up.x, scene.camera_up.y, scene.camera_up.z },
+		{ scene.camera_forward.x, scene.camera_forward.y, scene.camera_forward.z },
+	};
+}
+
+const char *to_string(Isa isa) {
+	return ISA_NAMES[(int)isa];
+}
+
+std::optional<Isa> parse_isa(const char *name) {
+	for (int i = 0; i < 4; i++) {
+		if (std::strcmp(name, ISA_NAMES[i]) == 0) {
+			return (Isa)i;
+		}
+	}
+
+	return {};
+}
+
+// __builtin_cpu_supports also checks that the OS saves the wider registers
+Isa detect_isa() {
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		return Isa::avx512;
+	}
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		return Isa::avx2;
+	}
+
+	if (__builtin_cpu_supports("sse4.2")) {
+		return Isa::sse42;
+	}
+
+	return Isa::scalar;
+}
+
+const Kernels &active_kernels() {
+	const Kernels *kernels = selected.load(std::memory_order_relaxed);
+	if (!kernels) {
+		kernels = ISA_KERNELS[(int)detect_isa()];
+		selected.store(kernels, std::memory_order_relaxed);
+	}
+
+	return *kernels;
+}
+
+bool select_isa(Isa isa) {
+	if ((int)isa > (int)detect_isa()) {
+		return false;
+	}
+
+	selected.store(ISA_KERNELS[(int)isa], std::memory_order_relaxed);
+	return true;
+}
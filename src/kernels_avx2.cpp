@@ -0,0 +1,13 @@
+// Built with -mavx2 -mfma, only reached after a runtime CPU check.
+
+#include "kernels_impl.h"
+
+const Kernels kernels_avx2 = {
+	Isa::avx2,
+	generate_directions,
+	intersect_axis_planes, intersect_planes,
+	intersect_spheres, intersect_ellipsoids,
+	intersect_aabbs, intersect_boxes,
+	bvh8_intersect_children_avx2,
+	quantize,
+};
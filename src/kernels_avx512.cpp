@@ -0,0 +1,16 @@
+// Built with -mavx512f and 512-bit vectors preferred, only reached after a
+// runtime CPU check.
+
+#include "kernels_impl.h"
+
+// the eight children of a BVH8 node fill exactly one AVX2 register, so the
+// AVX2 child test is kept
+const Kernels kernels_avx512 = {
+	Isa::avx512,
+	generate_directions,
+	intersect_axis_planes, intersect_planes,
+	intersect_spheres, intersect_ellipsoids,
+	intersect_aabbs, intersect_boxes,
+	bvh8_intersect_children_avx2,
+	quantize,
+};
@@ -0,0 +1,200 @@
+// Kernel bodies shared by the per-ISA translation units (kernels.cpp and
+// kernels_<isa>.cpp), each compiles them with its own target flags.
+//
+// Everything here has internal linkage and only uses builtins: an inline
+// function from a header (std::min, glm operators) instantiated in an AVX-512
+// unit could otherwise be picked by the linker for callers on any CPU.
+// The units are built with -ffp-contract=off, so that no level fuses
+// multiply-adds and every level gives the same bits as the scalar code, and
+// with -fno-trapping-math, without which clamps and float to int conversions
+// do not vectorize.
+
+#pragma once
+
+#include "kernels.h"
+
+namespace {
+
+const float KERNEL_INF = __builtin_inff();
+
+void generate_directions(const RayGenParams &params, size_t y, size_t x0, size_t n, float *dx, float *dy, float *dz) {
+	// same steps as Scene::generate_ray_to_pixel<float>; pixel coordinates go
+	// through int, which converts to the same floats as size_t and vectorizes
+	float width = (float)params.width;
+	float yc = params.tan_fov[1] * (2 * (y + 0.5f) / params.height - 1);
+
+	for (size_t i = 0; i < n; i++) {
+		float xc = params.tan_fov[0] * (2 * ((float)(int)(x0 + i) + 0.5f) / width - 1);
+
+		dx[i] = xc * params.right[0] - yc * params.up[0] + params.forward[0];
+		dy[i] = xc * params.right[1] - yc * params.up[1] + params.forward[1];
+		dz[i] = xc * params.right[2] - yc * params.up[2] + params.forward[2];
+	}
+}
+
+// least_positive_from_two of primitives.cpp without branches
+inline float least_positive(float a, float b) {
+	float lo = a - b > 0 ? b : a;
+	float hi = a - b > 0 ? a : b;
+
+	return lo > 0 ? lo : (hi > 0 ? hi : KERNEL_INF);
+}
+
+// least_positive_root_of_square_equation of primitives.cpp
+inline float least_positive_root(float a, float b, float c) {
+	float disc = b * b - 4 * a * c;
+	float sd = __builtin_sqrtf(disc < 0 ? 0 : disc);
+
+	float t = least_positive((-b + sd) / a / 2, (-b - sd) / a / 2);
+	return disc < 0 ? KERNEL_INF : t;
+}
+
+// ray origin relative to the primitive, turned by its conjugate rotation q
+// like glm's quaternion times vector: v + ((u x v) w + u x (u x v)) 2
+inline void to_local(const KernelBatch &batch, size_t i, float o[3], float d[3]) {
+	float ux = batch.q[0][i], uy = batch.q[1][i], uz = batch.q[2][i], w = batch.q[3][i];
+
+	float v[2][3] = {
+		{ batch.o[0][i] - batch.p[0][i], batch.o[1][i] - batch.p[1][i], batch.o[2][i] - batch.p[2][i] },
+		{ batch.d[0][i], batch.d[1][i], batch.d[2][i] },
+	};
+	float *out[2] = { o, d };
+
+	for (int k = 0; k < 2; k++) {
+		float vx = v[k][0], vy = v[k][1], vz = v[k][2];
+
+		float uvx = uy * vz - vy * uz;
+		float uvy = uz * vx - vz * ux;
+		float uvz = ux * vy - vx * uy;
+
+		float uuvx = uy * uvz - uvy * uz;
+		float uuvy = uz * uvx - uvz * ux;
+		float uuvz = ux * uvy - uvx * uy;
+
+		out[k][0] = vx + (uvx * w + uuvx) * 2;
+		out[k][1] = vy + (uvy * w + uuvy) * 2;
+		out[k][2] = vz + (uvz * w + uuvz) * 2;
+	}
+}
+
+void intersect_axis_planes(KernelBatch &batch) {
+	for (size_t i = 0; i < batch.size; i++) {
+		float d = batch.d[0][i];
+		float t = (batch.p[0][i] - batch.o[0][i]) / d;
+
+		bool parallel = __builtin_fabsf(d) < __FLT_EPSILON__;
+		batch.t[i] = parallel || t <= 0 ? KERNEL_INF : t;
+	}
+}
+
+void intersect_planes(KernelBatch &batch) {
+	for (size_t i = 0; i < batch.size; i++) {
+		float ox = batch.o[0][i] - batch.p[0][i];
+		float oy = batch.o[1][i] - batch.p[1][i];
+		float oz = batch.o[2][i] - batch.p[2][i];
+		float nx = batch.s[0][i], ny = batch.s[1][i], nz = batch.s[2][i];
+
+		float d_normal = batch.d[0][i] * nx + batch.d[1][i] * ny + batch.d[2][i] * nz;
+		float t = -(ox * nx + oy * ny + oz * nz) / d_normal;
+
+		bool parallel = __builtin_fabsf(d_normal) < __FLT_EPSILON__;
+		batch.t[i] = parallel || t <= 0 ? KERNEL_INF : t;
+	}
+}
+
+void intersect_spheres(KernelBatch &batch) {
+	for (size_t i = 0; i < batch.size; i++) {
+		float ox = batch.o[0][i] - batch.p[0][i];
+		float oy = batch.o[1][i] - batch.p[1][i];
+		float oz = batch.o[2][i] - batch.p[2][i];
+		float dx = batch.d[0][i], dy = batch.d[1][i], dz = batch.d[2][i];
+
+		float a = dx * dx + dy * dy + dz * dz;
+		float b = 2 * (ox * dx + oy * dy + oz * dz);
+		float c = (ox * ox + oy * oy + oz * oz) - batch.s[0][i] * batch.s[0][i];
+
+		batch.t[i] = least_positive_root(a, b, c);
+	}
+}
+
+void intersect_ellipsoids(KernelBatch &batch) {
+	for (size_t i = 0; i < batch.size; i++) {
+		float o[3], d[3];
+		to_local(batch, i, o, d);
+
+		float ox = o[0] / batch.s[0][i], oy = o[1] / batch.s[1][i], oz = o[2] / batch.s[2][i];
+		float dx = d[0] / batch.s[0][i], dy = d[1] / batch.s[1][i], dz = d[2] / batch.s[2][i];
+
+		float a = dx * dx + dy * dy + dz * dz;
+		float b = 2 * (ox * dx + oy * dy + oz * dz);
+		float c = (ox * ox + oy * oy + oz * oz) - 1;
+
+		batch.t[i] = least_positive_root(a, b, c);
+	}
+}
+
+// std::min / std::max comparison order, NaNs resolve the same way
+inline float slab_near(float ts1, float ts2) {
+	return ts2 < ts1 ? ts2 : ts1;
+}
+
+inline float slab_far(float ts1, float ts2) {
+	return ts1 < ts2 ? ts2 : ts1;
+}
+
+// Box::intersection_t of a local-space ray
+inline float box_hit(const KernelBatch &batch, size_t i, const float o[3], const float d[3]) {
+	float near[3], far[3];
+
+	for (int axis = 0; axis < 3; axis++) {
+		float s = batch.s[axis][i];
+
+		near[axis] = slab_near((s - o[axis]) / d[axis], (-s - o[axis]) / d[axis]);
+		far[axis] = slab_far((s - o[axis]) / d[axis], (-s - o[axis]) / d[axis]);
+	}
+
+	// std::max({ ... }) keeps the first of equal values
+	float t1 = near[0] < near[1] ? near[1] : near[0];
+	t1 = t1 < near[2] ? near[2] : t1;
+	float t2 = far[1] < far[0] ? far[1] : far[0];
+	t2 = far[2] < t2 ? far[2] : t2;
+
+	float t = least_positive(t1, t2);
+	return t1 > t2 ? KERNEL_INF : t;
+}
+
+void intersect_aabbs(KernelBatch &batch) {
+	for (size_t i = 0; i < batch.size; i++) {
+		float o[3], d[3];
+		for (int axis = 0; axis < 3; axis++) {
+			o[axis] = batch.o[axis][i] - batch.p[axis][i];
+			d[axis] = batch.d[axis][i];
+		}
+
+		batch.t[i] = box_hit(batch, i, o, d);
+	}
+}
+
+void intersect_boxes(KernelBatch &batch) {
+	for (size_t i = 0; i < batch.size; i++) {
+		float o[3], d[3];
+		to_local(batch, i, o, d);
+
+		batch.t[i] = box_hit(batch, i, o, d);
+	}
+}
+
+void quantize(const float *in, size_t n, uint8_t *out) {
+	for (size_t i = 0; i < n; i++) {
+		float x = in[i] * 255;
+		x = x < 0 ? 0 : x;
+		x = x > 255 ? 255 : x;
+
+		// round half away from zero, exact for non-negative x
+		int k = (int)x;
+		int up = x - (float)k >= 0.5f;
+		out[i] = (uint8_t)(k + up);
+	}
+}
+
+}
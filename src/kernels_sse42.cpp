@@ -0,0 +1,14 @@
+// Built with -msse4.2, only reached after a runtime CPU check.
+
+#include "kernels_impl.h"
+
+// eight children do not fit one SSE register, the BVH8 child test stays scalar
+const Kernels kernels_sse42 = {
+	Isa::sse42,
+	generate_directions,
+	intersect_axis_planes, intersect_planes,
+	intersect_spheres, intersect_ellipsoids,
+	intersect_aabbs, intersect_boxes,
+	bvh8_intersect_children_scalar,
+	quantize,
+};
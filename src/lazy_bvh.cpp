@@ -0,0 +1,166 @@
+#include "lazy_bvh.h"
+
+#include <algorithm>
+#include <numeric>
+#include <thread>
+
+namespace {
+
+const int LAZY_BINS = 16;
+
+}
+
+LazyBVH::LazyBVH(LazyBVH &&other) noexcept {
+	*this = std::move(other);
+}
+
+LazyBVH &LazyBVH::operator = (LazyBVH &&other) noexcept {
+	nodes = std::move(other.nodes);
+	items = std::move(other.items);
+	item_bounds = std::move(other.item_bounds);
+	next_node = other.next_node.exchange(0);
+
+	return *this;
+}
+
+void LazyBVH::build(const std::vector<AABB> &bounds) {
+	item_bounds = bounds;
+	items.resize(bounds.size());
+	std::iota(items.begin(), items.end(), 0);
+
+	if (bounds.empty()) {
+		nodes.reset();
+		return;
+	}
+
+	// a binary tree over n items has at most 2n - 1 nodes, handed out in pairs
+	nodes.reset(new LazyNode[2 * bounds.size()]);
+	next_node = 1;
+
+	LazyNode &root = nodes[0];
+	for (const AABB &box : bounds) {
+		root.bounds.extend(box);
+	}
+	root.left_first = 0;
+	root.count = bounds.size();
+	root.depth = 0;
+
+	expand_eagerly(0);
+}
+
+void LazyBVH::expand_eagerly(uint32_t index) const {
+	const LazyNode &node = expanded(index);
+
+	if (!node.is_leaf() && node.depth + 1 < EAGER_DEPTH) {
+		expand_eagerly(node.left_first);
+		expand_eagerly(node.left_first + 1);
+	}
+}
+
+const LazyNode &LazyBVH::expanded(uint32_t index) const {
+	LazyNode &node = nodes[index];
+
+	uint32_t state = node.state.load(std::memory_order_acquire);
+	if (state == LazyNode::ready) {
+		return node;
+	}
+
+	uint32_t expected = LazyNode::pending;
+	if (state == LazyNode::pending && node.state.compare_exchange_strong(expected, LazyNode::expanding, std::memory_order_acquire)) {
+		expand(node);
+		node.state.store(LazyNode::ready, std::memory_order_release);
+		return node;
+	}
+
+	while (node.state.load(std::memory_order_acquire) != LazyNode::ready) {
+		std::this_thread::yield();
+	}
+
+	return node;
+}
+
+// binned SAH over the centroids of the node's items, which no other node
+// owns, so they are partitioned in place
+void LazyBVH::expand(LazyNode &node) const {
+	uint32_t begin = node.left_first, end = begin + node.count;
+
+	AABB centroid_bounds;
+	for (uint32_t i = begin; i < end; i++) {
+		centroid_bounds.extend(item_bounds[items[i]].center());
+	}
+
+	glm::vec3 extent = centroid_bounds.hi - centroid_bounds.lo;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+	if (node.count <= BVH::MAX_LEAF_SIZE || node.depth >= BVH::MAX_DEPTH || extent[axis] <= 0) {
+		return;
+	}
+
+	struct Bin {
+		AABB bounds;
+		uint32_t count = 0;
+	};
+
+	Bin bins[LAZY_BINS];
+	float scale = LAZY_BINS / extent[axis];
+	auto bin_of = [&](uint32_t item) {
+		int b = (int)((item_bounds[item].center()[axis] - centroid_bounds.lo[axis]) * scale);
+		return std::min(b, LAZY_BINS - 1);
+	};
+
+	for (uint32_t i = begin; i < end; i++) {
+		Bin &bin = bins[bin_of(items[i])];
+		bin.bounds.extend(item_bounds[items[i]]);
+		bin.count++;
+	}
+
+	// sweep from the right, then from the left for the cheapest plane
+	float right_cost[LAZY_BINS];
+	AABB acc;
+	uint32_t acc_count = 0;
+	for (int b = LAZY_BINS - 1; b > 0; b--) {
+		acc.extend(bins[b].bounds);
+		acc_count += bins[b].count;
+		right_cost[b] = acc_count ? acc.surface_area() * acc_count : 0;
+	}
+
+	int best_plane = 1;
+	float best_cost = std::numeric_limits<float>::infinity();
+	acc = AABB();
+	acc_count = 0;
+	for (int b = 0; b < LAZY_BINS - 1; b++) {
+		acc.extend(bins[b].bounds);
+		acc_count += bins[b].count;
+
+		float cost = (acc_count ? acc.surface_area() * acc_count : 0) + right_cost[b + 1];
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_plane = b + 1;
+		}
+	}
+
+	uint32_t mid = std::partition(items.begin() + begin, items.begin() + end, [&](uint32_t item) {
+		return bin_of(item) < best_plane;
+	}) - items.begin();
+
+	if (mid == begin || mid == end) {
+		mid = begin + node.count / 2;
+	}
+
+	uint32_t left = next_node.fetch_add(2, std::memory_order_relaxed);
+	for (uint32_t k = 0; k < 2; k++) {
+		LazyNode &child = nodes[left + k];
+		uint32_t cb = k == 0 ? begin : mid, ce = k == 0 ? mid : end;
+
+		child.bounds = AABB();
+		for (uint32_t i = cb; i < ce; i++) {
+			child.bounds.extend(item_bounds[items[i]]);
+		}
+		child.left_first = cb;
+		child.count = ce - cb;
+		child.depth = node.depth + 1;
+	}
+
+	node.left_first = left;
+	node.count = 0;
+}
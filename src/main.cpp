@@ -1,15 +1,401 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
 
+#include "accel.h"
+#include "alloc_tracking.h"
+#include "compact.h"
+#include "kernels.h"
+#include "occlusion.h"
+#include "out_of_core.h"
+#include "parallel.h"
 #include "scene.h"
+#include "stats.h"
+#include "trace.h"
+#include "wavefront.h"
 #include "image.h"
 
+// streams primitives straight into the compact store, Scene only keeps the
+// camera and background
+template <typename Shape>
+std::optional<Image> render_compact(std::istream &in, Scene &scene, PhaseRecorder &stats) {
+	CompactStore<Shape> store;
+	bool fits = true;
+
+	stats.begin("parse");
+	scene = read_scene(in, [&](const AnyPrimitive &pr) {
+		fits = fits && store.add(pr);
+	});
+	stats.end();
+
+	if (!fits) {
+		std::cerr << "e: too many distinct colors for the half precision store" << std::endl;
+		return {};
+	}
+
+	std::cerr << "i: compact store: " << store.size() << " primitives, " << store.bytes() << " bytes, "
+		<< store.palette.size() << " palette colors" << std::endl;
+
+	stats.begin("render");
+	Image result = render_image(scene.width, scene.height, [&](size_t x, size_t y) {
+		return store.get_pixel_color(scene, x, y);
+	});
+	stats.end();
+
+	return result;
+}
+
+// streams the root primitives into chunk files, only the index and the
+// chunks that rays reach are held in memory
+std::optional<Image> render_out_of_core(std::istream &in, Scene &scene, const OutOfCoreOptions &options, PhaseRecorder &stats) {
+	ChunkWriter writer(options);
+
+	stats.begin("parse");
+	scene = read_scene(in, [&](const AnyPrimitive &pr) {
+		writer.add(pr);
+	});
+	stats.end();
+
+	auto start = std::chrono::steady_clock::now();
+	stats.begin("build");
+	std::optional<ChunkIndex> index = writer.finish();
+	stats.end();
+	if (!index.has_value()) {
+		return {};
+	}
+
+	std::cerr << "i: out of core: " << index->chunks.size() << " chunks, " << index->file_bytes << " bytes in " << options.path << ", "
+		<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e3 << " ms" << std::endl;
+
+	OutOfCoreBVH accel(scene, std::move(index.value()), options);
+	if (accel.failed()) {
+		return {};
+	}
+
+	stats.begin("render");
+	Image result = render_scene(scene, accel);
+	stats.end();
+
+	if (accel.failed()) {
+		return {};
+	}
+
+	OutOfCoreStats st = accel.stats();
+	std::cerr << "i: out of core paging: " << st.page_ins << " page-ins, " << st.paged_in_bytes << " bytes paged in, "
+		<< st.evictions << " evictions, " << st.hits << " hits, " << st.peak_mapped_bytes << " bytes mapped at most" << std::endl;
+
+	return result;
+}
+
 int main(int argc, char **argv) {
-	std::ifstream in(argv[1]);
-	std::ofstream out(argv[2]);
+	std::vector<const char*> files;
+	std::optional<CompactPrecision> compact;
+	bool brute_force = false;
+	std::optional<Precision> precision;
+	bool packets = false;
+	bool occlusion = false;
+	bool wavefront = false;
+	std::optional<OutOfCoreOptions> out_of_core;
+	size_t memory_budget_mb = 0;
+	BvhOptions bvh_options;
+	PhaseRecorder stats;
+	const char *stats_path = nullptr;
+	const char *heatmap_prefix = nullptr;
+	const char *trace_path = nullptr;
+	bool perf = false;
+	std::optional<CostMetric> heatmap_metric;
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--brute-force") == 0) {
+			brute_force = true;
+		} else if (std::strcmp(argv[i], "--builder=median") == 0) {
+			bvh_options.builder = BvhBuilder::median;
+		} else if (std::strcmp(argv[i], "--builder=sah") == 0) {
+			bvh_options.builder = BvhBuilder::binned_sah;
+		} else if (std::strcmp(argv[i], "--builder=lbvh") == 0) {
+			bvh_options.builder = BvhBuilder::lbvh;
+		} else if (std::strcmp(argv[i], "--wide-bvh") == 0) {
+			bvh_options.wide = true;
+		} else if (std::strcmp(argv[i], "--lazy-bvh") == 0) {
+			bvh_options.lazy = true;
+		} else if (std::strcmp(argv[i], "--grid") == 0) {
+			bvh_options.grid = true;
+		} else if (std::strncmp(argv[i], "--out-of-core=", 14) == 0) {
+			out_of_core = OutOfCoreOptions();
+			out_of_core->path = argv[i] + 14;
+		} else if (std::strncmp(argv[i], "--memory-budget=", 16) == 0) {
+			memory_budget_mb = std::strtoul(argv[i] + 16, nullptr, 10);
+		} else if (std::strcmp(argv[i], "--occlusion") == 0) {
+			occlusion = true;
+		} else if (std::strcmp(argv[i], "--wavefront") == 0) {
+			wavefront = true;
+		} else if (std::strcmp(argv[i], "--packets") == 0) {
+			packets = true;
+		} else if (std::strncmp(argv[i], "--bvh-layout=", 13) == 0) {
+			std::optional<BvhLayout> layout = parse_bvh_layout(argv[i] + 13);
+			if (!layout.has_value()) {
+				std::cerr << "e: unknown bvh layout " << argv[i] + 13 << std::endl;
+				return 1;
+			}
+
+			bvh_options.layout = layout.value();
+		} else if (std::strncmp(argv[i], "--precision=", 12) == 0) {
+			precision = parse_precision(argv[i] + 12);
+			if (!precision.has_value()) {
+				std::cerr << "e: unknown precision " << argv[i] + 12 << std::endl;
+				return 1;
+			}
+		} else if (std::strncmp(argv[i], "--isa=", 6) == 0) {
+			std::optional<Isa> isa = parse_isa(argv[i] + 6);
+			if (!isa.has_value()) {
+				std::cerr << "e: unknown isa " << argv[i] + 6 << std::endl;
+				return 1;
+			}
+
+			if (!select_isa(isa.value())) {
+				std::cerr << "e: this cpu does not support " << argv[i] + 6 << ", at most " << to_string(detect_isa()) << std::endl;
+				return 1;
+			}
+		} else if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+			set_thread_count(std::strtoul(argv[i] + 10, nullptr, 10));
+		} else if (std::strcmp(argv[i], "--stats") == 0) {
+			stats.enabled = true;
+		} else if (std::strncmp(argv[i], "--stats=", 8) == 0) {
+			stats.enabled = true;
+			stats_path = argv[i] + 8;
+		} else if (std::strcmp(argv[i], "--perf") == 0) {
+			stats.enabled = true;
+			perf = true;
+		} else if (std::strncmp(argv[i], "--trace=", 8) == 0) {
+			trace_path = argv[i] + 8;
+		} else if (std::strncmp(argv[i], "--heatmap=", 10) == 0) {
+			heatmap_prefix = argv[i] + 10;
+		} else if (std::strncmp(argv[i], "--heatmap-metric=", 17) == 0) {
+			heatmap_metric = parse_cost_metric(argv[i] + 17);
+			if (!heatmap_metric.has_value()) {
+				std::cerr << "e: unknown heatmap metric " << argv[i] + 17 << std::endl;
+				return 1;
+			}
+		} else if (std::strcmp(argv[i], "--compact") == 0) {
+			compact = CompactPrecision::full;
+		} else if (std::strcmp(argv[i], "--compact=half") == 0) {
+			compact = CompactPrecision::half;
+		} else {
+			files.push_back(argv[i]);
+		}
+	}
+
+	if (files.size() != 2) {
+		std::cerr << "usage: " << argv[0] << " <scene> <output.ppm> [options]\n"
+			"  --brute-force [--precision=float|double|refined]\n"
+			"  --builder=median|sah|lbvh --bvh-layout=build|dfs|bfs|veb|treelets\n"
+			"  --wide-bvh | --lazy-bvh | --grid | --packets | --occlusion | --wavefront\n"
+			"  --out-of-core=<chunk file> [--memory-budget=<MB>]\n"
+			"  --compact | --compact=half\n"
+			"  --isa=scalar|sse4.2|avx2|avx512: kernels of the output quantization, --wide-bvh child tests,\n"
+			"      --packets ray generation and --wavefront intersections; per-ray intersections ignore it\n"
+			"  --threads=<n>\n"
+			"  --stats[=<json>] --perf --heatmap=<prefix> [--heatmap-metric=tests|cycles] --trace=<json>" << std::endl;
+		return 1;
+	}
+
+	std::cerr << "i: kernels " << to_string(active_kernels().isa) << std::endl;
+
+	// acceleration structures and their traversal stay in float
+	if (precision.has_value() && !brute_force) {
+		std::cerr << "w: --precision only applies to --brute-force, rendering in float" << std::endl;
+	}
+
+	// tests are counted only with RAYTRACING_STATS, cycles always work
+	PixelCosts heatmap;
+	if (heatmap_prefix) {
+		heatmap.metric = heatmap_metric.value_or(STATS_ENABLED ? CostMetric::tests : CostMetric::cycles);
+		if (heatmap.metric == CostMetric::tests && !STATS_ENABLED) {
+			std::cerr << "e: --heatmap-metric=tests needs a build with -DRAYTRACING_STATS=ON" << std::endl;
+			return 1;
+		}
+
+		if (packets || wavefront) {
+			std::cerr << "w: --packets and --wavefront trace pixels in batches, no heatmap for them" << std::endl;
+		} else {
+			record_pixel_costs(&heatmap);
+		}
+	} else if (heatmap_metric.has_value()) {
+		std::cerr << "w: --heatmap-metric without --heatmap" << std::endl;
+	}
+
+	// pool workers open their counters with their next task
+	if (perf) {
+		stats.perf = start_perf_counters();
+	}
+
+	if (trace_path) {
+		trace_thread_name("main");
+		start_tracing();
+	}
+
+	std::ifstream in(files[0]);
+	std::ofstream out(files[1]);
+
+	Scene scene;
+	std::optional<Image> result;
+
+	if (out_of_core.has_value()) {
+		if (memory_budget_mb > 0) {
+			out_of_core->memory_budget = memory_budget_mb << 20;
+		}
+
+		out_of_core->builder = bvh_options.builder;
+		result = render_out_of_core(in, scene, out_of_core.value(), stats);
+	} else if (!compact.has_value()) {
+		stats.begin("parse");
+		scene = read_scene(in);
+		stats.end();
+	} else if (compact.value() == CompactPrecision::full) {
+		result = render_compact<CompactShape>(in, scene, stats);
+	} else {
+		result = render_compact<CompactHalfShape>(in, scene, stats);
+	}
+
+	const FastPathStats &fp = scene.fast_paths;
+	std::cerr << "i: fast paths: " << fp.spheres << " spheres, " << fp.aabbs << " aabbs, "
+		<< fp.axis_planes << " axis planes, " << fp.general << " general" << std::endl;
+
+	if (compact.has_value() && !scene.instances.empty()) {
+		std::cerr << "w: the compact store ignores instances" << std::endl;
+	}
+
+	std::optional<OcclusionBuffer> occlusion_buffer;
+	if (occlusion && !compact.has_value() && !out_of_core.has_value()) {
+		auto start = std::chrono::steady_clock::now();
+		stats.begin("occlusion");
+
+		occlusion_buffer.emplace(scene);
+		CullStats cs;
+		scene = cull_occluded(scene, occlusion_buffer.value(), cs);
+		stats.end();
+
+		std::cerr << "i: occlusion: " << cs.occluders << " occluders, " << cs.culled << " of " << cs.tested << " primitives culled, "
+			<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e3 << " ms" << std::endl;
+	}
+
+	if (!compact.has_value() && !out_of_core.has_value()) {
+		if (brute_force) {
+			stats.begin("render");
+			result = render_scene(scene, precision.value_or(Precision::f32));
+			stats.end();
+		} else {
+			stats.begin("build");
+			TwoLevelBVH accel(scene, bvh_options);
+			stats.end();
+
+			const BvhBuildStats &bs = accel.build_stats;
+			if (bs.options.grid) {
+				std::cerr << "i: grid build: " << bs.seconds * 1e3 << " ms, " << bs.nodes << " cells, " << bs.node_bytes << " bytes" << std::endl;
+			} else if (bs.options.lazy) {
+				std::cerr << "i: lazy bvh build: " << bs.seconds * 1e3 << " ms, " << bs.nodes << " nodes" << std::endl;
+			} else {
+				std::cerr << "i: bvh build (" << to_string(bs.options.builder) << (bs.options.wide ? ", wide" : "")
+					<< ", " << to_string(bs.options.layout)
+					<< "): " << bs.seconds * 1e3 << " ms, " << bs.nodes << " nodes, " << bs.node_bytes << " bytes, SAH cost " << bs.root_sah_cost << " root, "
+					<< bs.top_sah_cost << " top" << std::endl;
+			}
+
+			stats.begin("render");
+			if (wavefront) {
+				WavefrontStats ws;
+				result = render_scene_wavefront(scene, accel, ws);
+
+				std::cerr << "i: wavefront: " << ws.batches << " batches, " << ws.rounds << " rounds, work items:";
+				for_each_type(PrimitiveTypes{}, [&](auto tag) {
+					using T = typename decltype(tag)::type;
+					std::cerr << " " << ws.work_items[type_index_v<T, PrimitiveTypes>];
+				});
+				std::cerr << " (planes, ellipsoids, boxes)" << std::endl;
+			} else if (packets) {
+				result = render_scene_packets(scene, accel);
+			} else if (occlusion_buffer.has_value()) {
+				result = render_scene(scene, accel, occlusion_buffer.value());
+			} else {
+				result = render_scene(scene, accel);
+			}
+			stats.end();
+
+			if (bs.options.lazy && !bs.options.grid) {
+				std::cerr << "i: lazy bvh expanded to " << accel.node_count() << " nodes, " << accel.node_bytes() << " bytes" << std::endl;
+			}
+		}
+	}
+
+	if (!result.has_value()) {
+		return 1;
+	}
+
+	stats.begin("encode");
+	write_image(result.value(), out);
+	stats.end();
+
+	if (pixel_costs()) {
+		record_pixel_costs(nullptr);
+
+		size_t hottest = std::max_element(heatmap.cost.begin(), heatmap.cost.end()) - heatmap.cost.begin();
+		double sum = 0;
+		for (float c : heatmap.cost) {
+			sum += c;
+		}
+
+		std::cerr << "i: heatmap: " << to_string(heatmap.metric) << " per pixel " << sum / heatmap.cost.size() << " mean, "
+			<< heatmap.cost[hottest] << " max at " << hottest % heatmap.width << " " << hottest / heatmap.width << std::endl;
+
+		if (!write_pixel_costs(heatmap, heatmap_prefix)) {
+			std::cerr << "e: cannot write " << heatmap_prefix << ".ppm or .pfm" << std::endl;
+			return 1;
+		}
+	}
+
+	if (trace_path) {
+		stop_tracing();
+		print_trace_summary(std::cerr);
+
+		std::ofstream json(trace_path);
+		write_chrome_trace(json);
+		if (!json) {
+			std::cerr << "e: cannot write " << trace_path << std::endl;
+			return 1;
+		}
+	}
+
+	if (stats.enabled) {
+		std::vector<std::string> type_names = { "planes", "ellipsoids", "boxes" };
+		stats.estimate_rays("render", (uint64_t)result->width * result->height);
+		stats.print_table(std::cerr, type_names);
+		stats.print_perf_table(std::cerr);
+
+		if (stats_path) {
+			std::ofstream json(stats_path);
+			stats.write_json(json, type_names);
+			if (!json) {
+				std::cerr << "e: cannot write " << stats_path << std::endl;
+				return 1;
+			}
+		}
+	}
 
-	Scene scene = read_scene(in);
-	Image result = render_scene(scene);
-	write_image(result, out);
+	// per-pixel work reuses per-thread scratch, allocating there is a bug
+	if constexpr (ALLOC_TRACKING_ENABLED) {
+		AllocCounts allocs = collect_allocations();
+		if (allocs.forbidden > 0) {
+			std::cerr << "e: " << allocs.forbidden << " allocations while rendering pixels, the first of "
+				<< first_forbidden_allocation() << " bytes" << std::endl;
+			return 1;
+		}
+	}
 
 	return 0;
 }
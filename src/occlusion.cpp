@@ -0,0 +1,218 @@
+#include "occlusion.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+const float MIN_DEPTH = 1e-4f;
+
+// relative slack for rounding in the projection, primitives touching an
+// occluder are kept
+const float DEPTH_SLACK = 1e-4f;
+
+}
+
+OcclusionBuffer::OcclusionBuffer(const Scene &_scene) : scene(_scene) {
+	to_camera = glm::inverse(glm::mat3(scene.camera_right, -scene.camera_up, scene.camera_forward));
+
+	// candidates by the pixel area of their screen rectangles
+	struct Candidate {
+		size_t type, index;
+		PixelRect rect;
+		long long area;
+	};
+
+	std::vector<Candidate> candidates;
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr (is_bounded_v<T>) {
+			const auto &list = scene.primitives.get<T>();
+			for (size_t i = 0; i < list.size(); i++) {
+				auto projected = project(list[i].bounds());
+				if (!projected.has_value()) {
+					continue;
+				}
+
+				PixelRect r = projected->first;
+				long long area = (long long)(r.x1 - r.x0 + 1) * (r.y1 - r.y0 + 1);
+				if (area >= MIN_OCCLUDER_PIXELS) {
+					candidates.push_back({ type_index_v<T, PrimitiveTypes>, i, r, area });
+				}
+			}
+		}
+	});
+
+	size_t kept = std::min(candidates.size(), MAX_OCCLUDERS);
+	std::partial_sort(candidates.begin(), candidates.begin() + kept, candidates.end(), [](const Candidate &a, const Candidate &b) {
+		return a.area > b.area;
+	});
+	candidates.resize(kept);
+
+	occluders = kept;
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr (!is_bounded_v<T>) {
+			occluders += scene.primitives.get<T>().size();
+		}
+	});
+
+	pixels.assign(scene.width * scene.height, Hit());
+
+	auto closer = [](Hit &best, const auto &pr, const Ray &ray) {
+		auto t = intersect_t(pr, ray);
+		if (t.has_value() && t.value() < best.t) {
+			best.t = t.value();
+			best.color = pr.color;
+		}
+	};
+
+	for (size_t y = 0; y < scene.height; y++) {
+		for (size_t x = 0; x < scene.width; x++) {
+			Ray ray = scene.generate_ray_to_pixel(x, y);
+			Hit &best = pixels[y * scene.width + x];
+
+			for_each_type(PrimitiveTypes{}, [&](auto tag) {
+				using T = typename decltype(tag)::type;
+
+				if constexpr (!is_bounded_v<T>) {
+					for (const T &pr : scene.primitives.get<T>()) {
+						closer(best, pr, ray);
+					}
+				}
+			});
+
+			for (const Candidate &c : candidates) {
+				if ((int)x < c.rect.x0 || (int)x > c.rect.x1 || (int)y < c.rect.y0 || (int)y > c.rect.y1) {
+					continue;
+				}
+
+				visit_type_index(PrimitiveTypes{}, c.type, [&](auto tag) {
+					using T = typename decltype(tag)::type;
+					closer(best, scene.primitives.get<T>()[c.index], ray);
+				});
+			}
+		}
+	}
+
+	// max pyramid, odd sizes round up
+	size_t w = scene.width, h = scene.height;
+	levels.emplace_back(w * h);
+	for (size_t i = 0; i < w * h; i++) {
+		levels[0][i] = pixels[i].t;
+	}
+
+	while (w > 1 || h > 1) {
+		size_t nw = (w + 1) / 2, nh = (h + 1) / 2;
+		const std::vector<float> &prev = levels.back();
+		std::vector<float> next(nw * nh, 0.f);
+
+		for (size_t y = 0; y < h; y++) {
+			for (size_t x = 0; x < w; x++) {
+				float &cell = next[y / 2 * nw + x / 2];
+				cell = std::max(cell, prev[y * w + x]);
+			}
+		}
+
+		levels.push_back(std::move(next));
+		w = nw; h = nh;
+	}
+}
+
+std::optional<std::pair<PixelRect, float>> OcclusionBuffer::project(const AABB &box) const {
+	glm::vec2 lo(std::numeric_limits<float>::infinity()), hi(-std::numeric_limits<float>::infinity());
+	float depth = std::numeric_limits<float>::infinity();
+
+	for (int k = 0; k < 8; k++) {
+		glm::vec3 corner((k & 1 ? box.hi : box.lo).x, (k & 2 ? box.hi : box.lo).y, (k & 4 ? box.hi : box.lo).z);
+		glm::vec3 a = to_camera * (corner - scene.camera_position);
+
+		if (a.z < MIN_DEPTH) {
+			return {};
+		}
+
+		glm::vec2 screen(a.x / a.z, a.y / a.z);
+		lo = glm::min(lo, screen);
+		hi = glm::max(hi, screen);
+		depth = std::min(depth, a.z);
+	}
+
+	// xc = tan_fov.x * (2 * (x + 0.5) / width - 1), and likewise for y;
+	// one pixel of padding covers rounding
+	auto to_pixel = [](float c, float tan_fov, size_t size) {
+		return (c / tan_fov + 1) * size / 2 - 0.5f;
+	};
+
+	PixelRect r;
+	r.x0 = (int)std::floor(to_pixel(lo.x, scene.tan_fov.x, scene.width)) - 1;
+	r.x1 = (int)std::ceil(to_pixel(hi.x, scene.tan_fov.x, scene.width)) + 1;
+	r.y0 = (int)std::floor(to_pixel(lo.y, scene.tan_fov.y, scene.height)) - 1;
+	r.y1 = (int)std::ceil(to_pixel(hi.y, scene.tan_fov.y, scene.height)) + 1;
+
+	r.x0 = std::max(r.x0, 0); r.y0 = std::max(r.y0, 0);
+	r.x1 = std::min(r.x1, (int)scene.width - 1); r.y1 = std::min(r.y1, (int)scene.height - 1);
+
+	return std::make_pair(r, depth);
+}
+
+float OcclusionBuffer::max_depth(PixelRect rect) const {
+	int size = std::max(rect.x1 - rect.x0, rect.y1 - rect.y0) + 1;
+
+	size_t level = 0;
+	while ((size >> level) > 2 && level + 1 < levels.size()) {
+		level++;
+	}
+
+	size_t w = scene.width, h = scene.height;
+	for (size_t l = 0; l < level; l++) {
+		w = (w + 1) / 2; h = (h + 1) / 2;
+	}
+
+	float result = 0;
+	for (int y = rect.y0 >> level; y <= rect.y1 >> level; y++) {
+		for (int x = rect.x0 >> level; x <= rect.x1 >> level; x++) {
+			result = std::max(result, levels[level][y * w + x]);
+		}
+	}
+
+	return result;
+}
+
+bool OcclusionBuffer::hides(const AABB &box) const {
+	auto projected = project(box);
+	if (!projected.has_value()) {
+		return false;
+	}
+
+	const PixelRect &r = projected->first;
+	if (r.x0 > r.x1 || r.y0 > r.y1) {
+		return true; // off screen, no primary ray reaches it
+	}
+
+	return projected->second > max_depth(r) * (1 + DEPTH_SLACK);
+}
+
+Scene cull_occluded(const Scene &scene, const OcclusionBuffer &buffer, CullStats &stats) {
+	Scene result = scene;
+	stats.occluders = buffer.occluders;
+
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr (is_bounded_v<T>) {
+			auto &list = result.primitives.get<T>();
+			stats.tested += list.size();
+
+			list.erase(std::remove_if(list.begin(), list.end(), [&](const T &pr) {
+				return buffer.hides(pr.bounds());
+			}), list.end());
+
+			stats.culled += scene.primitives.get<T>().size() - list.size();
+		}
+	});
+
+	return result;
+}
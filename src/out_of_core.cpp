@@ -0,0 +1,473 @@
+#include "out_of_core.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "alloc_tracking.h"
+#include "trace.h"
+
+static_assert(std::is_trivially_copyable_v<AnyPrimitive>, "primitives are spilled and mapped as raw bytes");
+
+namespace {
+
+const size_t SPILL_BUFFER = 1 << 20;
+const uint64_t SECTION_ALIGN = 64;
+const int MORTON_BITS = 5; // per axis, 2^15 buckets
+
+uint64_t align_up(uint64_t x, uint64_t a) {
+	return (x + a - 1) / a * a;
+}
+
+uint64_t page_size() {
+	return (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+bool write_all(int fd, const void *data, size_t bytes, uint64_t offset) {
+	const char *p = static_cast<const char*>(data);
+	while (bytes > 0) {
+		ssize_t n = pwrite(fd, p, bytes, offset);
+		if (n < 0) {
+			return false;
+		}
+
+		// a write of nothing leaves errno as it was
+		if (n == 0) {
+			errno = ENOSPC;
+			return false;
+		}
+
+		p += n; bytes -= n; offset += n;
+	}
+
+	return true;
+}
+
+bool read_all(int fd, void *data, size_t bytes, uint64_t offset) {
+	char *p = static_cast<char*>(data);
+	while (bytes > 0) {
+		ssize_t n = pread(fd, p, bytes, offset);
+		if (n < 0) {
+			return false;
+		}
+
+		// the spill file ended early
+		if (n == 0) {
+			errno = EIO;
+			return false;
+		}
+
+		p += n; bytes -= n; offset += n;
+	}
+
+	return true;
+}
+
+AABB bounds_of(const AnyPrimitive &pr) {
+	return std::visit([](const auto &p) {
+		using T = std::decay_t<decltype(p)>;
+
+		if constexpr (is_bounded_v<T>) {
+			return p.bounds();
+		} else {
+			return AABB();
+		}
+	}, pr);
+}
+
+uint32_t morton_bucket(glm::vec3 p, const AABB &box) {
+	glm::vec3 extent = glm::max(box.hi - box.lo, glm::vec3(1e-20f));
+	glm::uvec3 cell = glm::min(glm::uvec3((p - box.lo) / extent * float(1 << MORTON_BITS)), glm::uvec3((1 << MORTON_BITS) - 1));
+
+	uint32_t code = 0;
+	for (int bit = MORTON_BITS - 1; bit >= 0; bit--) {
+		code = code << 3 | ((cell.x >> bit) & 1) << 2 | ((cell.y >> bit) & 1) << 1 | ((cell.z >> bit) & 1);
+	}
+
+	return code;
+}
+
+// byte offsets of the sections of a chunk, relative to its start
+struct ChunkSections {
+	uint64_t nodes, refs, types[PrimitiveTypes::size], end;
+
+	explicit ChunkSections(const ChunkInfo &info) {
+		uint64_t at = 0;
+		nodes = at;
+		at = align_up(at + info.node_count * sizeof(BVHNode), SECTION_ALIGN);
+		refs = at;
+		at = align_up(at + info.ref_count * sizeof(uint32_t), SECTION_ALIGN);
+
+		for_each_type(PrimitiveTypes{}, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+
+			const size_t k = type_index_v<T, PrimitiveTypes>;
+			types[k] = at;
+			at = align_up(at + info.type_counts[k] * sizeof(T), SECTION_ALIGN);
+		});
+
+		end = at;
+	}
+};
+
+const uint32_t REF_INDEX_MASK = (1u << 30) - 1;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// writer
+
+ChunkWriter::ChunkWriter(const OutOfCoreOptions &_options) : options(_options) {
+	std::string spill = options.path + ".spill";
+	spill_fd = open(spill.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (spill_fd < 0) {
+		std::cerr << "e: cannot create " << spill << ": " << std::strerror(errno) << std::endl;
+		failed = true;
+	} else {
+		// only reachable through the descriptor from now on
+		unlink(spill.c_str());
+	}
+
+	buffer.reserve(SPILL_BUFFER);
+}
+
+ChunkWriter::~ChunkWriter() {
+	if (spill_fd >= 0) {
+		close(spill_fd);
+	}
+}
+
+void ChunkWriter::add(const AnyPrimitive &pr) {
+	if (failed) {
+		return;
+	}
+
+	if (std::visit([](const auto &p) { return !is_bounded_v<std::decay_t<decltype(p)>>; }, pr)) {
+		std::visit([&](const auto &p) {
+			resident.get<std::decay_t<decltype(p)>>().push_back(p);
+		}, pr);
+		return;
+	}
+
+	centroid_bounds.extend(bounds_of(pr).center());
+
+	const char *bytes = reinterpret_cast<const char*>(&pr);
+	buffer.insert(buffer.end(), bytes, bytes + sizeof(AnyPrimitive));
+	spilled++;
+
+	if (buffer.size() + sizeof(AnyPrimitive) > SPILL_BUFFER) {
+		flush();
+	}
+}
+
+void ChunkWriter::flush() {
+	TraceScope scope("spill", "io");
+	uint64_t buffered = buffer.size() / sizeof(AnyPrimitive);
+	failed = failed || !write_all(spill_fd, buffer.data(), buffer.size(), (spilled - buffered) * sizeof(AnyPrimitive));
+	buffer.clear();
+}
+
+std::optional<ChunkIndex> ChunkWriter::finish() {
+	if (!failed) {
+		flush();
+	}
+
+	if (failed) {
+		std::cerr << "e: cannot write the spill file: " << std::strerror(errno) << std::endl;
+		return {};
+	}
+
+	// records are streamed through a window instead of being loaded at once
+	const uint64_t WINDOW = SPILL_BUFFER / sizeof(AnyPrimitive);
+	std::vector<AnyPrimitive> window(WINDOW);
+
+	// stops at the first read failure or when f returns false
+	auto for_each_spilled = [&](auto &&f) {
+		for (uint64_t first = 0; first < spilled; first += WINDOW) {
+			uint64_t n = std::min(WINDOW, spilled - first);
+			if (!read_all(spill_fd, window.data(), n * sizeof(AnyPrimitive), first * sizeof(AnyPrimitive))) {
+				return false;
+			}
+
+			for (uint64_t i = 0; i < n; i++) {
+				if (!f(first + i, window[i])) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	};
+
+	// count per Morton bucket, then cut the curve into chunks
+	const size_t BUCKETS = 1 << (3 * MORTON_BITS);
+	std::vector<uint64_t> bucket_start(BUCKETS + 1, 0);
+	bool ok = for_each_spilled([&](uint64_t, const AnyPrimitive &pr) {
+		bucket_start[morton_bucket(bounds_of(pr).center(), centroid_bounds) + 1]++;
+		return true;
+	});
+
+	for (size_t b = 0; b < BUCKETS; b++) {
+		bucket_start[b + 1] += bucket_start[b];
+	}
+
+	// a single bucket over the target size makes a chunk of its own
+	std::vector<uint64_t> chunk_start { 0 };
+	for (size_t b = 0; b < BUCKETS; b++) {
+		if (bucket_start[b + 1] - chunk_start.back() > options.chunk_primitives && bucket_start[b] > chunk_start.back()) {
+			chunk_start.push_back(bucket_start[b]);
+		}
+	}
+	chunk_start.push_back(spilled);
+
+	// scatter into Morton order, in place of the records after the spill
+	uint64_t sorted_base = spilled * sizeof(AnyPrimitive);
+	std::vector<uint64_t> cursor(bucket_start.begin(), bucket_start.end() - 1);
+	ok = ok && for_each_spilled([&](uint64_t, const AnyPrimitive &pr) {
+		uint64_t slot = cursor[morton_bucket(bounds_of(pr).center(), centroid_bounds)]++;
+		return write_all(spill_fd, &pr, sizeof(AnyPrimitive), sorted_base + slot * sizeof(AnyPrimitive));
+	});
+
+	if (!ok) {
+		std::cerr << "e: cannot sort the spill file: " << std::strerror(errno) << std::endl;
+		return {};
+	}
+
+	int fd = open(options.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		std::cerr << "e: cannot create " << options.path << ": " << std::strerror(errno) << std::endl;
+		return {};
+	}
+
+	ChunkIndex index;
+	index.path = options.path;
+	index.resident = std::move(resident);
+
+	BvhOptions bvh_options;
+	bvh_options.builder = options.builder;
+
+	std::vector<AABB> chunk_bounds;
+	std::vector<AnyPrimitive> records;
+	uint64_t offset = 0;
+
+	for (size_t c = 0; c + 1 < chunk_start.size() && ok; c++) {
+		uint64_t first = chunk_start[c], n = chunk_start[c + 1] - first;
+		if (n == 0) {
+			continue;
+		}
+
+		records.resize(n);
+		if (!read_all(spill_fd, records.data(), n * sizeof(AnyPrimitive), sorted_base + first * sizeof(AnyPrimitive))) {
+			ok = false;
+			break;
+		}
+
+		TypedVectors<PrimitiveTypes> primitives;
+		for (const AnyPrimitive &pr : records) {
+			std::visit([&](const auto &p) {
+				primitives.get<std::decay_t<decltype(p)>>().push_back(p);
+			}, pr);
+		}
+
+		// refs are stored in item order in place of the items, so leaves
+		// read them directly
+		Blas blas;
+		blas.build(primitives, bvh_options);
+		const BVH &bvh = blas.bvh.binary;
+
+		ChunkInfo info;
+		info.bounds = blas.bounds();
+		info.offset = offset;
+		info.node_count = bvh.nodes.size();
+		info.ref_count = bvh.items.size();
+
+		std::vector<uint32_t> leaf_refs(bvh.items.size());
+		for (size_t i = 0; i < leaf_refs.size(); i++) {
+			leaf_refs[i] = blas.refs[bvh.items[i]];
+		}
+
+		for_each_type(PrimitiveTypes{}, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+			info.type_counts[type_index_v<T, PrimitiveTypes>] = blas.primitives->get<T>().size();
+		});
+
+		ChunkSections sections(info);
+		info.bytes = align_up(sections.end, page_size());
+
+		ok = write_all(fd, bvh.nodes.data(), info.node_count * sizeof(BVHNode), offset + sections.nodes)
+			&& write_all(fd, leaf_refs.data(), info.ref_count * sizeof(uint32_t), offset + sections.refs);
+
+		for_each_type(PrimitiveTypes{}, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+
+			const auto &list = blas.primitives->get<T>();
+			ok = ok && write_all(fd, list.data(), list.size() * sizeof(T), offset + sections.types[type_index_v<T, PrimitiveTypes>]);
+		});
+
+		offset += info.bytes;
+		index.chunks.push_back(info);
+		chunk_bounds.push_back(info.bounds);
+	}
+
+	// the file must reach the end of the last page for it to be mapped
+	ok = ok && ftruncate(fd, offset) == 0;
+	close(fd);
+
+	if (!ok) {
+		std::cerr << "e: cannot write " << options.path << ": " << std::strerror(errno) << std::endl;
+		return {};
+	}
+
+	index.file_bytes = offset;
+	index.top.build(chunk_bounds, options.builder);
+
+	return index;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// accelerator
+
+OutOfCoreBVH::Mapping::~Mapping() {
+	if (base) {
+		munmap(base, length);
+	}
+}
+
+OutOfCoreBVH::OutOfCoreBVH(const Scene &scene, ChunkIndex _index, const OutOfCoreOptions &options)
+	: index(std::move(_index)), instances(scene), memory_budget(options.memory_budget) {
+	fd = open(index.path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "e: cannot open " << index.path << ": " << std::strerror(errno) << std::endl;
+		io_failed = true;
+	}
+}
+
+OutOfCoreBVH::~OutOfCoreBVH() {
+	mapped.clear();
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+std::shared_ptr<const OutOfCoreBVH::Mapping> OutOfCoreBVH::acquire(uint32_t chunk) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (failed()) {
+		return nullptr;
+	}
+
+	auto it = mapped.find(chunk);
+	if (it != mapped.end()) {
+		counters.hits++;
+		lru.splice(lru.begin(), lru, it->second.lru);
+		return it->second.mapping;
+	}
+
+	const ChunkInfo &info = index.chunks[chunk];
+
+	while (!lru.empty() && mapped_bytes + info.bytes > memory_budget) {
+		auto victim = mapped.find(lru.back());
+		mapped_bytes -= victim->second.mapping->length;
+		mapped.erase(victim);
+		lru.pop_back();
+		counters.evictions++;
+	}
+
+	// the mapped set is a cache that grows while rendering by design
+	AllowAllocScope allow;
+	TraceScope scope("page in", "io", chunk);
+	auto mapping = std::make_shared<Mapping>();
+	void *base = mmap(nullptr, info.bytes, PROT_READ, MAP_PRIVATE, fd, info.offset);
+	if (base == MAP_FAILED) {
+		std::cerr << "e: cannot map chunk " << chunk << " of " << index.path << ": " << std::strerror(errno) << std::endl;
+		io_failed = true;
+		return nullptr;
+	}
+
+	madvise(base, info.bytes, MADV_WILLNEED);
+	mapping->base = base;
+	mapping->length = info.bytes;
+
+	lru.push_front(chunk);
+	mapped[chunk] = { mapping, lru.begin() };
+	mapped_bytes += info.bytes;
+
+	counters.page_ins++;
+	counters.paged_in_bytes += info.bytes;
+	counters.peak_mapped_bytes = std::max(counters.peak_mapped_bytes, mapped_bytes);
+
+	return mapping;
+}
+
+void OutOfCoreBVH::intersect_chunk(const ChunkInfo &info, const char *base, const Ray &ray, const RayInv &ray_inv, Hit &best) const {
+	ChunkSections sections(info);
+	const BVHNode *nodes = reinterpret_cast<const BVHNode*>(base + sections.nodes);
+	const uint32_t *refs = reinterpret_cast<const uint32_t*>(base + sections.refs);
+
+	traverse_bvh(nodes, refs, ray_inv, best.t, [&](uint32_t ref, float &t_max) {
+		visit_type_index(PrimitiveTypes{}, ref >> 30, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+
+			if constexpr (is_bounded_v<T>) {
+				const T *list = reinterpret_cast<const T*>(base + sections.types[type_index_v<T, PrimitiveTypes>]);
+				const T &pr = list[ref & REF_INDEX_MASK];
+
+				auto t = intersect_t(pr, ray);
+				if (t.has_value() && t.value() < t_max) {
+					t_max = t.value();
+					best.color = pr.color;
+				}
+			}
+		});
+	});
+}
+
+std::optional<Hit> OutOfCoreBVH::closest_hit(const Ray &ray) const {
+	// the rest of a failed render is not traced
+	if (failed()) {
+		return {};
+	}
+
+	Hit best;
+
+	auto instance_hit = instances.closest_hit(ray);
+	if (instance_hit.has_value()) {
+		best = instance_hit.value();
+	}
+
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		for (const T &pr : index.resident.get<T>()) {
+			auto t = intersect_t(pr, ray);
+			if (t.has_value() && t.value() < best.t) {
+				best.t = t.value();
+				best.color = pr.color;
+			}
+		}
+	});
+
+	RayInv ray_inv(ray.o, ray.d);
+	index.top.traverse(ray_inv, best.t, [&](uint32_t chunk, float &) {
+		std::shared_ptr<const Mapping> mapping = acquire(chunk);
+		if (mapping) {
+			intersect_chunk(index.chunks[chunk], static_cast<const char*>(mapping->base), ray, ray_inv, best);
+		}
+	});
+
+	if (best.t == std::numeric_limits<float>::infinity()) {
+		return {};
+	}
+
+	return best;
+}
+
+OutOfCoreStats OutOfCoreBVH::stats() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return counters;
+}
@@ -0,0 +1,154 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <memory>
+
+#include "perf_counters.h"
+
+ThreadPool::ThreadPool(size_t threads) {
+	for (size_t i = 1; i < threads; i++) {
+		workers.emplace_back([this]() {
+			trace_thread_name("worker");
+
+			while (true) {
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					has_work.wait(lock, [this]() { return stopping || !queue.empty(); });
+
+					if (queue.empty()) {
+						return;
+					}
+
+					task = std::move(queue.front());
+					queue.pop_front();
+				}
+
+				perf_thread_attach();
+				task();
+			}
+		});
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	has_work.notify_all();
+	for (std::thread &worker : workers) {
+		worker.join();
+	}
+}
+
+size_t ThreadPool::size() const {
+	return workers.size() + 1;
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(std::move(task));
+	}
+
+	has_work.notify_one();
+}
+
+bool ThreadPool::run_one() {
+	std::function<void()> task;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (queue.empty()) {
+			return false;
+		}
+
+		task = std::move(queue.front());
+		queue.pop_front();
+	}
+
+	task();
+	return true;
+}
+
+namespace {
+
+std::unique_ptr<ThreadPool> pool;
+
+size_t default_thread_count() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+}
+
+ThreadPool &thread_pool() {
+	if (!pool) {
+		pool = std::make_unique<ThreadPool>(default_thread_count());
+	}
+
+	return *pool;
+}
+
+void set_thread_count(size_t threads) {
+	pool.reset();
+	pool = std::make_unique<ThreadPool>(threads == 0 ? default_thread_count() : threads);
+}
+
+size_t chunk_count(size_t n, size_t grain) {
+	return std::max<size_t>(1, std::min(thread_pool().size(), n / std::max<size_t>(grain, 1)));
+}
+
+void parallel_radix_sort(std::vector<std::uint64_t> &keys, std::vector<std::uint32_t> &values) {
+	const size_t RADIX = 256;
+	const size_t GRAIN = 1 << 14;
+
+	size_t n = keys.size();
+	size_t chunks = chunk_count(n, GRAIN);
+
+	std::vector<std::uint64_t> keys_tmp(n);
+	std::vector<std::uint32_t> values_tmp(n);
+	std::vector<size_t> offsets(chunks * RADIX);
+
+	for (int shift = 0; shift < 64; shift += 8) {
+		std::fill(offsets.begin(), offsets.end(), 0);
+
+		parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end) {
+			size_t *hist = &offsets[c * RADIX];
+			for (size_t i = begin; i < end; i++) {
+				hist[(keys[i] >> shift) & (RADIX - 1)]++;
+			}
+		});
+
+		// digit-major, chunk-minor exclusive prefix sum keeps the sort stable
+		size_t sum = 0;
+		bool single_digit = false;
+		for (size_t d = 0; d < RADIX; d++) {
+			size_t digit_total = 0;
+			for (size_t c = 0; c < chunks; c++) {
+				size_t count = offsets[c * RADIX + d];
+				offsets[c * RADIX + d] = sum;
+				sum += count;
+				digit_total += count;
+			}
+
+			single_digit = single_digit || digit_total == n;
+		}
+
+		if (single_digit) {
+			continue;
+		}
+
+		parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end) {
+			size_t *offset = &offsets[c * RADIX];
+			for (size_t i = begin; i < end; i++) {
+				size_t dst = offset[(keys[i] >> shift) & (RADIX - 1)]++;
+				keys_tmp[dst] = keys[i];
+				values_tmp[dst] = values[i];
+			}
+		});
+
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
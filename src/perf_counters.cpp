@@ -0,0 +1,236 @@
+#include "perf_counters.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char *to_string(PerfEvent event) {
+	switch (event) {
+	case PerfEvent::cycles:        return "cycles";
+	case PerfEvent::instructions:  return "instructions";
+	case PerfEvent::l1d_misses:    return "l1d_misses";
+	case PerfEvent::llc_misses:    return "llc_misses";
+	case PerfEvent::branch_misses: return "branch_misses";
+	}
+
+	return "";
+}
+
+bool PerfValues::any() const {
+	for (bool a : available) {
+		if (a) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+PerfValues &PerfValues::operator += (const PerfValues &other) {
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		counts[i] += other.counts[i];
+		available[i] = available[i] || other.available[i];
+	}
+
+	return *this;
+}
+
+PerfValues &PerfValues::operator -= (const PerfValues &other) {
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		counts[i] -= other.counts[i];
+	}
+
+	return *this;
+}
+
+namespace {
+
+// file descriptors of one thread's counters, -1 where unavailable
+struct ThreadCounters {
+	std::string name;
+	int fds[PERF_EVENTS];
+
+	~ThreadCounters() {
+#ifdef __linux__
+		for (int fd : fds) {
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+#endif
+	}
+};
+
+// counters stay open after their thread exits and keep its final counts
+struct PerfRegistry {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadCounters>> threads;
+	bool available[PERF_EVENTS] = {}; // as found by start_perf_counters
+};
+
+PerfRegistry &registry() {
+	static PerfRegistry instance;
+	return instance;
+}
+
+std::atomic<bool> started { false };
+
+#ifdef __linux__
+
+int open_counter(PerfEvent event) {
+	perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	const uint64_t READ_MISS = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+	switch (event) {
+	case PerfEvent::cycles:
+		attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+	case PerfEvent::instructions:
+		attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+	case PerfEvent::l1d_misses:
+		attr.type = PERF_TYPE_HW_CACHE; attr.config = PERF_COUNT_HW_CACHE_L1D | READ_MISS; break;
+	case PerfEvent::llc_misses:
+		attr.type = PERF_TYPE_HW_CACHE; attr.config = PERF_COUNT_HW_CACHE_LL | READ_MISS; break;
+	case PerfEvent::branch_misses:
+		attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+	}
+
+	// this thread on any CPU
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t read_counter(int fd) {
+	uint64_t v[3]; // value, time enabled, time running
+	if (read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0) {
+		return 0;
+	}
+
+	return v[2] < v[1] ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+}
+
+#else
+
+int open_counter(PerfEvent) {
+	errno = ENOSYS;
+	return -1;
+}
+
+uint64_t read_counter(int) {
+	return 0;
+}
+
+#endif
+
+// opens what start_perf_counters found available for the calling thread
+void attach(PerfRegistry &r, const char *name) {
+	auto counters = std::make_unique<ThreadCounters>();
+	counters->name = name + std::to_string(r.threads.size() + 1);
+
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		counters->fds[i] = r.available[i] ? open_counter((PerfEvent)i) : -1;
+	}
+
+	r.threads.push_back(std::move(counters));
+}
+
+thread_local bool attached = false;
+
+PerfValues read_thread(const PerfRegistry &r, const ThreadCounters &t) {
+	PerfValues result;
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		result.available[i] = r.available[i];
+		result.counts[i] = t.fds[i] >= 0 ? read_counter(t.fds[i]) : 0;
+	}
+
+	return result;
+}
+
+}
+
+bool start_perf_counters() {
+	PerfRegistry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	int errors[PERF_EVENTS] = {};
+	bool any = false;
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		int fd = open_counter((PerfEvent)i);
+		if (fd >= 0) {
+#ifdef __linux__
+			close(fd);
+#endif
+			r.available[i] = true;
+			any = true;
+		} else {
+			errors[i] = errno;
+		}
+	}
+
+	if (!any) {
+		std::cerr << "w: perf: no hardware counters (" << std::strerror(errors[0]) << ")" << (errors[0] == EACCES || errors[0] == EPERM
+			? ", /proc/sys/kernel/perf_event_paranoid may forbid them" : "") << ", --perf reports nothing" << std::endl;
+		return false;
+	}
+
+	for (size_t i = 0; i < PERF_EVENTS; i++) {
+		if (!r.available[i]) {
+			std::cerr << "w: perf: " << to_string((PerfEvent)i) << " unavailable (" << std::strerror(errors[i]) << ")" << std::endl;
+		}
+	}
+
+	attach(r, "main ");
+	attached = true;
+	started = true;
+
+	return true;
+}
+
+bool perf_counters_started() {
+	return started;
+}
+
+void perf_thread_attach() {
+	if (!started.load(std::memory_order_relaxed) || attached) {
+		return;
+	}
+
+	PerfRegistry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	attach(r, "worker ");
+	attached = true;
+}
+
+PerfValues read_perf_counters() {
+	PerfValues result;
+	for (const ThreadPerf &t : read_perf_counters_per_thread()) {
+		result += t.values;
+	}
+
+	return result;
+}
+
+std::vector<ThreadPerf> read_perf_counters_per_thread() {
+	PerfRegistry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	std::vector<ThreadPerf> result;
+	for (const auto &t : r.threads) {
+		result.push_back({ t->name, read_thread(r, *t) });
+	}
+
+	return result;
+}
@@ -1,25 +1,31 @@
 #include "primitives.h"
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
 
 ///////////////////////////////////////////////////////////////////////////////
 // utils
 
-const float EPS = 1e-12;
+// rays closer to parallel than this to a plane miss it; the precision's own
+// epsilon, a fixed 1e-12 meant nothing for float
+template <typename S>
+constexpr S PARALLEL_EPS = std::numeric_limits<S>::epsilon();
 
-namespace glm {
+// tolerance for treating a normalized quaternion as the identity rotation or a
+// unit vector as a coordinate axis during classification
+const float CLASSIFY_EPS = 1e-6;
 
-float scalar_square(glm::vec3 &vec) {
-	return glm::dot(vec, vec);
-}
+// relative and absolute padding of primitive bounds against rounding
+const float BOUNDS_PAD = 1e-5;
 
-float scalar_square(glm::vec3 vec) {
+template <typename S>
+S scalar_square(glm::vec<3, S> vec) {
 	return glm::dot(vec, vec);
 }
 
-}
-
-std::optional<float> least_positive_from_two(float a, float b) {
+template <typename S>
+std::optional<S> least_positive_from_two(S a, S b) {
 	if (a - b > 0) {
 		std::swap(a, b);
 	}
@@ -35,45 +41,64 @@ std::optional<float> least_positive_from_two(float a, float b) {
 	return {};
 }
 
-std::optional<float> least_positive_root_of_square_equation(float a, float b, float c) {
-	float d = b * b - 4 * a * c;
+// keeps the nearest positive t of a grazing ray
+template <typename S>
+void note_grazing(S *grazing, S t) {
+	if (t > 0 && t < *grazing) {
+		*grazing = t;
+	}
+}
+
+// a near-zero discriminant is a ray touching the quadric's silhouette, at
+// about t = -b / 2a
+template <typename S>
+std::optional<S> least_positive_root_of_square_equation(S a, S b, S c, S *grazing) {
+	S d = b * b - 4 * a * c;
+	if (grazing && std::abs(d) <= GRAZING_EPS<S> * b * b) {
+		note_grazing(grazing, -b / a / 2);
+	}
+
 	if (d < 0) {
 		return {};
 	}
 
-	float sd = sqrt(d);
-	float x1 = (-b + sd) / a / 2;
-	float x2 = (-b - sd) / a / 2;
+	S sd = std::sqrt(d);
+	S x1 = (-b + sd) / a / 2;
+	S x2 = (-b - sd) / a / 2;
 
 	return least_positive_from_two(x1, x2);
 }
 
+// instantiates a member template of every primitive type for float and double
+#define INSTANTIATE_INTERSECTION(T, fn) \
+	template std::optional<float> T::fn(const RayT<float> &ray, float *grazing) const; \
+	template std::optional<double> T::fn(const RayT<double> &ray, double *grazing) const;
+
 ///////////////////////////////////////////////////////////////////////////////
 // ray
 
-Ray Ray::operator - (const glm::vec3 &vec) const {
+template <typename S>
+RayT<S> RayT<S>::operator - (const vec3 &vec) const {
 	return { o - vec, d };
 }
 
-Ray Ray::rotate(const glm::quat &rot) const {
+template <typename S>
+RayT<S> RayT<S>::rotate(const glm::qua<S> &rot) const {
 	return { rot * o, rot * d };
 }
 
+template struct RayT<float>;
+template struct RayT<double>;
+
 ///////////////////////////////////////////////////////////////////////////////
 // primitive
 
 Primitive::Primitive() {}
 
-std::optional<std::pair<float, glm::vec3>> Primitive::intersect(const Ray &ray) const {
-	glm::quat conj_rotation = glm::conjugate(rotation);
-	Ray transformed_ray = (ray - position).rotate(conj_rotation);
-
-	auto t = intersection_t(transformed_ray);
-    if (!t.has_value()) {
-    	return {};
-    }
-
-	return std::make_pair(t.value(), color);
+bool Primitive::has_identity_rotation() const {
+	return std::abs(rotation.x) < CLASSIFY_EPS
+		&& std::abs(rotation.y) < CLASSIFY_EPS
+		&& std::abs(rotation.z) < CLASSIFY_EPS;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -85,13 +110,54 @@ Plane::Plane(glm::vec3 _normal) {
 	normal = glm::normalize(_normal);
 }
 
-std::optional<float> Plane::intersection_t(const Ray &ray) const {
-	float d_normal = glm::dot(ray.d, normal);
-	if (std::abs(d_normal) < EPS) {
+// a plane is fully described by its world-space normal, so the rotation is
+// always baked in; planes left facing along a coordinate axis get a 1D test
+void Plane::classify() {
+	rotation = glm::normalize(rotation);
+	normal = glm::normalize(rotation * normal);
+	rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
+
+	axis = -1;
+	fast_path = FastPath::none;
+	for (int i = 0; i < 3; i++) {
+		if (std::abs(std::abs(normal[i]) - 1) < CLASSIFY_EPS) {
+			axis = i;
+			fast_path = FastPath::axis_plane;
+		}
+	}
+}
+
+template <typename S>
+std::optional<S> Plane::intersection_t(const RayT<S> &ray, S *grazing) const {
+	glm::vec<3, S> n(normal);
+
+	S d_normal = glm::dot(ray.d, n);
+	if (std::abs(d_normal) < PARALLEL_EPS<S>) {
+		return {};
+	}
+
+	S t = -glm::dot(ray.o, n) / d_normal;
+	if (grazing && std::abs(d_normal) <= GRAZING_EPS<S> * glm::length(ray.d)) {
+		note_grazing(grazing, t);
+	}
+	if (t <= 0) {
+		return {};
+	}
+
+	return t;
+}
+
+template <typename S>
+std::optional<S> Plane::fast_intersection_t(const RayT<S> &ray, S *grazing) const {
+	S d_axis = ray.d[axis];
+	if (std::abs(d_axis) < PARALLEL_EPS<S>) {
 		return {};
 	}
 
-	float t = -glm::dot(ray.o, normal) / d_normal;
+	S t = (S(position[axis]) - ray.o[axis]) / d_axis;
+	if (grazing && std::abs(d_axis) <= GRAZING_EPS<S> * glm::length(ray.d)) {
+		note_grazing(grazing, t);
+	}
 	if (t <= 0) {
 		return {};
 	}
@@ -99,6 +165,9 @@ std::optional<float> Plane::intersection_t(const Ray &ray) const {
 	return t;
 }
 
+INSTANTIATE_INTERSECTION(Plane, intersection_t)
+INSTANTIATE_INTERSECTION(Plane, fast_intersection_t)
+
 ///////////////////////////////////////////////////////////////////////////////
 // ellipsoid
 
@@ -108,12 +177,54 @@ Ellipsoid::Ellipsoid(glm::vec3 _axes) {
 	axes = _axes;
 }
 
-std::optional<float> Ellipsoid::intersection_t(const Ray &ray) const {
-	float a = glm::scalar_square(ray.d / axes);
-	float b = 2 * glm::dot(ray.o / axes, ray.d / axes);
-	float c = glm::scalar_square(ray.o / axes) - 1;
+// rotation does not matter for an ellipsoid with equal axes
+void Ellipsoid::classify() {
+	rotation = glm::normalize(rotation);
+
+	fast_path = FastPath::none;
+	if (axes.x == axes.y && axes.y == axes.z) {
+		rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
+		fast_path = FastPath::sphere;
+	}
+}
+
+template <typename S>
+std::optional<S> Ellipsoid::intersection_t(const RayT<S> &ray, S *grazing) const {
+	glm::vec<3, S> ax(axes);
+
+	S a = scalar_square(ray.d / ax);
+	S b = 2 * glm::dot(ray.o / ax, ray.d / ax);
+	S c = scalar_square(ray.o / ax) - 1;
+
+	return least_positive_root_of_square_equation(a, b, c, grazing);
+}
+
+template <typename S>
+std::optional<S> Ellipsoid::fast_intersection_t(const RayT<S> &ray, S *grazing) const {
+	glm::vec<3, S> o = ray.o - glm::vec<3, S>(position);
+	S r = axes.x;
+
+	S a = scalar_square(ray.d);
+	S b = 2 * glm::dot(o, ray.d);
+	S c = glm::dot(o, o) - r * r;
+
+	return least_positive_root_of_square_equation(a, b, c, grazing);
+}
+
+INSTANTIATE_INTERSECTION(Ellipsoid, intersection_t)
+INSTANTIATE_INTERSECTION(Ellipsoid, fast_intersection_t)
 
-	return least_positive_root_of_square_equation(a, b, c);
+// half-extents of a rotated ellipsoid: |R * diag(axes)| row lengths
+AABB Ellipsoid::bounds() const {
+	glm::mat3 r = glm::mat3_cast(rotation);
+	glm::vec3 e = glm::sqrt(
+		glm::pow(r[0] * axes.x, glm::vec3(2.f))
+		+ glm::pow(r[1] * axes.y, glm::vec3(2.f))
+		+ glm::pow(r[2] * axes.z, glm::vec3(2.f))
+	);
+
+	e = e * (1 + BOUNDS_PAD) + BOUNDS_PAD;
+	return { position - e, position + e };
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -125,16 +236,34 @@ Box::Box(glm::vec3 _semi_axes) {
 	semi_axes = _semi_axes;
 }
 
-std::optional<float> Box::intersection_t(const Ray &ray) const {
-	glm::vec3 ts1 = (semi_axes - ray.o) / ray.d;
-	glm::vec3 ts2 = (-semi_axes - ray.o) / ray.d;
+void Box::classify() {
+	rotation = glm::normalize(rotation);
+
+	fast_path = FastPath::none;
+	if (has_identity_rotation()) {
+		rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
+		fast_path = FastPath::aabb;
+	}
+}
+
+// an entry close to the exit is a ray clipping an edge or a corner
+template <typename S>
+std::optional<S> Box::intersection_t(const RayT<S> &ray, S *grazing) const {
+	glm::vec<3, S> sa(semi_axes);
+
+	glm::vec<3, S> ts1 = (sa - ray.o) / ray.d;
+	glm::vec<3, S> ts2 = (-sa - ray.o) / ray.d;
+
+	S t1x = std::min(ts1.x, ts2.x), t2x = std::max(ts1.x, ts2.x);
+	S t1y = std::min(ts1.y, ts2.y), t2y = std::max(ts1.y, ts2.y);
+	S t1z = std::min(ts1.z, ts2.z), t2z = std::max(ts1.z, ts2.z);
 
-	float t1x = std::min(ts1.x, ts2.x), t2x = std::max(ts1.x, ts2.x);
-	float t1y = std::min(ts1.y, ts2.y), t2y = std::max(ts1.y, ts2.y);
-	float t1z = std::min(ts1.z, ts2.z), t2z = std::max(ts1.z, ts2.z);
+	S t1 = std::max({ t1x, t1y, t1z });
+	S t2 = std::min({ t2x, t2y, t2z });
 
-	float t1 = std::max({ t1x, t1y, t1z });
-	float t2 = std::min({ t2x, t2y, t2z });
+	if (grazing && std::abs(t2 - t1) <= GRAZING_EPS<S> * std::max(std::abs(t1), std::abs(t2))) {
+		note_grazing(grazing, t1);
+	}
 
 	if (t1 > t2) {
 		return {};
@@ -142,3 +271,20 @@ std::optional<float> Box::intersection_t(const Ray &ray) const {
 
 	return least_positive_from_two(t1, t2);
 }
+
+// with identity rotation the local-space slab test only needs the translation
+template <typename S>
+std::optional<S> Box::fast_intersection_t(const RayT<S> &ray, S *grazing) const {
+	return intersection_t(ray - glm::vec<3, S>(position), grazing);
+}
+
+INSTANTIATE_INTERSECTION(Box, intersection_t)
+INSTANTIATE_INTERSECTION(Box, fast_intersection_t)
+
+AABB Box::bounds() const {
+	AABB local(-semi_axes, semi_axes);
+	AABB result = local.transformed(rotation, position);
+
+	glm::vec3 pad = (result.hi - result.lo) * BOUNDS_PAD + BOUNDS_PAD;
+	return { result.lo - pad, result.hi + pad };
+}
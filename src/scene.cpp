@@ -1,52 +1,164 @@
 #include "scene.h"
 
+#include <cassert>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
-#include <memory>
+#include <limits>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <variant>
+
+#include <glm/gtc/constants.hpp>
+
+#include "stats.h"
 
 using std::size_t;
 
-Ray Scene::generate_ray_to_pixel(size_t x, size_t y) const {
-	float xc = tan_fov.x * (2 * (x + 0.5) / width - 1);
-	float yc = tan_fov.y * (2 * (y + 0.5) / height - 1);
+// computed in S throughout, float rays no longer pass through double
+template <typename S>
+RayT<S> Scene::generate_ray_to_pixel(size_t x, size_t y) const {
+	using vec3 = glm::vec<3, S>;
+	count_rays();
+
+	S xc = S(tan_fov.x) * (2 * (x + S(0.5)) / width - 1);
+	S yc = S(tan_fov.y) * (2 * (y + S(0.5)) / height - 1);
 
-	return { camera_position, xc * camera_right - yc * camera_up + camera_forward };
+	return { vec3(camera_position), xc * vec3(camera_right) - yc * vec3(camera_up) + vec3(camera_forward) };
 }
 
-glm::vec3 Scene::get_pixel_color(size_t x, size_t y) const {
-	std::optional<std::pair<float, glm::vec3>> ans;
+template RayT<float> Scene::generate_ray_to_pixel<float>(size_t x, size_t y) const;
+template RayT<double> Scene::generate_ray_to_pixel<double>(size_t x, size_t y) const;
 
-	for (const auto &pr : primitives) {
-		Ray ray = generate_ray_to_pixel(x, y);
-		std::optional<std::pair<float, glm::vec3>> intersection;
+///////////////////////////////////////////////////////////////////////////////
+// instance
 
-		switch (pr.index()) {
-		case 0:
-			intersection = std::get<0>(pr).intersect(ray);
-			break;
+size_t Instance::copies() const {
+	return (size_t)counts.x * counts.y * counts.z;
+}
 
-		case 1:
-			intersection = std::get<1>(pr).intersect(ray);
-			break;
+glm::uvec3 Instance::copy_index(size_t i) const {
+	return glm::uvec3(i % counts.x, i / counts.x % counts.y, i / counts.x / counts.y);
+}
 
-		case 2:
-			intersection = std::get<2>(pr).intersect(ray);
-			break;
+template <typename S>
+RayT<S> Instance::to_copy_space(const RayT<S> &ray, glm::uvec3 index) const {
+	using vec3 = glm::vec<3, S>;
 
-		default:
-			assert(false);
+	if (layout == InstanceLayout::grid) {
+		return ray - vec3(spacing) * vec3(index);
+	}
+
+	S angle = 2 * glm::pi<S>() * index.x / counts.x;
+	vec3 offset(S(radius) * std::cos(angle), S(0), S(radius) * std::sin(angle));
+
+	// the copy is turned by -angle around y, undo it
+	return (ray - offset).rotate(glm::angleAxis(angle, vec3(S(0), S(1), S(0))));
+}
+
+template Ray Instance::to_copy_space(const Ray &ray, glm::uvec3 index) const;
+template RayD Instance::to_copy_space(const RayD &ray, glm::uvec3 index) const;
+
+///////////////////////////////////////////////////////////////////////////////
+// scene
+
+namespace {
+
+// relative gap below which the two nearest hits count as a tie
+const float TIE_EPS = 1e-5f;
+
+// float-pass bookkeeping of Precision::refined: the two nearest hits and the
+// nearest grazed surface
+struct TieTracker {
+	float best = std::numeric_limits<float>::infinity();
+	float second = std::numeric_limits<float>::infinity();
+	float grazing = std::numeric_limits<float>::infinity();
+
+	void add(float t) {
+		if (t < best) {
+			second = best;
+			best = t;
+		} else if (t < second) {
+			second = t;
 		}
+	}
 
-		if (!intersection.has_value()) {
-			continue;
+	bool needs_refinement() const {
+		return std::min(second, grazing) - best <= TIE_EPS * best;
+	}
+};
+
+template <unsigned Mask, typename S>
+void closest_intersection(
+	const TypedVectors<PrimitiveTypes> &primitives, const RayT<S> &ray,
+	std::optional<std::pair<S, glm::vec3>> &ans, TieTracker *ties
+) {
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		if constexpr ((Mask & type_bit<T, PrimitiveTypes>) != 0) {
+			S *grazing = nullptr;
+			if constexpr (std::is_same_v<S, float>) {
+				grazing = ties ? &ties->grazing : nullptr;
+			}
+
+			for (const T &pr : primitives.get<T>()) {
+				auto intersection = intersect(pr, ray, grazing);
+				if (!intersection.has_value()) {
+					continue;
+				}
+
+				if constexpr (std::is_same_v<S, float>) {
+					if (ties) {
+						ties->add(intersection.value().first);
+					}
+				}
+
+				if (!ans.has_value() || ans.value().first > intersection.value().first) {
+					ans = intersection;
+				}
+			}
 		}
+	});
+}
+
+// ties are only tracked in float, they decide whether to redo the pixel in
+// double
+template <unsigned Mask, typename S>
+std::optional<std::pair<S, glm::vec3>> trace_pixel(const Scene &scene, size_t x, size_t y, TieTracker *ties) {
+	RayT<S> ray = scene.generate_ray_to_pixel<S>(x, y);
+	std::optional<std::pair<S, glm::vec3>> ans;
+
+	closest_intersection<Mask>(scene.primitives, ray, ans, ties);
+
+	for (const Instance &inst : scene.instances) {
+		using vec3 = glm::vec<3, S>;
 
-		if (!ans.has_value() || ans.value().first > intersection.value().first) {
-			ans = intersection;
+		RayT<S> instance_ray = (ray - vec3(inst.position)).rotate(glm::conjugate(glm::qua<S>(inst.rotation)));
+		const Prototype &proto = scene.prototypes[inst.prototype];
+
+		for (size_t i = 0; i < inst.copies(); i++) {
+			RayT<S> copy_ray = inst.to_copy_space(instance_ray, inst.copy_index(i));
+
+			auto before = ans;
+			closest_intersection<full_type_mask<PrimitiveTypes>>(proto.primitives, copy_ray, ans, ties);
+
+			if (inst.color.has_value() && ans != before) {
+				ans.value().second = inst.color.value();
+			}
 		}
 	}
 
+	return ans;
+}
+
+}
+
+template <unsigned Mask, typename S>
+glm::vec3 Scene::get_pixel_color_for(size_t x, size_t y) const {
+	auto ans = trace_pixel<Mask, S>(*this, x, y, nullptr);
 	if (!ans.has_value()) {
 		return bg_color;
 	}
@@ -54,7 +166,77 @@ glm::vec3 Scene::get_pixel_color(size_t x, size_t y) const {
 	return ans.value().second;
 }
 
+template <unsigned Mask>
+glm::vec3 Scene::get_pixel_color_refined(size_t x, size_t y) const {
+	TieTracker ties;
+	auto ans = trace_pixel<Mask, float>(*this, x, y, &ties);
+
+	if (ties.needs_refinement()) {
+		return get_pixel_color_for<Mask, double>(x, y);
+	}
+
+	if (!ans.has_value()) {
+		return bg_color;
+	}
+
+	return ans.value().second;
+}
+
+glm::vec3 Scene::get_pixel_color(size_t x, size_t y) const {
+	return get_pixel_color_for<full_type_mask<PrimitiveTypes>>(x, y);
+}
+
+namespace {
+
+template <typename S>
+struct PixelColorByMask {
+	template <unsigned Mask>
+	static constexpr Scene::PixelColorFn value = &Scene::get_pixel_color_for<Mask, S>;
+};
+
+struct RefinedPixelColorByMask {
+	template <unsigned Mask>
+	static constexpr Scene::PixelColorFn value = &Scene::get_pixel_color_refined<Mask>;
+};
+
+}
+
+Scene::PixelColorFn Scene::specialized_pixel_color(Precision precision) const {
+	static constexpr auto single_table = make_mask_table<PrimitiveTypes, PixelColorByMask<float>>();
+	static constexpr auto double_table = make_mask_table<PrimitiveTypes, PixelColorByMask<double>>();
+	static constexpr auto refined_table = make_mask_table<PrimitiveTypes, RefinedPixelColorByMask>();
+
+	unsigned mask = primitives.presence_mask();
+	switch (precision) {
+	case Precision::f64:     return double_table[mask];
+	case Precision::refined: return refined_table[mask];
+	default:                 return single_table[mask];
+	}
+}
+
+const char *to_string(Precision precision) {
+	switch (precision) {
+	case Precision::f64:     return "double";
+	case Precision::refined: return "refined";
+	default:                 return "float";
+	}
+}
+
+std::optional<Precision> parse_precision(const char *name) {
+	for (Precision precision : { Precision::f32, Precision::f64, Precision::refined }) {
+		if (std::strcmp(name, to_string(precision)) == 0) {
+			return precision;
+		}
+	}
+
+	return {};
+}
+
 Scene read_scene(std::istream &in) {
+	return read_scene(in, nullptr);
+}
+
+Scene read_scene(std::istream &in, const PrimitiveSink &sink) {
 	std::unordered_map <std::string, int> command_id;
 
 	static const int UNKNOWN_COMMAND = 0;
@@ -76,6 +258,12 @@ Scene read_scene(std::istream &in) {
 	static const int ELLIPSOID       = 13;
 	static const int BOX             = 14;
 
+	static const int NEW_PROTOTYPE   = 15;
+	static const int END_PROTOTYPE   = 16;
+	static const int NEW_INSTANCE    = 17;
+	static const int GRID            = 18;
+	static const int RING            = 19;
+
 	command_id["FIN"]             = FIN;
 
 	command_id["DIMENSIONS"]      = DIMENSIONS;
@@ -94,40 +282,87 @@ Scene read_scene(std::istream &in) {
 	command_id["ELLIPSOID"]       = ELLIPSOID;
 	command_id["BOX"]             = BOX;
 
+	command_id["NEW_PROTOTYPE"]   = NEW_PROTOTYPE;
+	command_id["END_PROTOTYPE"]   = END_PROTOTYPE;
+	command_id["NEW_INSTANCE"]    = NEW_INSTANCE;
+	command_id["GRID"]            = GRID;
+	command_id["RING"]            = RING;
+
 	Scene scene;
 
-	enum { none, plane, ellipsoid, box } cur_primitive_type = none;
-	std::unique_ptr<Primitive> cur_primitive;
+	std::variant<std::monostate, Plane, Ellipsoid, Box> cur_primitive;
 	glm::vec3 cur_position;
 	glm::quat cur_rotation;
 	glm::vec3 cur_color;
 
-	auto emit_primitive = [&]() {
-		switch (cur_primitive_type) {
-		case plane: {
-			Plane *ptr = static_cast<Plane*>(cur_primitive.get());
-			scene.primitives.push_back(*ptr);
-			break;
-		}
+	std::optional<Prototype> cur_prototype;
+	std::optional<Instance> cur_instance;
+	std::unordered_map<std::string, size_t> prototype_id;
 
-		case ellipsoid: {
-			Ellipsoid *ptr = static_cast<Ellipsoid*>(cur_primitive.get());
-			scene.primitives.push_back(*ptr);
-			break;
+	auto count_fast_path = [&](FastPath fast_path) {
+		switch (fast_path) {
+		case FastPath::sphere:     scene.fast_paths.spheres++;     break;
+		case FastPath::aabb:       scene.fast_paths.aabbs++;       break;
+		case FastPath::axis_plane: scene.fast_paths.axis_planes++; break;
+		case FastPath::none:       scene.fast_paths.general++;     break;
 		}
+	};
 
-		case box: {
-			Box *ptr = static_cast<Box*>(cur_primitive.get());
-			scene.primitives.push_back(*ptr);
-			break;
+	auto current_primitive = [&]() -> Primitive* {
+		return std::visit([](auto &pr) -> Primitive* {
+			if constexpr (std::is_same_v<std::decay_t<decltype(pr)>, std::monostate>) {
+				return nullptr;
+			} else {
+				return &pr;
+			}
+		}, cur_primitive);
+	};
+
+	auto emit_primitive = [&]() {
+		std::visit([&](auto &pr) {
+			using T = std::decay_t<decltype(pr)>;
+
+			if constexpr (std::is_same_v<T, std::monostate>) {
+				assert(false);
+			} else {
+				pr.classify();
+				count_fast_path(pr.fast_path);
+
+				if (cur_prototype) {
+					cur_prototype->primitives.get<T>().push_back(pr);
+				} else if (sink) {
+					sink(pr);
+				} else {
+					scene.primitives.get<T>().push_back(pr);
+				}
+			}
+		}, cur_primitive);
+
+		cur_primitive = std::monostate{};
+	};
+
+	// closes the current NEW_PRIMITIVE or NEW_INSTANCE block
+	auto emit_block = [&]() {
+		if (current_primitive()) {
+			emit_primitive();
 		}
 
-		case none:
-			assert(false);
+		if (cur_instance) {
+			scene.instances.push_back(cur_instance.value());
+			cur_instance.reset();
 		}
 
-		cur_primitive_type = none;
-		cur_primitive.reset();
+		cur_position = glm::vec3(0.f, 0.f, 0.f);
+		cur_rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
+		cur_color = glm::vec3(0.f, 0.f, 0.f);
+	};
+
+	auto end_prototype = [&]() {
+		emit_block();
+
+		prototype_id[cur_prototype->name] = scene.prototypes.size();
+		scene.prototypes.push_back(std::move(cur_prototype.value()));
+		cur_prototype.reset();
 	};
 
 	std::string s;
@@ -186,50 +421,129 @@ Scene read_scene(std::istream &in) {
 			break;
 
 		case NEW_PRIMITIVE:
-			if (cur_primitive) {
-				emit_primitive();
-			}
-
-			cur_position = glm::vec3(0.f, 0.f, 0.f);
-			cur_rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
-			cur_color = glm::vec3(0.f, 0.f, 0.f);
-
+			emit_block();
 			break;
 
 		case POSITION:
 			in >> cur_position.x >> cur_position.y >> cur_position.z;
-			if (cur_primitive) {
-				cur_primitive->position = cur_position;
+			if (Primitive *pr = current_primitive()) {
+				pr->position = cur_position;
+			}
+
+			if (cur_instance) {
+				cur_instance->position = cur_position;
 			}
 
 			break;
 
 		case ROTATION:
 			in >> cur_rotation.x >> cur_rotation.y >> cur_rotation.z >> cur_rotation.w;
-			if (cur_primitive) {
-				cur_primitive->rotation = cur_rotation;
+			if (Primitive *pr = current_primitive()) {
+				pr->rotation = cur_rotation;
+			}
+
+			if (cur_instance) {
+				cur_instance->rotation = glm::normalize(cur_rotation);
 			}
 
 			break;
 
 		case COLOR:
 			in >> cur_color.x >> cur_color.y >> cur_color.z;
-			if (cur_primitive) {
-				cur_primitive->color = cur_color;
+			if (Primitive *pr = current_primitive()) {
+				pr->color = cur_color;
+			}
+
+			if (cur_instance) {
+				cur_instance->color = cur_color;
+			}
+
+			break;
+
+		case NEW_PROTOTYPE: {
+			if (cur_prototype) {
+				std::cerr << "w: prototype " << cur_prototype->name << " is not ended" << std::endl;
+				end_prototype();
 			}
 
+			emit_block();
+
+			cur_prototype = Prototype();
+			in >> cur_prototype->name;
+
 			break;
+		}
+
+		case END_PROTOTYPE:
+			if (!cur_prototype) {
+				std::cerr << "w: END_PROTOTYPE outside of a prototype" << std::endl;
+				break;
+			}
+
+			end_prototype();
+			break;
+
+		case NEW_INSTANCE: {
+			emit_block();
+
+			std::string name;
+			in >> name;
+
+			auto it = prototype_id.find(name);
+			if (it == prototype_id.end()) {
+				std::cerr << "w: unknown prototype " << name << std::endl;
+				break;
+			}
+
+			if (cur_prototype) {
+				std::cerr << "w: instances inside prototypes are not supported" << std::endl;
+				break;
+			}
+
+			cur_instance = Instance();
+			cur_instance->prototype = it->second;
+
+			break;
+		}
+
+		case GRID: {
+			glm::uvec3 counts;
+			glm::vec3 spacing;
+			in >> counts.x >> counts.y >> counts.z >> spacing.x >> spacing.y >> spacing.z;
+
+			if (cur_instance) {
+				cur_instance->layout = InstanceLayout::grid;
+				cur_instance->counts = glm::max(counts, glm::uvec3(1, 1, 1));
+				cur_instance->spacing = spacing;
+			}
+
+			break;
+		}
+
+		case RING: {
+			unsigned count;
+			float radius;
+			in >> count >> radius;
+
+			if (cur_instance) {
+				cur_instance->layout = InstanceLayout::ring;
+				cur_instance->counts = glm::uvec3(std::max(count, 1u), 1, 1);
+				cur_instance->radius = radius;
+			}
+
+			break;
+		}
 
 		case PLANE: {
 			glm::vec3 normal;
 			in >> normal.x >> normal.y >> normal.z;
 
-			cur_primitive_type = plane;
-			cur_primitive = std::make_unique<Plane>(normal);
+			Plane pr(normal);
+			pr.position = cur_position;
+			pr.rotation = cur_rotation;
+			pr.color = cur_color;
 
-			cur_primitive->position = cur_position;
-			cur_primitive->rotation = cur_rotation;
-			cur_primitive->color = cur_color;
+			cur_primitive = pr;
 
 			break;
 		}
@@ -238,12 +552,12 @@ Scene read_scene(std::istream &in) {
 			glm::vec3 axes;
 			in >> axes.x >> axes.y >> axes.z;
 
-			cur_primitive_type = ellipsoid;
-			cur_primitive = std::make_unique<Ellipsoid>(axes);
+			Ellipsoid pr(axes);
+			pr.position = cur_position;
+			pr.rotation = cur_rotation;
+			pr.color = cur_color;
 
-			cur_primitive->position = cur_position;
-			cur_primitive->rotation = cur_rotation;
-			cur_primitive->color = cur_color;
+			cur_primitive = pr;
 
 			break;
 		}
@@ -252,12 +566,12 @@ Scene read_scene(std::istream &in) {
 			glm::vec3 semi_axes;
 			in >> semi_axes.x >> semi_axes.y >> semi_axes.z;
 
-			cur_primitive_type = box;
-			cur_primitive = std::make_unique<Box>(semi_axes);
+			Box pr(semi_axes);
+			pr.position = cur_position;
+			pr.rotation = cur_rotation;
+			pr.color = cur_color;
 
-			cur_primitive->position = cur_position;
-			cur_primitive->rotation = cur_rotation;
-			cur_primitive->color = cur_color;
+			cur_primitive = pr;
 
 			break;
 		}
@@ -267,9 +581,12 @@ Scene read_scene(std::istream &in) {
 		}
 	}
 
-	if (cur_primitive) {
-		emit_primitive();
+	if (cur_prototype) {
+		std::cerr << "w: prototype " << cur_prototype->name << " is not ended" << std::endl;
+		end_prototype();
 	}
 
+	emit_block();
+
 	return scene;
 }
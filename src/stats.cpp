@@ -0,0 +1,363 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+
+#include "trace.h"
+
+uint64_t StatCounters::total_tests() const {
+	uint64_t result = 0;
+	for (uint64_t n : tests) {
+		result += n;
+	}
+
+	return result;
+}
+
+uint64_t StatCounters::total_hits() const {
+	uint64_t result = 0;
+	for (uint64_t n : hits) {
+		result += n;
+	}
+
+	return result;
+}
+
+StatCounters &StatCounters::operator += (const StatCounters &other) {
+	rays += other.rays;
+	node_visits += other.node_visits;
+	for (size_t i = 0; i < TYPE_SLOTS; i++) {
+		tests[i] += other.tests[i];
+		hits[i] += other.hits[i];
+	}
+
+	return *this;
+}
+
+StatCounters &StatCounters::operator -= (const StatCounters &other) {
+	rays -= other.rays;
+	node_visits -= other.node_visits;
+	for (size_t i = 0; i < TYPE_SLOTS; i++) {
+		tests[i] -= other.tests[i];
+		hits[i] -= other.hits[i];
+	}
+
+	return *this;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// per-thread counters
+
+namespace {
+
+// counters of live threads, and the sum of the ones that have exited; only
+// registration and collection lock, counting never does
+struct StatsRegistry {
+	std::mutex mutex;
+	std::vector<const StatCounters*> live;
+	StatCounters retired;
+	size_t threads = 0;
+};
+
+// never destroyed: the pool's workers retire their slots when they are
+// joined during static destruction, possibly after a static registry
+StatsRegistry &registry() {
+	static StatsRegistry &instance = *new StatsRegistry;
+	return instance;
+}
+
+struct ThreadSlot {
+	StatCounters counters;
+
+	// first counted in a render tile on the pool's threads
+	ThreadSlot() {
+		AllowAllocScope allow;
+		StatsRegistry &r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		r.live.push_back(&counters);
+		r.threads++;
+	}
+
+	~ThreadSlot() {
+		StatsRegistry &r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		r.retired += counters;
+		r.live.erase(std::find(r.live.begin(), r.live.end(), &counters));
+	}
+};
+
+}
+
+StatCounters &thread_stats() {
+	thread_local ThreadSlot slot;
+	return slot.counters;
+}
+
+// counters of other threads are read without synchronization, callers
+// collect between phases, when workers are idle
+StatCounters collect_stats() {
+	StatsRegistry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	StatCounters result = r.retired;
+	for (const StatCounters *c : r.live) {
+		result += *c;
+	}
+
+	return result;
+}
+
+size_t stats_thread_count() {
+	StatsRegistry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	return r.threads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// phases
+
+void PhaseRecorder::begin(const char *name) {
+	current = name;
+	if (tracing) {
+		trace_begin = trace_clock();
+	}
+
+	if (!enabled) {
+		return;
+	}
+
+	phases.push_back({ name, 0, {}, {}, {}, 0 });
+	if constexpr (STATS_ENABLED) {
+		at_start = collect_stats();
+	}
+	if (perf) {
+		perf_at_start = read_perf_counters();
+	}
+	if constexpr (ALLOC_TRACKING_ENABLED) {
+		allocs_at_start = collect_allocations();
+	}
+	start = std::chrono::steady_clock::now();
+}
+
+void PhaseRecorder::end() {
+	if (tracing && current) {
+		trace_event(current, "phase", trace_begin, trace_clock());
+	}
+	current = nullptr;
+
+	if (!enabled || phases.empty()) {
+		return;
+	}
+
+	PhaseStats &phase = phases.back();
+	phase.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (perf) {
+		phase.perf = read_perf_counters();
+		phase.perf -= perf_at_start;
+	}
+	if constexpr (ALLOC_TRACKING_ENABLED) {
+		phase.allocs = collect_allocations();
+		phase.allocs -= allocs_at_start;
+	}
+	if constexpr (STATS_ENABLED) {
+		phase.counters = collect_stats();
+		phase.counters -= at_start;
+		phase.rays = phase.counters.rays;
+	}
+}
+
+void PhaseRecorder::estimate_rays(const char *name, uint64_t rays) {
+	for (PhaseStats &p : phases) {
+		if (p.name == name && p.rays == 0) {
+			p.rays = rays;
+		}
+	}
+}
+
+namespace {
+
+double per(uint64_t n, uint64_t d) {
+	return d > 0 ? double(n) / d : 0;
+}
+
+}
+
+void PhaseRecorder::print_table(std::ostream &out, const std::vector<std::string> &type_names) const {
+	if (!enabled) {
+		return;
+	}
+
+	char line[256];
+	double total = 0;
+
+	std::snprintf(line, sizeof(line), "%-10s %10s", "phase", "ms");
+	out << line;
+	if constexpr (STATS_ENABLED) {
+		std::snprintf(line, sizeof(line), " %12s %12s %12s %12s %10s %10s", "rays", "nodes", "tests", "hits", "nodes/ray", "tests/ray");
+		out << line;
+	}
+	if constexpr (ALLOC_TRACKING_ENABLED) {
+		std::snprintf(line, sizeof(line), " %10s %12s %6s %9s", "allocs", "alloc KB", "maps", "forbidden");
+		out << line;
+	}
+	out << "\n";
+
+	for (const PhaseStats &p : phases) {
+		const StatCounters &c = p.counters;
+		total += p.seconds;
+
+		std::snprintf(line, sizeof(line), "%-10s %10.2f", p.name.c_str(), p.seconds * 1e3);
+		out << line;
+		if constexpr (STATS_ENABLED) {
+			std::snprintf(line, sizeof(line), " %12llu %12llu %12llu %12llu %10.2f %10.2f",
+				(unsigned long long)c.rays, (unsigned long long)c.node_visits,
+				(unsigned long long)c.total_tests(), (unsigned long long)c.total_hits(),
+				per(c.node_visits, c.rays), per(c.total_tests(), c.rays));
+			out << line;
+		}
+		if constexpr (ALLOC_TRACKING_ENABLED) {
+			const AllocCounts &a = p.allocs;
+			std::snprintf(line, sizeof(line), " %10llu %12.1f %6llu %9llu", (unsigned long long)a.allocations,
+				(a.bytes + a.mapped_bytes) / 1024.0, (unsigned long long)a.maps, (unsigned long long)a.forbidden);
+			out << line;
+		}
+		out << "\n";
+	}
+
+	std::snprintf(line, sizeof(line), "%-10s %10.2f\n", "total", total * 1e3);
+	out << line;
+
+	if constexpr (!STATS_ENABLED) {
+		out << "counters compiled out, build with -DRAYTRACING_STATS=ON for them\n";
+		return;
+	}
+
+	StatCounters all;
+	for (const PhaseStats &p : phases) {
+		all += p.counters;
+	}
+
+	for (size_t i = 0; i < type_names.size() && i < StatCounters::TYPE_SLOTS; i++) {
+		std::snprintf(line, sizeof(line), "%-10s %12llu tests %12llu hits %6.2f%%\n", type_names[i].c_str(),
+			(unsigned long long)all.tests[i], (unsigned long long)all.hits[i], per(all.hits[i], all.tests[i]) * 100);
+		out << line;
+	}
+
+	out << stats_thread_count() << " threads counted\n";
+}
+
+namespace {
+
+// a count, or n/a where the counter could not be opened
+std::string perf_count(const PerfValues &v, PerfEvent event) {
+	return v.has(event) ? std::to_string(v[event]) : "n/a";
+}
+
+std::string perf_ratio(const PerfValues &v, PerfEvent n, PerfEvent d) {
+	char text[32];
+	std::snprintf(text, sizeof(text), "%.2f", per(v[n], v[d]));
+	return v.has(n) && v.has(d) ? text : "n/a";
+}
+
+std::string perf_per_ray(const PerfValues &v, PerfEvent event, uint64_t rays) {
+	char text[32];
+	std::snprintf(text, sizeof(text), "%.2f", per(v[event], rays));
+	return v.has(event) && rays > 0 ? text : "-";
+}
+
+}
+
+void PhaseRecorder::print_perf_table(std::ostream &out) const {
+	if (!enabled || !perf) {
+		return;
+	}
+
+	char line[256];
+
+	std::snprintf(line, sizeof(line), "%-10s %14s %14s %6s %12s %12s %12s %9s %9s %9s\n", "phase", "cycles", "instructions", "IPC",
+		"l1d miss", "llc miss", "br miss", "l1d/ray", "llc/ray", "br/ray");
+	out << line;
+
+	for (const PhaseStats &p : phases) {
+		const PerfValues &v = p.perf;
+		std::snprintf(line, sizeof(line), "%-10s %14s %14s %6s %12s %12s %12s %9s %9s %9s\n", p.name.c_str(),
+			perf_count(v, PerfEvent::cycles).c_str(), perf_count(v, PerfEvent::instructions).c_str(),
+			perf_ratio(v, PerfEvent::instructions, PerfEvent::cycles).c_str(),
+			perf_count(v, PerfEvent::l1d_misses).c_str(), perf_count(v, PerfEvent::llc_misses).c_str(),
+			perf_count(v, PerfEvent::branch_misses).c_str(),
+			perf_per_ray(v, PerfEvent::l1d_misses, p.rays).c_str(), perf_per_ray(v, PerfEvent::llc_misses, p.rays).c_str(),
+			perf_per_ray(v, PerfEvent::branch_misses, p.rays).c_str());
+		out << line;
+	}
+
+	// whole run, including work between phases
+	std::snprintf(line, sizeof(line), "%-10s %14s %14s %6s %12s %12s %12s\n", "thread", "cycles", "instructions", "IPC",
+		"l1d miss", "llc miss", "br miss");
+	out << line;
+
+	for (const ThreadPerf &t : read_perf_counters_per_thread()) {
+		const PerfValues &v = t.values;
+		std::snprintf(line, sizeof(line), "%-10s %14s %14s %6s %12s %12s %12s\n", t.name.c_str(),
+			perf_count(v, PerfEvent::cycles).c_str(), perf_count(v, PerfEvent::instructions).c_str(),
+			perf_ratio(v, PerfEvent::instructions, PerfEvent::cycles).c_str(),
+			perf_count(v, PerfEvent::l1d_misses).c_str(), perf_count(v, PerfEvent::llc_misses).c_str(),
+			perf_count(v, PerfEvent::branch_misses).c_str());
+		out << line;
+	}
+}
+
+void PhaseRecorder::write_json(std::ostream &out, const std::vector<std::string> &type_names) const {
+	if (!enabled) {
+		return;
+	}
+
+	out << "{\n\t\"counters\": " << (STATS_ENABLED ? "true" : "false") << ",\n";
+	out << "\t\"allocation_tracking\": " << (ALLOC_TRACKING_ENABLED ? "true" : "false") << ",\n";
+	if constexpr (STATS_ENABLED) {
+		out << "\t\"threads\": " << stats_thread_count() << ",\n";
+	}
+	out << "\t\"phases\": [\n";
+
+	for (size_t k = 0; k < phases.size(); k++) {
+		const PhaseStats &p = phases[k];
+		const StatCounters &c = p.counters;
+
+		out << "\t\t{ \"name\": \"" << p.name << "\", \"ms\": " << p.seconds * 1e3;
+		if constexpr (STATS_ENABLED) {
+			out << ", \"rays\": " << c.rays << ", \"node_visits\": " << c.node_visits << ", \"tests\": {";
+			for (size_t i = 0; i < type_names.size() && i < StatCounters::TYPE_SLOTS; i++) {
+				out << (i > 0 ? ", " : " ") << "\"" << type_names[i] << "\": " << c.tests[i];
+			}
+			out << " }, \"hits\": {";
+			for (size_t i = 0; i < type_names.size() && i < StatCounters::TYPE_SLOTS; i++) {
+				out << (i > 0 ? ", " : " ") << "\"" << type_names[i] << "\": " << c.hits[i];
+			}
+			out << " }";
+		}
+		if constexpr (ALLOC_TRACKING_ENABLED) {
+			const AllocCounts &a = p.allocs;
+			out << ", \"allocations\": { \"count\": " << a.allocations << ", \"bytes\": " << a.bytes
+				<< ", \"frees\": " << a.frees << ", \"maps\": " << a.maps << ", \"mapped_bytes\": " << a.mapped_bytes
+				<< ", \"forbidden\": " << a.forbidden << " }";
+		}
+		if (perf) {
+			if constexpr (!STATS_ENABLED) {
+				out << ", \"rays\": " << p.rays;
+			}
+			out << ", \"perf\": {";
+			bool first = true;
+			for (size_t i = 0; i < PERF_EVENTS; i++) {
+				if (p.perf.available[i]) {
+					out << (first ? " " : ", ") << "\"" << to_string((PerfEvent)i) << "\": " << p.perf.counts[i];
+					first = false;
+				}
+			}
+			out << " }";
+		}
+		out << " }" << (k + 1 < phases.size() ? "," : "") << "\n";
+	}
+
+	out << "\t]\n}\n";
+}
@@ -0,0 +1,225 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "alloc_tracking.h"
+
+std::atomic<bool> tracing { false };
+
+namespace {
+
+// events kept per thread, older ones are overwritten
+const size_t RING_SIZE = 1 << 16;
+
+struct TraceBuffer {
+	size_t id;
+	std::string name;
+	std::unique_ptr<TraceEvent[]> events { new TraceEvent[RING_SIZE] };
+	std::atomic<uint64_t> written { 0 };
+};
+
+// buffers outlive their threads, the pool's workers are replaced whenever
+// the thread count changes
+struct TraceRegistry {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<TraceBuffer>> buffers;
+	std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+};
+
+TraceRegistry &registry() {
+	static TraceRegistry instance;
+	return instance;
+}
+
+thread_local const char *thread_name = "thread";
+
+// created on the first event of a thread, so that threads that never trace
+// cost nothing
+TraceBuffer &thread_buffer() {
+	thread_local TraceBuffer *buffer = nullptr;
+
+	if (!buffer) {
+		AllowAllocScope allow;
+		TraceRegistry &r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+
+		r.buffers.push_back(std::make_unique<TraceBuffer>());
+		buffer = r.buffers.back().get();
+		buffer->id = r.buffers.size();
+		buffer->name = std::string(thread_name) + " " + std::to_string(buffer->id);
+	}
+
+	return *buffer;
+}
+
+// the events still in a buffer, oldest first
+std::vector<TraceEvent> events_of(const TraceBuffer &b, uint64_t &dropped) {
+	uint64_t written = b.written.load(std::memory_order_acquire);
+	uint64_t first = written > RING_SIZE ? written - RING_SIZE : 0;
+
+	std::vector<TraceEvent> result;
+	for (uint64_t i = first; i < written; i++) {
+		result.push_back(b.events[i % RING_SIZE]);
+	}
+
+	dropped = first;
+	return result;
+}
+
+}
+
+void start_tracing() {
+	registry().origin = std::chrono::steady_clock::now();
+	tracing = true;
+}
+
+void stop_tracing() {
+	tracing = false;
+}
+
+uint64_t trace_clock() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - registry().origin).count();
+}
+
+void trace_event(const char *name, const char *category, uint64_t begin_ns, uint64_t end_ns, int64_t arg) {
+	TraceBuffer &b = thread_buffer();
+
+	// only this thread writes the buffer; the release store publishes the
+	// event to the exporter
+	uint64_t w = b.written.load(std::memory_order_relaxed);
+	b.events[w % RING_SIZE] = { name, category, begin_ns, end_ns, arg };
+	b.written.store(w + 1, std::memory_order_release);
+}
+
+void trace_thread_name(const char *name) {
+	thread_name = name;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// export
+
+void write_chrome_trace(std::ostream &out) {
+	TraceRegistry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	char line[512];
+	bool first = true;
+	auto separator = [&]() {
+		const char *s = first ? "\n\t\t" : ",\n\t\t";
+		first = false;
+		return s;
+	};
+
+	out << "{\n\t\"displayTimeUnit\": \"ms\",\n\t\"traceEvents\": [";
+
+	for (const auto &b : r.buffers) {
+		std::snprintf(line, sizeof(line),
+			"{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": { \"name\": \"%s\" } }",
+			b->id, b->name.c_str());
+		out << separator() << line;
+
+		uint64_t dropped;
+		for (const TraceEvent &e : events_of(*b, dropped)) {
+			std::snprintf(line, sizeof(line),
+				"{ \"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %zu",
+				e.name, e.category, e.begin_ns * 1e-3, (e.end_ns - e.begin_ns) * 1e-3, b->id);
+			out << separator() << line;
+
+			if (e.arg >= 0) {
+				out << ", \"args\": { \"index\": " << e.arg << " }";
+			}
+			out << " }";
+		}
+
+		if (dropped > 0) {
+			std::fprintf(stderr, "w: trace: %s overflowed its ring, the oldest %llu events are missing\n",
+				b->name.c_str(), (unsigned long long)dropped);
+		}
+	}
+
+	out << "\n\t]\n}\n";
+}
+
+void print_trace_summary(std::ostream &out) {
+	TraceRegistry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	struct ThreadEvents {
+		const TraceBuffer *buffer;
+		std::vector<TraceEvent> events;
+	};
+
+	std::vector<ThreadEvents> threads;
+	std::vector<TraceEvent> renders;
+	for (const auto &b : r.buffers) {
+		uint64_t dropped;
+		threads.push_back({ b.get(), events_of(*b, dropped) });
+
+		for (const TraceEvent &e : threads.back().events) {
+			if (std::string(e.category) == "phase" && std::string(e.name) == "render") {
+				renders.push_back(e);
+			}
+		}
+	}
+
+	if (renders.empty()) {
+		out << "trace: no render phase recorded\n";
+		return;
+	}
+
+	uint64_t render_ns = 0;
+	for (const TraceEvent &render : renders) {
+		render_ns += render.end_ns - render.begin_ns;
+	}
+
+	char line[256];
+	std::snprintf(line, sizeof(line), "%-12s %8s %12s %12s %8s\n", "thread", "tiles", "busy ms", "idle ms", "idle");
+	out << line;
+
+	TraceEvent longest { "", "", 0, 0, -1 };
+	uint64_t first_done = UINT64_MAX, last_done = 0;
+
+	for (const ThreadEvents &t : threads) {
+		uint64_t busy = 0, last_end = 0;
+		size_t tiles = 0;
+
+		for (const TraceEvent &e : t.events) {
+			if (std::string(e.name) != "tile") {
+				continue;
+			}
+
+			tiles++;
+			busy += e.end_ns - e.begin_ns;
+			last_end = std::max(last_end, e.end_ns);
+
+			if (e.end_ns - e.begin_ns > longest.end_ns - longest.begin_ns) {
+				longest = e;
+			}
+		}
+
+		if (tiles == 0) {
+			continue;
+		}
+
+		first_done = std::min(first_done, last_end);
+		last_done = std::max(last_done, last_end);
+
+		uint64_t idle = render_ns > busy ? render_ns - busy : 0;
+		std::snprintf(line, sizeof(line), "%-12s %8zu %12.2f %12.2f %7.1f%%\n",
+			t.buffer->name.c_str(), tiles, busy * 1e-6, idle * 1e-6, 100.0 * idle / render_ns);
+		out << line;
+	}
+
+	if (longest.arg >= 0) {
+		std::snprintf(line, sizeof(line), "longest tile %lld: %.3f ms, tail after the first thread ran out of tiles: %.3f ms\n",
+			(long long)longest.arg, (longest.end_ns - longest.begin_ns) * 1e-6, (last_done - first_done) * 1e-6);
+		out << line;
+	}
+}
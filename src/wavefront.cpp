@@ -0,0 +1,337 @@
+#include "wavefront.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "alloc_tracking.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "scratch.h"
+#include "stats.h"
+#include "trace.h"
+
+using std::uint32_t;
+
+namespace {
+
+const size_t BATCH_SIZE = 1 << 12;
+
+// work items a queue holds before its kernel runs in the middle of a stage
+const size_t QUEUE_SIZE = 4 * BATCH_SIZE;
+const uint32_t REF_INDEX_MASK = (1u << 30) - 1;
+
+// a ray and a primitive of type T to intersect it with
+template <typename T>
+struct WorkItem {
+	uint32_t ray, primitive;
+};
+
+template <typename T>
+using QueueOf = std::vector<WorkItem<T>>;
+
+// BVH traversal that can stop at a leaf and be resumed later
+struct TraversalState {
+	struct Entry {
+		uint32_t node;
+		float t;
+	};
+
+	Entry stack[64];
+	uint32_t top = 0;
+	uint32_t cur = 0;
+	bool at_leaf = false, done = false;
+
+	// walks on from cur and returns the next leaf the ray reaches before
+	// t_max, or null once the traversal is over; the stack is only popped on
+	// the following call, so that it sees the hits of the kernels in between
+	const BVHNode *next_leaf(const BVH &bvh, const RayInv &ray, float t_max) {
+		const float INF = std::numeric_limits<float>::infinity();
+
+		if (at_leaf) {
+			at_leaf = false;
+			pop(t_max);
+		}
+
+		while (!done) {
+			const BVHNode &node = bvh.nodes[cur];
+			count_node_visit();
+
+			if (node.is_leaf()) {
+				at_leaf = true;
+				return &node;
+			}
+
+			uint32_t near = node.left_first, far = node.left_first + 1;
+			float t_near = slab_entry(bvh.nodes[near].bounds, ray, t_max);
+			float t_far = slab_entry(bvh.nodes[far].bounds, ray, t_max);
+
+			if (t_far < t_near) {
+				std::swap(near, far);
+				std::swap(t_near, t_far);
+			}
+
+			if (t_near != INF) {
+				if (t_far != INF) {
+					stack[top++] = { far, t_far };
+				}
+
+				cur = near;
+			} else {
+				pop(t_max);
+			}
+		}
+
+		return nullptr;
+	}
+
+	// moves cur to the next stacked subtree still in front of t_max
+	void pop(float t_max) {
+		while (top > 0) {
+			Entry e = stack[--top];
+			if (e.t <= t_max) {
+				cur = e.node;
+				return;
+			}
+		}
+
+		done = true;
+	}
+};
+
+// buffers of a wavefront render, kept per thread between renders
+struct WavefrontScratch {
+	std::vector<Ray> rays;
+	std::vector<RayInv> inv;
+	std::vector<Hit> hits;
+	std::vector<TraversalState> states;
+	std::vector<uint32_t> active, still_active;
+	PerType<QueueOf, PrimitiveTypes> queues;
+	std::vector<float> dirs[3];
+
+	// the fast path's and the general path's pairs of the type in a kernel
+	std::unique_ptr<KernelBatch> batches[2];
+	uint32_t batch_rays[2][KernelBatch::SIZE], batch_primitives[2][KernelBatch::SIZE];
+};
+
+// takes batches off next_batch until there are none left, with the calling
+// thread's scratch
+void trace_batches(const Scene &scene, const TwoLevelBVH &accel, std::atomic<size_t> &next_batch,
+	Image &result, WavefrontStats &stats) {
+	const float INF = std::numeric_limits<float>::infinity();
+
+	const Blas &root = accel.root;
+	const BVH &bvh = root.bvh.binary;
+	size_t pixel_count = scene.width * scene.height;
+	size_t batches = (pixel_count + BATCH_SIZE - 1) / BATCH_SIZE;
+
+	WavefrontScratch &scratch = thread_scratch<WavefrontScratch>();
+	auto &rays = scratch.rays;
+	auto &inv = scratch.inv;
+	auto &hits = scratch.hits;
+	auto &states = scratch.states;
+	auto &active = scratch.active;
+	auto &still_active = scratch.still_active;
+	auto &queues = scratch.queues;
+	auto &dirs = scratch.dirs;
+
+	// sized once per thread for any scene, so that batches do not allocate
+	states.resize(BATCH_SIZE);
+	rays.reserve(BATCH_SIZE); inv.reserve(BATCH_SIZE); hits.reserve(BATCH_SIZE);
+	active.reserve(BATCH_SIZE); still_active.reserve(BATCH_SIZE);
+	for (int axis = 0; axis < 3; axis++) {
+		dirs[axis].reserve(BATCH_SIZE);
+	}
+	for_each_type(PrimitiveTypes{}, [&](auto tag) {
+		using T = typename decltype(tag)::type;
+		queues.get<T>().reserve(QUEUE_SIZE);
+	});
+	for (auto &batch : scratch.batches) {
+		if (!batch) {
+			batch.reset(new KernelBatch());
+		}
+	}
+	auto &batch_rays = scratch.batch_rays;
+	auto &batch_primitives = scratch.batch_primitives;
+
+	const Kernels &kernels = active_kernels();
+	RayGenParams params = ray_gen_params(scene);
+
+	// the kernels of one type, empty the type's queue
+	auto run_kernel = [&](auto tag) {
+		using T = typename decltype(tag)::type;
+
+		auto &queue = queues.get<T>();
+		const auto &list = root.primitives->get<T>();
+		stats.work_items[type_index_v<T, PrimitiveTypes>] += queue.size();
+
+		// slot 0 holds fast-path pairs, slot 1 general ones
+		auto flush = [&](int general) {
+			KernelBatch &batch = *scratch.batches[general];
+			batch_kernel(kernels, list[batch_primitives[general][0]])(batch);
+
+			size_t batch_hits = 0;
+			for (size_t k = 0; k < batch.size; k++) {
+				uint32_t ray = batch_rays[general][k];
+				if (batch.t[k] < hits[ray].t) {
+					hits[ray].t = batch.t[k];
+					hits[ray].color = list[batch_primitives[general][k]].color;
+				}
+				batch_hits += batch.t[k] != INF;
+			}
+
+			count_tests(type_index_v<T, PrimitiveTypes>, batch.size, batch_hits);
+			batch.size = 0;
+		};
+
+		for (const WorkItem<T> &w : queue) {
+			const T &pr = list[w.primitive];
+			int general = pr.fast_path == FastPath::none;
+
+			KernelBatch &batch = *scratch.batches[general];
+			size_t k = batch.size++;
+			batch_rays[general][k] = w.ray;
+			batch_primitives[general][k] = w.primitive;
+			load_pair(batch, k, rays[w.ray], pr);
+
+			if (batch.size == KernelBatch::SIZE) {
+				flush(general);
+			}
+		}
+
+		for (int general = 0; general < 2; general++) {
+			if (scratch.batches[general]->size > 0) {
+				flush(general);
+			}
+		}
+
+		queue.clear();
+	};
+
+	// a full queue runs its kernel early, which only lowers the t_max of
+	// the traversals still to come
+	auto enqueue = [&](auto tag, uint32_t ray, uint32_t primitive) {
+		using T = typename decltype(tag)::type;
+
+		auto &queue = queues.get<T>();
+		queue.push_back({ ray, primitive });
+		if (queue.size() == QUEUE_SIZE) {
+			run_kernel(tag);
+		}
+	};
+
+	for (size_t b; (b = next_batch++) < batches; ) {
+		TraceScope scope("batch", "render", b);
+		NoAllocScope no_alloc;
+
+		size_t first = b * BATCH_SIZE;
+		size_t n = std::min(BATCH_SIZE, pixel_count - first);
+		stats.batches++;
+
+		rays.clear(); inv.clear(); hits.assign(n, Hit());
+		active.clear();
+
+		// directions row segment by row segment
+		for (int axis = 0; axis < 3; axis++) {
+			dirs[axis].resize(n);
+		}
+		for (size_t i = 0; i < n; ) {
+			size_t pixel = first + i, x = pixel % scene.width;
+			size_t count = std::min(n - i, scene.width - x);
+
+			kernels.generate_directions(params, pixel / scene.width, x, count, &dirs[0][i], &dirs[1][i], &dirs[2][i]);
+			count_rays(count);
+			i += count;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			rays.push_back({ scene.camera_position, glm::vec3(dirs[0][i], dirs[1][i], dirs[2][i]) });
+			inv.emplace_back(rays[i].o, rays[i].d);
+
+			states[i] = TraversalState();
+			if (!bvh.empty() && slab_entry(bvh.nodes[0].bounds, inv[i], INF) != INF) {
+				active.push_back(i);
+			}
+		}
+
+		// every ray meets every plane
+		for_each_type(PrimitiveTypes{}, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+
+			if constexpr (!is_bounded_v<T>) {
+				for (uint32_t p = 0; p < root.primitives->get<T>().size(); p++) {
+					for (uint32_t i = 0; i < n; i++) {
+						enqueue(tag, i, p);
+					}
+				}
+			}
+		});
+
+		bool first_round = true;
+		while (first_round || !active.empty()) {
+			first_round = false;
+			stats.rounds++;
+
+			// traversal stage
+			still_active.clear();
+			for (uint32_t i : active) {
+				const BVHNode *leaf = states[i].next_leaf(bvh, inv[i], hits[i].t);
+				if (!leaf) {
+					continue;
+				}
+
+				for (uint32_t k = leaf->left_first; k < leaf->left_first + leaf->count; k++) {
+					uint32_t ref = root.refs[bvh.items[k]];
+
+					visit_type_index(PrimitiveTypes{}, ref >> 30, [&](auto tag) {
+						enqueue(tag, i, ref & REF_INDEX_MASK);
+					});
+				}
+
+				still_active.push_back(i);
+			}
+			active.swap(still_active);
+
+			for_each_type(TypeList<Ellipsoid, Box, Plane>{}, run_kernel);
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			accel.intersect_instances(rays[i], hits[i]);
+
+			size_t pixel = first + i;
+			result.data[pixel / scene.width][pixel % scene.width] = hits[i].t != INF ? hits[i].color : scene.bg_color;
+		}
+	}
+}
+
+}
+
+Image render_scene_wavefront(const Scene &scene, const TwoLevelBVH &accel, WavefrontStats &stats) {
+	if (accel.root.bvh.kind != HierarchyKind::binary) {
+		return render_scene(scene, accel);
+	}
+
+	Image result(scene.width, scene.height);
+	size_t batches = (scene.width * scene.height + BATCH_SIZE - 1) / BATCH_SIZE;
+	std::atomic<size_t> next_batch { 0 };
+	std::mutex mutex;
+
+	// one wavefront per thread, batches go to whichever thread is free
+	parallel_chunks(batches, std::min(thread_pool().size(), batches), [&](size_t, size_t, size_t) {
+		WavefrontStats local;
+		trace_batches(scene, accel, next_batch, result, local);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.batches += local.batches;
+		stats.rounds += local.rounds;
+		for (size_t k = 0; k < PrimitiveTypes::size; k++) {
+			stats.work_items[k] += local.work_items[k];
+		}
+	});
+
+	return result;
+}
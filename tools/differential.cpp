@@ -0,0 +1,887 @@
+// Differential test of every renderer against the brute-force reference,
+// Scene::get_pixel_color in float, on randomized scenes: every BVH builder
+// and layout, the wide, lazy and grid hierarchies, packets, wavefront,
+// occlusion culling, the compact stores, out-of-core chunks and the other
+// brute-force precisions, under every kernel ISA the CPU supports and every
+// given thread count.
+//
+// usage: differential [--scenes=N] [--seed=S] [--count=N] [--width=W] [--height=H]
+//                     [--threads=1,4] [--isa=scalar,avx2,...] [--filter=<substring>]
+//                     [--reproducers=<prefix>] [--max-reproducers=N] [--work-dir=<dir>]
+//
+// Every primitive, and every instance that recolors its prototype, gets a
+// color of its own that encodes its id, so a rendered image is both the
+// color buffer and the primitive-id buffer of the renderer. A pixel that
+// differs from the reference is
+//   a tie          if both primitives are hit at the same distance, the
+//                  order in which they are tested decides;
+//   precision      for the double and refined brute force, if the double
+//                  reference agrees with it;
+//   approximate    for the compact stores, whose half precision shapes and
+//                  rotation codes are lossy by design, if the hit is within
+//                  their tolerance of the reference's or the rendered id is
+//                  next to the pixel in the reference, a silhouette that
+//                  moved; more than 1% approximate pixels fail the render;
+// and a failure otherwise. The first failures are narrowed down to the
+// primary ray and a minimal scene, by dropping blocks of the scene while
+// the pixel still fails, which is written to <prefix>-<seed>-<renderer>.txt.
+// Built with RAYTRACING_ALLOC_TRACKING, a render that allocates in its
+// per-pixel loops, inside a NoAllocScope, fails as well. Exits with 1 if
+// anything failed.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "accel.h"
+#include "alloc_tracking.h"
+#include "compact.h"
+#include "image.h"
+#include "kernels.h"
+#include "occlusion.h"
+#include "out_of_core.h"
+#include "parallel.h"
+#include "scene.h"
+#include "wavefront.h"
+
+namespace {
+
+const float INF = std::numeric_limits<float>::infinity();
+
+// relative distance below which two hits are a tie
+const float TIE_EPS = 1e-5f;
+
+// the compact stores move a surface by at most ~0.1 degree of rotation
+// (1.75e-3 radians) and 2^-11 of its size, see compact.h; relative distance
+// below which their hit is still the reference's surface
+const float APPROXIMATE_EPS = 2e-3f;
+
+// share of a render's pixels that may be approximate
+const double MAX_APPROXIMATE_SHARE = 0.01;
+
+///////////////////////////////////////////////////////////////////////////////
+// ids as colors
+
+// three base-32 digits at the centers of their intervals, robust to the
+// rounding of the half precision store; 0 is the black background
+const uint32_t DIGIT = 32;
+
+glm::vec3 id_color(uint32_t id) {
+	return (glm::vec3(id % DIGIT, id / DIGIT % DIGIT, id / (DIGIT * DIGIT) % DIGIT) + 0.5f) / float(DIGIT);
+}
+
+uint32_t color_id(const glm::vec3 &color) {
+	glm::ivec3 digits = glm::clamp(glm::ivec3(glm::floor(color * float(DIGIT))), 0, int(DIGIT) - 1);
+	return digits.x + digits.y * DIGIT + digits.z * DIGIT * DIGIT;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// scenes
+
+enum class SceneKind { mixed, axis_aligned, instances, inside, thin, planes, degenerate };
+const size_t SCENE_KINDS = 7;
+
+const char *to_string(SceneKind kind) {
+	switch (kind) {
+	case SceneKind::mixed:        return "mixed";
+	case SceneKind::axis_aligned: return "axis-aligned";
+	case SceneKind::instances:    return "instances";
+	case SceneKind::inside:       return "inside";
+	case SceneKind::thin:         return "thin";
+	case SceneKind::planes:       return "planes";
+	case SceneKind::degenerate:   return "degenerate";
+	}
+
+	return "";
+}
+
+// a scene as text, split into the blocks that minimization drops
+struct GeneratedScene {
+	unsigned seed;
+	SceneKind kind;
+	std::string header;                // dimensions, camera, background
+	std::vector<std::string> prototypes;
+	std::vector<std::string> blocks;   // root primitives and instances
+
+	// prototypes are always kept, unused ones cost nothing
+	std::string text(const std::vector<bool> *keep = nullptr) const {
+		std::string result = header;
+		for (const std::string &p : prototypes) {
+			result += p;
+		}
+		for (size_t i = 0; i < blocks.size(); i++) {
+			if (!keep || (*keep)[i]) {
+				result += blocks[i];
+			}
+		}
+
+		return result + "FIN\n";
+	}
+};
+
+struct SceneOptions {
+	size_t count = 120;
+	size_t width = 96, height = 72;
+};
+
+// writes floats so that read_scene gets them back exactly
+std::string vec(const glm::vec3 &v) {
+	char text[96];
+	std::snprintf(text, sizeof(text), "%.9g %.9g %.9g", v.x, v.y, v.z);
+	return text;
+}
+
+std::string quat(const glm::quat &q) {
+	char text[128];
+	std::snprintf(text, sizeof(text), "%.9g %.9g %.9g %.9g", q.x, q.y, q.z, q.w);
+	return text;
+}
+
+struct Generator {
+	std::mt19937 rng;
+	uint32_t next_id = 1;
+
+	explicit Generator(unsigned seed) : rng(seed) {}
+
+	float uniform(float lo, float hi) {
+		return std::uniform_real_distribution<float>(lo, hi)(rng);
+	}
+
+	bool chance(float p) {
+		return uniform(0, 1) < p;
+	}
+
+	glm::vec3 point(float extent) {
+		return glm::vec3(uniform(-extent, extent), uniform(-extent, extent), uniform(-extent, extent));
+	}
+
+	glm::quat rotation() {
+		std::normal_distribution<float> normal;
+		return glm::normalize(glm::quat(normal(rng), normal(rng), normal(rng), normal(rng)));
+	}
+
+	// sizes of a shape, up to `aspect` times apart
+	glm::vec3 size(float lo, float hi, float aspect) {
+		float s = uniform(lo, hi);
+		return glm::vec3(s * uniform(1, aspect), s * uniform(1, aspect), s * uniform(1, aspect)) / aspect * 2.f;
+	}
+
+	std::string primitive(const char *shape, const glm::vec3 &params, const glm::vec3 &position, const std::optional<glm::quat> &rot) {
+		std::string block = std::string("NEW_PRIMITIVE\n") + shape + " " + vec(params) + "\nPOSITION " + vec(position) + "\n";
+		if (rot.has_value()) {
+			block += "ROTATION " + quat(rot.value()) + "\n";
+		}
+
+		return block + "COLOR " + vec(id_color(next_id++)) + "\n";
+	}
+
+	// an ellipsoid or box of the given size, spheres and cubes now and then
+	// so that the fast paths get their share
+	std::string shape(float lo, float hi, float aspect, const glm::vec3 &position, float rotated) {
+		bool box = chance(0.5f);
+		glm::vec3 s = size(lo, hi, aspect);
+		if (chance(0.3f)) {
+			s = glm::vec3(s.x);
+		}
+
+		std::optional<glm::quat> rot;
+		if (chance(rotated)) {
+			rot = rotation();
+		}
+
+		return primitive(box ? "BOX" : "ELLIPSOID", s, position, rot);
+	}
+
+	std::string plane(const glm::vec3 &normal, const glm::vec3 &position) {
+		return primitive("PLANE", normal, position, {});
+	}
+};
+
+GeneratedScene generate_scene(unsigned seed, const SceneOptions &options) {
+	Generator g(seed);
+	GeneratedScene scene;
+	scene.seed = seed;
+	scene.kind = SceneKind(seed % SCENE_KINDS);
+
+	size_t n = options.count;
+	float extent = 2 * std::cbrt(float(n));
+	glm::vec3 target(0, 0, 0);
+	float distance = extent * g.uniform(2.2f, 3.f);
+
+	switch (scene.kind) {
+	case SceneKind::mixed:
+		scene.blocks.push_back(g.plane(glm::vec3(0, 1, 0), glm::vec3(0, -extent, 0)));
+		for (size_t i = 0; i < n; i++) {
+			scene.blocks.push_back(g.shape(0.2f, 1.5f, 3, g.point(extent), 0.5f));
+		}
+		break;
+
+	case SceneKind::axis_aligned:
+		// overlapping and nested boxes and spheres on the fast paths, some
+		// on a lattice where faces meet
+		for (size_t i = 0; i < n; i++) {
+			glm::vec3 p = g.chance(0.3f) ? glm::round(g.point(extent)) : g.point(extent);
+			scene.blocks.push_back(g.shape(0.3f, 2, 2, p, 0));
+		}
+		break;
+
+	case SceneKind::instances: {
+		scene.blocks.push_back(g.plane(glm::vec3(0, 1, 0), glm::vec3(0, -extent, 0)));
+
+		size_t prototypes = 3;
+		for (size_t p = 0; p < prototypes; p++) {
+			std::string proto = "NEW_PROTOTYPE p" + std::to_string(p) + "\n";
+			size_t parts = 1 + g.rng() % 4;
+			for (size_t k = 0; k < parts; k++) {
+				proto += g.shape(0.2f, 0.8f, 3, g.point(0.8f), 0.5f);
+			}
+			scene.prototypes.push_back(proto + "END_PROTOTYPE\n");
+		}
+
+		for (size_t i = 0; i < n / 10 + 1; i++) {
+			std::string inst = "NEW_INSTANCE p" + std::to_string(g.rng() % prototypes) + "\nPOSITION " + vec(g.point(extent)) + "\n";
+			if (g.chance(0.5f)) {
+				inst += "ROTATION " + quat(g.rotation()) + "\n";
+			}
+			if (g.chance(0.5f)) {
+				inst += "COLOR " + vec(id_color(g.next_id++)) + "\n";
+			}
+
+			if (g.chance(0.5f)) {
+				inst += "GRID " + std::to_string(1 + g.rng() % 3) + " " + std::to_string(1 + g.rng() % 3) + " "
+					+ std::to_string(1 + g.rng() % 3) + " " + vec(glm::vec3(g.uniform(1.5f, 3), g.uniform(1.5f, 3), g.uniform(1.5f, 3))) + "\n";
+			} else {
+				char ring[64];
+				std::snprintf(ring, sizeof(ring), "RING %u %.9g\n", unsigned(2 + g.rng() % 8), g.uniform(1.5f, 4));
+				inst += ring;
+			}
+			scene.blocks.push_back(inst);
+		}
+
+		for (size_t i = 0; i < n / 2; i++) {
+			scene.blocks.push_back(g.shape(0.2f, 1, 3, g.point(extent), 0.5f));
+		}
+		break;
+	}
+
+	case SceneKind::inside:
+		// the camera sits inside a large shape, rays start within it
+		distance = 0;
+		scene.blocks.push_back(g.shape(extent * 1.5f, extent * 2, 1.5f, glm::vec3(0), 0.5f));
+		for (size_t i = 0; i < n; i++) {
+			scene.blocks.push_back(g.shape(0.2f, 1, 3, g.point(extent), 0.5f));
+		}
+		break;
+
+	case SceneKind::thin:
+		// flat and needle-like shapes seen at grazing angles
+		for (size_t i = 0; i < n; i++) {
+			scene.blocks.push_back(g.shape(0.5f, 3, 40, g.point(extent), 0.7f));
+		}
+		break;
+
+	case SceneKind::planes:
+		for (size_t i = 0; i < 4; i++) {
+			scene.blocks.push_back(g.plane(glm::normalize(g.point(1) + glm::vec3(0, 0.2f, 0)), g.point(extent)));
+		}
+		for (size_t i = 0; i < n / 4; i++) {
+			scene.blocks.push_back(g.shape(0.3f, 1.5f, 3, g.point(extent), 0.5f));
+		}
+		break;
+
+	case SceneKind::degenerate:
+		// hundreds of crossing slabs and needles sharing one centroid, which
+		// the median and SAH builders put into a single leaf; with the chain
+		// of shapes at halving distances along the axes in turn, each taking
+		// a Morton bit of its own, the LBVH reaches MAX_DEPTH right above them
+		for (size_t i = 0; i < std::max<size_t>(n, 300); i++) {
+			scene.blocks.push_back(g.shape(0.5f, 3, 20, glm::vec3(0), 0.7f));
+		}
+		for (int k = 0; k < 63; k++) {
+			glm::vec3 p(0);
+			p[k % 3] = extent * std::ldexp(1.f, -k / 3);
+			scene.blocks.push_back(g.shape(p[k % 3] * 0.05f, p[k % 3] * 0.1f, 1, p, 0));
+		}
+		break;
+	}
+
+	// orbiting camera looking down at the target, right = up x forward
+	glm::vec3 forward = glm::normalize(g.point(1) - glm::vec3(0, 0.5f, 0));
+	glm::vec3 position = target - forward * distance;
+	glm::vec3 right = glm::normalize(glm::cross(glm::vec3(0, 1, 0), forward));
+	glm::vec3 up = glm::cross(forward, right);
+
+	char fov[64];
+	std::snprintf(fov, sizeof(fov), "CAMERA_FOV_X %.9g\n", g.uniform(0.8f, 1.6f));
+
+	scene.header = "DIMENSIONS " + std::to_string(options.width) + " " + std::to_string(options.height) + "\n"
+		+ "BG_COLOR 0 0 0\n"
+		+ "CAMERA_POSITION " + vec(position) + "\n"
+		+ "CAMERA_RIGHT " + vec(right) + "\n"
+		+ "CAMERA_UP " + vec(up) + "\n"
+		+ "CAMERA_FORWARD " + vec(forward) + "\n"
+		+ fov;
+
+	return scene;
+}
+
+Scene parse(const std::string &text) {
+	std::istringstream in(text);
+	return read_scene(in);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// renderers
+
+enum class Tolerance { exact, precision, approximate };
+
+struct Renderer {
+	std::string name;
+	Tolerance tolerance = Tolerance::exact;
+	bool roots_only = false; // ignores instances
+	std::function<std::optional<Image>(const std::string &text)> render;
+};
+
+std::optional<Image> render_bvh(const std::string &text, const BvhOptions &options) {
+	Scene scene = parse(text);
+	TwoLevelBVH accel(scene, options);
+	return render_scene(scene, accel);
+}
+
+template <typename Shape>
+std::optional<Image> render_compact(const std::string &text) {
+	CompactStore<Shape> store;
+	bool fits = true;
+
+	std::istringstream in(text);
+	Scene scene = read_scene(in, [&](const AnyPrimitive &pr) {
+		fits = fits && store.add(pr);
+	});
+
+	if (!fits) {
+		return {};
+	}
+
+	return render_image(scene.width, scene.height, [&](size_t x, size_t y) {
+		return store.get_pixel_color(scene, x, y);
+	});
+}
+
+std::vector<Renderer> make_renderers(const std::string &chunk_path) {
+	std::vector<Renderer> result;
+
+	for (BvhBuilder builder : { BvhBuilder::median, BvhBuilder::binned_sah, BvhBuilder::lbvh }) {
+		for (BvhLayout layout : { BvhLayout::build_order, BvhLayout::depth_first, BvhLayout::breadth_first,
+				BvhLayout::van_emde_boas, BvhLayout::treelets }) {
+			BvhOptions options;
+			options.builder = builder;
+			options.layout = layout;
+
+			result.push_back({ std::string("bvh-") + to_string(builder) + "-" + to_string(layout), Tolerance::exact, false,
+				[options](const std::string &text) { return render_bvh(text, options); } });
+		}
+
+		BvhOptions wide;
+		wide.builder = builder;
+		wide.wide = true;
+		result.push_back({ std::string("bvh8-") + to_string(builder), Tolerance::exact, false,
+			[wide](const std::string &text) { return render_bvh(text, wide); } });
+	}
+
+	BvhOptions lazy;
+	lazy.lazy = true;
+	result.push_back({ "lazy-bvh", Tolerance::exact, false, [lazy](const std::string &text) { return render_bvh(text, lazy); } });
+
+	BvhOptions grid;
+	grid.grid = true;
+	result.push_back({ "grid", Tolerance::exact, false, [grid](const std::string &text) { return render_bvh(text, grid); } });
+
+	result.push_back({ "packets", Tolerance::exact, false, [](const std::string &text) -> std::optional<Image> {
+		Scene scene = parse(text);
+		TwoLevelBVH accel(scene);
+		return render_scene_packets(scene, accel);
+	} });
+
+	result.push_back({ "wavefront", Tolerance::exact, false, [](const std::string &text) -> std::optional<Image> {
+		Scene scene = parse(text);
+		TwoLevelBVH accel(scene);
+		WavefrontStats stats;
+		return render_scene_wavefront(scene, accel, stats);
+	} });
+
+	// as main does it: occluders are rendered into the buffer, the root
+	// primitives it hides are culled, the rest is traversed behind it
+	result.push_back({ "occlusion", Tolerance::exact, false, [](const std::string &text) -> std::optional<Image> {
+		Scene scene = parse(text);
+		OcclusionBuffer buffer(scene);
+		CullStats stats;
+		scene = cull_occluded(scene, buffer, stats);
+
+		TwoLevelBVH accel(scene);
+		return render_scene(scene, accel, buffer);
+	} });
+
+	// small chunks and a small budget, so that chunks are evicted and
+	// paged in again while rendering
+	result.push_back({ "out-of-core", Tolerance::exact, false, [chunk_path](const std::string &text) -> std::optional<Image> {
+		OutOfCoreOptions options;
+		options.path = chunk_path;
+		options.chunk_primitives = 16;
+		options.memory_budget = 8 << 10;
+
+		ChunkWriter writer(options);
+		std::istringstream in(text);
+		Scene scene = read_scene(in, [&](const AnyPrimitive &pr) {
+			writer.add(pr);
+		});
+
+		std::optional<ChunkIndex> index = writer.finish();
+		if (!index.has_value()) {
+			return {};
+		}
+
+		OutOfCoreBVH accel(scene, std::move(index.value()), options);
+		Image image = render_scene(scene, accel);
+		if (accel.failed()) {
+			return {};
+		}
+
+		return image;
+	} });
+
+	for (Precision precision : { Precision::f64, Precision::refined }) {
+		result.push_back({ std::string("brute-") + to_string(precision), Tolerance::precision, false,
+			[precision](const std::string &text) -> std::optional<Image> { return render_scene(parse(text), precision); } });
+	}
+
+	result.push_back({ "compact", Tolerance::approximate, true, render_compact<CompactShape> });
+	result.push_back({ "compact-half", Tolerance::approximate, true, render_compact<CompactHalfShape> });
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// comparison
+
+enum class Verdict { match, tie, precision, approximate, failure };
+
+// distance to the nearest surface with the given id, walked like the
+// reference walks root primitives and instance copies; infinite if missed
+float distance_to(const Scene &scene, uint32_t id, const Ray &ray) {
+	float best = INF;
+
+	auto walk = [&](const TypedVectors<PrimitiveTypes> &primitives, const Ray &r, const std::optional<glm::vec3> &recolor) {
+		for_each_type(PrimitiveTypes{}, [&](auto tag) {
+			using T = typename decltype(tag)::type;
+
+			for (const T &pr : primitives.get<T>()) {
+				if (color_id(recolor.value_or(pr.color)) != id) {
+					continue;
+				}
+
+				std::optional<float> t = intersect_t(pr, r);
+				if (t.has_value()) {
+					best = std::min(best, t.value());
+				}
+			}
+		});
+	};
+
+	walk(scene.primitives, ray, {});
+
+	for (const Instance &inst : scene.instances) {
+		Ray instance_ray = (ray - inst.position).rotate(glm::conjugate(inst.rotation));
+		const Prototype &proto = scene.prototypes[inst.prototype];
+
+		for (size_t i = 0; i < inst.copies(); i++) {
+			walk(proto.primitives, inst.to_copy_space(instance_ray, inst.copy_index(i)), inst.color);
+		}
+	}
+
+	return best;
+}
+
+// whether a neighbour of (x, y) shows the id in the reference
+bool next_to(const Scene &scene, size_t x, size_t y, uint32_t id) {
+	for (size_t ny = y > 0 ? y - 1 : 0; ny <= std::min(y + 1, scene.height - 1); ny++) {
+		for (size_t nx = x > 0 ? x - 1 : 0; nx <= std::min(x + 1, scene.width - 1); nx++) {
+			if ((nx != x || ny != y) && color_id(scene.get_pixel_color(nx, ny)) == id) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+struct PixelCheck {
+	Verdict verdict = Verdict::match;
+	uint32_t expected_id = 0, got_id = 0;
+	float expected_t = INF, got_t = INF;
+};
+
+PixelCheck check_pixel(const Scene &scene, const Renderer &renderer, size_t x, size_t y,
+	const glm::vec3 &expected, const glm::vec3 &got) {
+	PixelCheck check;
+	check.expected_id = color_id(expected);
+	check.got_id = color_id(got);
+
+	bool same = renderer.tolerance == Tolerance::approximate ? check.expected_id == check.got_id : expected == got;
+	if (same) {
+		return check;
+	}
+
+	Ray ray = scene.generate_ray_to_pixel(x, y);
+	check.expected_t = check.expected_id ? distance_to(scene, check.expected_id, ray) : INF;
+	check.got_t = check.got_id ? distance_to(scene, check.got_id, ray) : INF;
+
+	bool both_hit = std::isfinite(check.expected_t) && std::isfinite(check.got_t);
+	if (both_hit && check.expected_id != check.got_id
+			&& std::abs(check.expected_t - check.got_t) <= TIE_EPS * std::max(check.expected_t, check.got_t)) {
+		check.verdict = Verdict::tie;
+	} else if (renderer.tolerance == Tolerance::approximate
+			&& ((both_hit && std::abs(check.expected_t - check.got_t) <= APPROXIMATE_EPS * std::max(check.expected_t, check.got_t))
+				|| next_to(scene, x, y, check.got_id))) {
+		check.verdict = Verdict::approximate;
+	} else if (renderer.tolerance == Tolerance::precision
+			&& (scene.*scene.specialized_pixel_color(Precision::f64))(x, y) == got) {
+		check.verdict = Verdict::precision;
+	} else {
+		check.verdict = Verdict::failure;
+	}
+
+	return check;
+}
+
+struct Tally {
+	size_t renders = 0, skipped = 0, errors = 0;
+	size_t pixels = 0, ties = 0, precision = 0, approximate = 0, failures = 0;
+};
+
+struct Failure {
+	const Renderer *renderer;
+	Isa isa;
+	size_t threads;
+	size_t x, y;
+	PixelCheck check;
+};
+
+// whether (x, y) still fails with only the kept blocks
+bool still_fails(const GeneratedScene &generated, const std::vector<bool> &keep, const Renderer &renderer, size_t x, size_t y) {
+	std::string text = generated.text(&keep);
+	Scene scene = parse(text);
+	std::optional<Image> image = renderer.render(text);
+	if (!image.has_value()) {
+		return false;
+	}
+
+	glm::vec3 expected = scene.get_pixel_color(x, y);
+	return check_pixel(scene, renderer, x, y, expected, image->data[y][x]).verdict == Verdict::failure;
+}
+
+// every trial renders the whole image, failures that need hundreds of
+// primitives in one leaf would otherwise take quadratically many
+const size_t MAX_MINIMIZE_TRIALS = 300;
+
+// drops halves, then quarters and so on of the remaining blocks while the
+// pixel keeps failing, down to single blocks until none can go or the
+// trials run out
+std::vector<bool> minimize(const GeneratedScene &generated, const Failure &f) {
+	std::vector<bool> keep(generated.blocks.size(), true);
+	size_t trials = 0;
+
+	for (size_t chunk = std::max<size_t>(keep.size() / 2, 1); trials < MAX_MINIMIZE_TRIALS; chunk = std::max<size_t>(chunk / 2, 1)) {
+		bool dropped = false;
+
+		for (size_t begin = 0; begin < keep.size() && trials < MAX_MINIMIZE_TRIALS; begin += chunk) {
+			std::vector<bool> trial = keep;
+			bool any = false;
+			for (size_t i = begin; i < std::min(begin + chunk, keep.size()); i++) {
+				any = any || trial[i];
+				trial[i] = false;
+			}
+
+			if (!any) {
+				continue;
+			}
+
+			trials++;
+			if (still_fails(generated, trial, *f.renderer, f.x, f.y)) {
+				keep = trial;
+				dropped = true;
+			}
+		}
+
+		if (chunk == 1 && !dropped) {
+			break;
+		}
+	}
+
+	return keep;
+}
+
+void report(const GeneratedScene &generated, const Failure &f, const char *prefix, bool minimize_scene) {
+	Scene scene = parse(generated.text());
+	Ray ray = scene.generate_ray_to_pixel(f.x, f.y);
+
+	std::fprintf(stderr, "e: %s, isa %s, %zu threads, scene %u (%s), pixel %zu %zu: id %u at t %g expected, id %u at t %g rendered\n",
+		f.renderer->name.c_str(), to_string(f.isa), f.threads, generated.seed, to_string(generated.kind), f.x, f.y,
+		f.check.expected_id, f.check.expected_t, f.check.got_id, f.check.got_t);
+	std::fprintf(stderr, "   ray origin %a %a %a direction %a %a %a\n   (%.9g %.9g %.9g, %.9g %.9g %.9g)\n",
+		ray.o.x, ray.o.y, ray.o.z, ray.d.x, ray.d.y, ray.d.z, ray.o.x, ray.o.y, ray.o.z, ray.d.x, ray.d.y, ray.d.z);
+
+	if (!minimize_scene) {
+		return;
+	}
+
+	std::vector<bool> keep = minimize(generated, f);
+	std::string path = std::string(prefix) + "-" + std::to_string(generated.seed) + "-" + f.renderer->name + ".txt";
+
+	std::ofstream out(path);
+	out << generated.text(&keep);
+	if (!out) {
+		std::fprintf(stderr, "e: cannot write %s\n", path.c_str());
+		return;
+	}
+
+	std::fprintf(stderr, "   minimal scene: %zu of %zu blocks in %s\n",
+		(size_t)std::count(keep.begin(), keep.end(), true), keep.size(), path.c_str());
+}
+
+std::vector<size_t> parse_list(const char *s) {
+	std::vector<size_t> result;
+	for (const char *p = s; *p; ) {
+		char *end;
+		result.push_back(std::strtoul(p, &end, 10));
+		p = *end == ',' ? end + 1 : end;
+		if (end == p && *p) {
+			break;
+		}
+	}
+
+	return result;
+}
+
+}
+
+int main(int argc, char **argv) {
+	size_t scenes = 12;
+	unsigned first_seed = 1;
+	SceneOptions options;
+	std::vector<size_t> threads = { 1, 4 };
+	std::vector<Isa> isas;
+	const char *filter = nullptr;
+	const char *prefix = "differential";
+	size_t max_reproducers = 3;
+	std::string work_dir = "/tmp";
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strncmp(argv[i], "--scenes=", 9) == 0) {
+			scenes = std::strtoul(argv[i] + 9, nullptr, 10);
+		} else if (std::strncmp(argv[i], "--seed=", 7) == 0) {
+			first_seed = std::strtoul(argv[i] + 7, nullptr, 10);
+		} else if (std::strncmp(argv[i], "--count=", 8) == 0) {
+			options.count = std::max<size_t>(std::strtoul(argv[i] + 8, nullptr, 10), 1);
+		} else if (std::strncmp(argv[i], "--width=", 8) == 0) {
+			options.width = std::max<size_t>(std::strtoul(argv[i] + 8, nullptr, 10), 1);
+		} else if (std::strncmp(argv[i], "--height=", 9) == 0) {
+			options.height = std::max<size_t>(std::strtoul(argv[i] + 9, nullptr, 10), 1);
+		} else if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+			threads = parse_list(argv[i] + 10);
+		} else if (std::strncmp(argv[i], "--isa=", 6) == 0) {
+			std::stringstream names(argv[i] + 6);
+			for (std::string name; std::getline(names, name, ','); ) {
+				std::optional<Isa> isa = parse_isa(name.c_str());
+				if (!isa.has_value()) {
+					std::fprintf(stderr, "e: unknown isa %s\n", name.c_str());
+					return 1;
+				}
+				isas.push_back(isa.value());
+			}
+		} else if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+			filter = argv[i] + 9;
+		} else if (std::strncmp(argv[i], "--reproducers=", 14) == 0) {
+			prefix = argv[i] + 14;
+		} else if (std::strncmp(argv[i], "--max-reproducers=", 18) == 0) {
+			max_reproducers = std::strtoul(argv[i] + 18, nullptr, 10);
+		} else if (std::strncmp(argv[i], "--work-dir=", 11) == 0) {
+			work_dir = argv[i] + 11;
+		} else {
+			std::fprintf(stderr, "usage: %s [--scenes=N] [--seed=S] [--count=N] [--width=W] [--height=H] [--threads=1,4] "
+				"[--isa=scalar,...] [--filter=<substring>] [--reproducers=<prefix>] [--max-reproducers=N] [--work-dir=<dir>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// every level up to the detected one by default
+	if (isas.empty()) {
+		for (Isa isa : { Isa::scalar, Isa::sse42, Isa::avx2, Isa::avx512 }) {
+			if (isa <= detect_isa()) {
+				isas.push_back(isa);
+			}
+		}
+	}
+
+	for (Isa isa : isas) {
+		if (isa > detect_isa()) {
+			std::fprintf(stderr, "e: this cpu does not support %s, at most %s\n", to_string(isa), to_string(detect_isa()));
+			return 1;
+		}
+	}
+
+	if (threads.empty()) {
+		threads = { 1 };
+	}
+
+	if (!ALLOC_TRACKING_ENABLED) {
+		std::fprintf(stderr, "i: built without RAYTRACING_ALLOC_TRACKING, allocations while rendering are not checked\n");
+	}
+
+	std::string chunk_path = work_dir + "/differential-" + std::to_string(getpid()) + ".chunks";
+	std::vector<Renderer> renderers = make_renderers(chunk_path);
+
+	std::map<std::string, Tally> tallies;
+	size_t reported = 0, failed_renders = 0;
+
+	for (size_t s = 0; s < scenes; s++) {
+		GeneratedScene generated = generate_scene(first_seed + s, options);
+		std::string text = generated.text();
+		Scene scene = parse(text);
+
+		Image reference = render_scene(scene);
+		size_t scene_failures = 0;
+
+		// a scene that shows little says little
+		std::vector<bool> visible;
+		size_t background = 0;
+		for (size_t y = 0; y < scene.height; y++) {
+			for (size_t x = 0; x < scene.width; x++) {
+				uint32_t id = color_id(reference.data[y][x]);
+				visible.resize(std::max<size_t>(visible.size(), id + 1));
+				visible[id] = true;
+				background += id == 0;
+			}
+		}
+
+		for (Isa isa : isas) {
+			select_isa(isa);
+
+			for (size_t t : threads) {
+				set_thread_count(t);
+
+				for (const Renderer &renderer : renderers) {
+					if (filter && renderer.name.find(filter) == std::string::npos) {
+						continue;
+					}
+
+					Tally &tally = tallies[renderer.name];
+					if (renderer.roots_only && !scene.instances.empty()) {
+						tally.skipped++;
+						continue;
+					}
+
+					uint64_t forbidden = collect_allocations().forbidden;
+					std::optional<Image> image = renderer.render(text);
+					forbidden = collect_allocations().forbidden - forbidden;
+
+					tally.renders++;
+					if (!image.has_value()) {
+						std::fprintf(stderr, "e: %s cannot render scene %u\n", renderer.name.c_str(), generated.seed);
+						tally.errors++;
+						failed_renders++;
+						continue;
+					}
+
+					// only counted with RAYTRACING_ALLOC_TRACKING
+					if (forbidden > 0) {
+						std::fprintf(stderr, "e: %s, isa %s, %zu threads, scene %u: %llu allocations while rendering pixels\n",
+							renderer.name.c_str(), to_string(isa), t, generated.seed, (unsigned long long)forbidden);
+						tally.errors++;
+						failed_renders++;
+					}
+
+					std::optional<Failure> first;
+					size_t approximate = 0;
+					for (size_t y = 0; y < scene.height; y++) {
+						for (size_t x = 0; x < scene.width; x++) {
+							tally.pixels++;
+
+							PixelCheck check = check_pixel(scene, renderer, x, y, reference.data[y][x], image->data[y][x]);
+							switch (check.verdict) {
+							case Verdict::match:       break;
+							case Verdict::tie:         tally.ties++;        break;
+							case Verdict::precision:   tally.precision++;   break;
+							case Verdict::approximate: tally.approximate++; approximate++; break;
+							case Verdict::failure:
+								tally.failures++;
+								scene_failures++;
+								if (!first.has_value()) {
+									first = Failure { &renderer, isa, t, x, y, check };
+								}
+								break;
+							}
+						}
+					}
+
+					// each pixel may be close, but not the whole image
+					if (approximate > MAX_APPROXIMATE_SHARE * scene.width * scene.height) {
+						std::fprintf(stderr, "e: %s, isa %s, %zu threads, scene %u: %zu of %zu pixels approximate\n",
+							renderer.name.c_str(), to_string(isa), t, generated.seed, approximate, scene.width * scene.height);
+						tally.errors++;
+						failed_renders++;
+					}
+
+					if (first.has_value()) {
+						report(generated, first.value(), prefix, reported < max_reproducers);
+						reported++;
+					}
+				}
+			}
+		}
+
+		std::fprintf(stderr, "i: scene %u (%s, %zu blocks): %zu ids visible, %.0f%% background, %zu failed pixels\n",
+			generated.seed, to_string(generated.kind), generated.blocks.size(), (size_t)std::count(visible.begin() + 1, visible.end(), true),
+			100.0 * background / (scene.width * scene.height), scene_failures);
+	}
+
+	select_isa(detect_isa());
+	std::remove(chunk_path.c_str());
+
+	std::printf("%-28s %8s %8s %10s %8s %10s %12s %10s\n", "renderer", "renders", "skipped", "pixels", "ties", "precision", "approximate", "failures");
+
+	size_t total_failures = 0;
+	for (const Renderer &renderer : renderers) {
+		auto it = tallies.find(renderer.name);
+		if (it == tallies.end()) {
+			continue;
+		}
+
+		const Tally &t = it->second;
+		total_failures += t.failures;
+		std::printf("%-28s %8zu %8zu %10zu %8zu %10zu %12zu %10zu\n", renderer.name.c_str(), t.renders, t.skipped, t.pixels,
+			t.ties, t.precision, t.approximate, t.failures);
+	}
+
+	if (total_failures > 0 || failed_renders > 0) {
+		std::fprintf(stderr, "e: %zu failed pixels, %zu failed renders\n", total_failures, failed_renders);
+		return 1;
+	}
+
+	return 0;
+}
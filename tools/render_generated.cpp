@@ -0,0 +1,51 @@
+// Renderer with the root primitives of one scene compiled in by scene_codegen,
+// see the CODEGEN_SCENE option in CMakeLists.txt. The scene file given at run
+// time supplies the camera, background and instances, so that one build
+// renders the fixed geometry from any number of camera poses; root primitives
+// in it are ignored.
+//
+// usage: render_generated <scene> <output.ppm>
+
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include "accel.h"
+#include "codegen.h"
+#include "image.h"
+#include "scene.h"
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		std::cerr << "usage: " << argv[0] << " <scene> <output.ppm>" << std::endl;
+		return 1;
+	}
+
+	std::ifstream in(argv[1]);
+	std::ofstream out(argv[2]);
+
+	size_t ignored = 0;
+	Scene scene = read_scene(in, [&](const AnyPrimitive &) { ignored++; });
+
+	std::cerr << "i: " << GENERATED_PRIMITIVES << " primitives compiled in from " << GENERATED_FROM;
+	if (ignored > 0) {
+		std::cerr << ", " << ignored << " in the scene file ignored";
+	}
+	std::cerr << std::endl;
+
+	// instances are still traced through their prototype BVHs
+	TwoLevelBVH instances(scene);
+
+	Image result = render_image(scene.width, scene.height, [&](size_t x, size_t y) {
+		Ray ray = scene.generate_ray_to_pixel(x, y);
+
+		Hit best;
+		generated_closest_hit(ray, best);
+		instances.intersect_instances(ray, best);
+
+		return best.t != std::numeric_limits<float>::infinity() ? best.color : scene.bg_color;
+	});
+
+	write_image(result, out);
+	return 0;
+}
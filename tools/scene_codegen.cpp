@@ -0,0 +1,213 @@
+// Turns the root primitives of a scene into C++ for render_generated: every
+// primitive becomes a constexpr description and one call of its codegen::test,
+// grouped by kernel, and kernels without primitives are left out. Groups
+// larger than the unroll limit are emitted as constexpr arrays walked by a
+// loop instead, to keep compile times in check.
+//
+// usage: scene_codegen <scene> <output.cpp> [--unroll-limit=N]
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "scene.h"
+
+namespace {
+
+const size_t DEFAULT_UNROLL_LIMIT = 4096;
+
+// exact float literal
+std::string literal(float v) {
+	std::ostringstream out;
+	out << std::hexfloat << v << "f";
+	return out.str();
+}
+
+std::string literal(const glm::vec3 &v) {
+	return "{ " + literal(v.x) + ", " + literal(v.y) + ", " + literal(v.z) + " }";
+}
+
+// glm::quat is initialized as (w, x, y, z)
+std::string literal(const glm::quat &q) {
+	return "{ " + literal(q.w) + ", " + literal(q.x) + ", " + literal(q.y) + ", " + literal(q.z) + " }";
+}
+
+std::string escaped(const char *s) {
+	std::string result;
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			result += '\\';
+		}
+		result += *s;
+	}
+
+	return result;
+}
+
+// the constexpr descriptions of one kernel and the code that tests them
+struct Group {
+	size_t primitive_type;
+	std::string type, name;
+	std::vector<std::string> initializers;
+};
+
+struct Generator {
+	std::vector<Group> groups;
+
+	template <typename T>
+	Group &group(const std::string &type, const std::string &name) {
+		for (Group &g : groups) {
+			if (g.name == name) {
+				return g;
+			}
+		}
+
+		groups.push_back({ type_index_v<T, PrimitiveTypes>, type, name, {} });
+		return groups.back();
+	}
+
+	void add(const Plane &pr) {
+		if (pr.fast_path == FastPath::axis_plane) {
+			std::string axis = std::to_string(pr.axis);
+			group<Plane>("codegen::AxisPlane<" + axis + ">", "axis_planes_" + axis).initializers.push_back(
+				"{ " + literal(pr.position[pr.axis]) + ", " + literal(pr.color) + " }"
+			);
+		} else {
+			group<Plane>("codegen::GeneralPlane", "planes").initializers.push_back(
+				"{ " + literal(pr.position) + ", " + literal(pr.normal) + ", " + literal(pr.color) + " }"
+			);
+		}
+	}
+
+	void add(const Ellipsoid &pr) {
+		if (pr.fast_path == FastPath::sphere) {
+			group<Ellipsoid>("codegen::Sphere", "spheres").initializers.push_back(
+				"{ " + literal(pr.position) + ", " + literal(pr.axes.x) + ", " + literal(pr.color) + " }"
+			);
+		} else {
+			group<Ellipsoid>("codegen::GeneralEllipsoid", "ellipsoids").initializers.push_back(
+				"{ " + literal(pr.position) + ", " + literal(glm::conjugate(pr.rotation)) + ", "
+					+ literal(pr.axes) + ", " + literal(pr.color) + " }"
+			);
+		}
+	}
+
+	void add(const Box &pr) {
+		if (pr.fast_path == FastPath::aabb) {
+			group<Box>("codegen::Aabb", "aabbs").initializers.push_back(
+				"{ " + literal(pr.position) + ", " + literal(pr.semi_axes) + ", " + literal(pr.color) + " }"
+			);
+		} else {
+			group<Box>("codegen::GeneralBox", "boxes").initializers.push_back(
+				"{ " + literal(pr.position) + ", " + literal(glm::conjugate(pr.rotation)) + ", "
+					+ literal(pr.semi_axes) + ", " + literal(pr.color) + " }"
+			);
+		}
+	}
+
+	void write(std::ostream &out, const char *scene_path, size_t unroll_limit) const {
+		size_t total = 0;
+
+		out << "// generated by scene_codegen from " << escaped(scene_path) << ", do not edit\n\n";
+		out << "#include \"codegen.h\"\n\n";
+		out << "namespace {\n";
+
+		for (const Group &g : groups) {
+			total += g.initializers.size();
+			out << "\n";
+
+			if (g.initializers.size() > unroll_limit) {
+				out << "constexpr " << g.type << " " << g.name << "[] = {\n";
+				for (const std::string &init : g.initializers) {
+					out << "\t" << init << ",\n";
+				}
+				out << "};\n";
+			} else {
+				for (size_t i = 0; i < g.initializers.size(); i++) {
+					out << "constexpr " << g.type << " " << g.name << "_" << i << " " << g.initializers[i] << ";\n";
+				}
+			}
+		}
+
+		out << "\n}\n\n";
+		out << "void generated_closest_hit(const Ray &ray, Hit &best) {\n";
+
+		for (size_t k = 0; k < groups.size(); k++) {
+			const Group &g = groups[k];
+			out << (k > 0 ? "\n" : "");
+
+			if (g.initializers.size() > unroll_limit) {
+				out << "\tfor (const " << g.type << " &pr : " << g.name << ") {\n";
+				out << "\t\tcodegen::test(ray, best, pr);\n";
+				out << "\t}\n";
+			} else {
+				for (size_t i = 0; i < g.initializers.size(); i++) {
+					out << "\tcodegen::test(ray, best, " << g.name << "_" << i << ");\n";
+				}
+			}
+		}
+
+		out << "}\n\n";
+		out << "const char *const GENERATED_FROM = \"" << escaped(scene_path) << "\";\n";
+		out << "const size_t GENERATED_PRIMITIVES = " << total << ";\n";
+	}
+};
+
+}
+
+int main(int argc, char **argv) {
+	std::vector<const char*> files;
+	size_t unroll_limit = DEFAULT_UNROLL_LIMIT;
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strncmp(argv[i], "--unroll-limit=", 15) == 0) {
+			unroll_limit = std::strtoul(argv[i] + 15, nullptr, 10);
+		} else {
+			files.push_back(argv[i]);
+		}
+	}
+
+	if (files.size() != 2) {
+		std::cerr << "usage: " << argv[0] << " <scene> <output.cpp> [--unroll-limit=N]" << std::endl;
+		return 1;
+	}
+
+	std::ifstream in(files[0]);
+	if (!in) {
+		std::cerr << "e: cannot open " << files[0] << std::endl;
+		return 1;
+	}
+
+	Generator generator;
+	read_scene(in, [&](const AnyPrimitive &pr) {
+		std::visit([&](const auto &p) { generator.add(p); }, pr);
+	});
+
+	// types in the generic brute force's order; grouping by kernel still
+	// reorders primitives within a type, only exact ties between two of them
+	// can resolve differently than in the generic renderer
+	std::stable_sort(generator.groups.begin(), generator.groups.end(), [](const Group &a, const Group &b) {
+		return a.primitive_type < b.primitive_type;
+	});
+
+	std::ofstream out(files[1]);
+	generator.write(out, files[0], unroll_limit);
+
+	if (!out) {
+		std::cerr << "e: cannot write " << files[1] << std::endl;
+		return 1;
+	}
+
+	for (const Group &g : generator.groups) {
+		std::cerr << "i: " << g.name << ": " << g.initializers.size()
+			<< (g.initializers.size() > unroll_limit ? " (loop)" : " (unrolled)") << std::endl;
+	}
+
+	return 0;
+}
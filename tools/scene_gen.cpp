@@ -0,0 +1,418 @@
+// Writes procedural benchmark scenes in the text format of read_scene.
+//
+// usage: scene_gen <output> [options]
+//        scene_gen --corpus=<file> --out-dir=<dir> [--max-count=N]
+//
+// The second form writes every scene of a corpus file (see bench/corpus.txt)
+// that is not there yet and has at most N primitives.
+//
+// options, --case first, later options override it:
+//   --case=uniform|clustered|huge-boxes|thin-ellipsoids|inside|grazing
+//   --count=N               bounded primitives, 1 to 10^7
+//   --mix=E:B               relative weights of ellipsoids and boxes
+//   --planes=N              infinite planes, the first is the ground
+//   --size=uniform|lognormal, --min-size=S, --max-size=S
+//   --aspect=A              axes of a primitive differ by up to A times
+//   --spheres=F             fraction of ellipsoids with equal axes
+//   --rotation=F            fraction of rotated primitives, the rest stay
+//                           axis-aligned
+//   --clusters=K, --spread=S   gaussian clusters instead of a uniform cube
+//   --camera=outside|inside|grazing
+//   --width=W, --height=H, --seed=N
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+namespace {
+
+const size_t MAX_COUNT = 10000000;
+
+// average distance between primitives of the uniform cube
+const float SPACING = 2;
+
+enum class SizeDistribution { uniform, lognormal };
+enum class CameraSetup { outside, inside, grazing };
+
+struct SceneGenOptions {
+	size_t count = 1000;
+	float ellipsoid_weight = 1, box_weight = 1;
+	size_t planes = 1;
+	SizeDistribution size = SizeDistribution::uniform;
+	float min_size = 0.1f, max_size = 1;
+	float aspect = 4;
+	float spheres = 0.5f;
+	float rotation = 0.5f;
+	size_t clusters = 0;
+	float spread = 2;
+	CameraSetup camera = CameraSetup::outside;
+	size_t width = 320, height = 240;
+	unsigned seed = 1;
+
+	// sizes given relative to the scene extent, for the huge-boxes case
+	bool relative_size = false;
+};
+
+// half the side of the cube the primitives are spread in
+float extent(const SceneGenOptions &opt) {
+	return std::max(2.f, SPACING * std::cbrt((float)opt.count) / 2);
+}
+
+bool apply_case(SceneGenOptions &opt, const char *name) {
+	if (std::strcmp(name, "uniform") == 0) {
+		return true;
+	}
+
+	if (std::strcmp(name, "clustered") == 0) {
+		opt.clusters = std::max<size_t>(1, opt.count / 1000);
+	} else if (std::strcmp(name, "huge-boxes") == 0) {
+		opt.ellipsoid_weight = 0;
+		opt.relative_size = true;
+		opt.min_size = 0.2f; opt.max_size = 1;
+		opt.rotation = 0;
+	} else if (std::strcmp(name, "thin-ellipsoids") == 0) {
+		opt.box_weight = 0;
+		opt.aspect = 50;
+		opt.spheres = 0;
+		opt.rotation = 1;
+		opt.min_size = 0.5f; opt.max_size = 3;
+	} else if (std::strcmp(name, "inside") == 0) {
+		opt.camera = CameraSetup::inside;
+	} else if (std::strcmp(name, "grazing") == 0) {
+		opt.camera = CameraSetup::grazing;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+bool parse_option(SceneGenOptions &opt, const char *arg) {
+	auto value = [&](const char *key) -> const char* {
+		size_t n = std::strlen(key);
+		return std::strncmp(arg, key, n) == 0 ? arg + n : nullptr;
+	};
+
+	if (const char *v = value("--case=")) {
+		return apply_case(opt, v);
+	} else if (const char *v = value("--count=")) {
+		opt.count = std::strtoull(v, nullptr, 10);
+		return opt.count >= 1 && opt.count <= MAX_COUNT;
+	} else if (const char *v = value("--mix=")) {
+		return std::sscanf(v, "%f:%f", &opt.ellipsoid_weight, &opt.box_weight) == 2
+			&& opt.ellipsoid_weight >= 0 && opt.box_weight >= 0 && opt.ellipsoid_weight + opt.box_weight > 0;
+	} else if (const char *v = value("--planes=")) {
+		opt.planes = std::strtoull(v, nullptr, 10);
+	} else if (const char *v = value("--size=")) {
+		if (std::strcmp(v, "uniform") == 0) {
+			opt.size = SizeDistribution::uniform;
+		} else if (std::strcmp(v, "lognormal") == 0) {
+			opt.size = SizeDistribution::lognormal;
+		} else {
+			return false;
+		}
+	} else if (const char *v = value("--min-size=")) {
+		opt.min_size = std::strtof(v, nullptr);
+	} else if (const char *v = value("--max-size=")) {
+		opt.max_size = std::strtof(v, nullptr);
+	} else if (const char *v = value("--aspect=")) {
+		opt.aspect = std::max(1.f, std::strtof(v, nullptr));
+	} else if (const char *v = value("--spheres=")) {
+		opt.spheres = std::strtof(v, nullptr);
+	} else if (const char *v = value("--rotation=")) {
+		opt.rotation = std::strtof(v, nullptr);
+	} else if (const char *v = value("--clusters=")) {
+		opt.clusters = std::strtoull(v, nullptr, 10);
+	} else if (const char *v = value("--spread=")) {
+		opt.spread = std::strtof(v, nullptr);
+	} else if (const char *v = value("--camera=")) {
+		if (std::strcmp(v, "outside") == 0) {
+			opt.camera = CameraSetup::outside;
+		} else if (std::strcmp(v, "inside") == 0) {
+			opt.camera = CameraSetup::inside;
+		} else if (std::strcmp(v, "grazing") == 0) {
+			opt.camera = CameraSetup::grazing;
+		} else {
+			return false;
+		}
+	} else if (const char *v = value("--width=")) {
+		opt.width = std::strtoull(v, nullptr, 10);
+	} else if (const char *v = value("--height=")) {
+		opt.height = std::strtoull(v, nullptr, 10);
+	} else if (const char *v = value("--seed=")) {
+		opt.seed = std::strtoul(v, nullptr, 10);
+	} else {
+		return false;
+	}
+
+	return opt.min_size > 0 && opt.min_size <= opt.max_size;
+}
+
+// --case is applied before the other options whatever their order, and
+// --count before --case, which scales with it
+bool parse_options(SceneGenOptions &opt, const std::vector<const char*> &args) {
+	for (const char *arg : args) {
+		if (std::strncmp(arg, "--count=", 8) == 0 && !parse_option(opt, arg)) {
+			return false;
+		}
+	}
+
+	for (const char *arg : args) {
+		if (std::strncmp(arg, "--case=", 7) == 0 && !parse_option(opt, arg)) {
+			return false;
+		}
+	}
+
+	for (const char *arg : args) {
+		if (std::strncmp(arg, "--case=", 7) != 0 && !parse_option(opt, arg)) {
+			std::cerr << "e: bad option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// generation
+
+struct Generator {
+	const SceneGenOptions &opt;
+	std::mt19937_64 rng;
+	float half;
+	std::vector<glm::vec3> cluster_centers;
+
+	explicit Generator(const SceneGenOptions &_opt) : opt(_opt), rng(_opt.seed), half(extent(_opt)) {
+		for (size_t i = 0; i < opt.clusters; i++) {
+			cluster_centers.push_back(glm::vec3(uniform(-half, half), uniform(-half, half), uniform(-half, half)));
+		}
+	}
+
+	float uniform(float lo, float hi) {
+		return std::uniform_real_distribution<float>(lo, hi)(rng);
+	}
+
+	float gaussian() {
+		return std::normal_distribution<float>()(rng);
+	}
+
+	glm::vec3 position() {
+		if (cluster_centers.empty()) {
+			return glm::vec3(uniform(-half, half), uniform(-half, half), uniform(-half, half));
+		}
+
+		glm::vec3 center = cluster_centers[rng() % cluster_centers.size()];
+		return center + glm::vec3(gaussian(), gaussian(), gaussian()) * opt.spread;
+	}
+
+	// lognormal sizes have their median in the middle of the range (in log
+	// space) and 95% of them inside it
+	float size() {
+		float scale = opt.relative_size ? half : 1;
+		float lo = opt.min_size * scale, hi = opt.max_size * scale;
+
+		if (opt.size == SizeDistribution::uniform) {
+			return uniform(lo, hi);
+		}
+
+		float mu = (std::log(lo) + std::log(hi)) / 2, sigma = (std::log(hi) - std::log(lo)) / 4;
+		return std::exp(mu + sigma * gaussian());
+	}
+
+	glm::vec3 axes(bool equal) {
+		float s = size();
+		if (equal) {
+			return glm::vec3(s);
+		}
+
+		return glm::vec3(s, s / uniform(1, opt.aspect), s / uniform(1, opt.aspect));
+	}
+
+	glm::quat rotation() {
+		glm::quat q(gaussian(), gaussian(), gaussian(), gaussian());
+		return glm::normalize(q);
+	}
+
+	void write_camera(std::ostream &out) {
+		glm::vec3 position(0.f, 0.4f * half, -2.5f * half), target(0.f);
+		switch (opt.camera) {
+		case CameraSetup::outside:
+			break;
+		case CameraSetup::inside:
+			position = glm::vec3(0.f);
+			target = glm::vec3(0.f, 0.f, 1.f);
+			break;
+		case CameraSetup::grazing:
+			// just above the ground, looking along it
+			position = glm::vec3(0.f, -half + 0.05f, -half);
+			target = glm::vec3(0.f, -half, half);
+			break;
+		}
+
+		glm::vec3 forward = glm::normalize(target - position);
+		glm::vec3 right = glm::normalize(glm::cross(glm::vec3(0.f, 1.f, 0.f), forward));
+		glm::vec3 up = glm::cross(forward, right);
+
+		out << "DIMENSIONS " << opt.width << " " << opt.height << "\n";
+		out << "BG_COLOR 0.1 0.2 0.3\n";
+		out << "CAMERA_POSITION " << position.x << " " << position.y << " " << position.z << "\n";
+		out << "CAMERA_RIGHT " << right.x << " " << right.y << " " << right.z << "\n";
+		out << "CAMERA_UP " << up.x << " " << up.y << " " << up.z << "\n";
+		out << "CAMERA_FORWARD " << forward.x << " " << forward.y << " " << forward.z << "\n";
+		out << "CAMERA_FOV_X 1.2\n";
+	}
+
+	void write_placement(std::ostream &out, const glm::vec3 &p, bool rotated) {
+		out << "POSITION " << p.x << " " << p.y << " " << p.z << "\n";
+		if (rotated) {
+			glm::quat q = rotation();
+			out << "ROTATION " << q.x << " " << q.y << " " << q.z << " " << q.w << "\n";
+		}
+		out << "COLOR " << uniform(0, 1) << " " << uniform(0, 1) << " " << uniform(0, 1) << "\n";
+	}
+
+	void write(std::ostream &out) {
+		write_camera(out);
+
+		for (size_t i = 0; i < opt.planes; i++) {
+			glm::vec3 normal(0.f, 1.f, 0.f);
+			if (i > 0) {
+				normal = glm::normalize(glm::vec3(gaussian(), gaussian(), gaussian()));
+			}
+
+			out << "NEW_PRIMITIVE\nPLANE " << normal.x << " " << normal.y << " " << normal.z << "\n";
+			write_placement(out, i == 0 ? glm::vec3(0.f, -half, 0.f) : normal * -2.f * half, false);
+		}
+
+		float box_share = opt.box_weight / (opt.ellipsoid_weight + opt.box_weight);
+		for (size_t i = 0; i < opt.count; i++) {
+			bool box = uniform(0, 1) < box_share;
+			bool rotated = uniform(0, 1) < opt.rotation;
+
+			out << "NEW_PRIMITIVE\n";
+			if (box) {
+				glm::vec3 a = axes(false);
+				out << "BOX " << a.x << " " << a.y << " " << a.z << "\n";
+			} else {
+				glm::vec3 a = axes(uniform(0, 1) < opt.spheres);
+				out << "ELLIPSOID " << a.x << " " << a.y << " " << a.z << "\n";
+			}
+
+			write_placement(out, position(), rotated);
+		}
+	}
+};
+
+bool generate(const SceneGenOptions &opt, const std::string &path) {
+	std::ofstream out(path);
+	if (!out) {
+		std::cerr << "e: cannot write " << path << std::endl;
+		return false;
+	}
+
+	Generator(opt).write(out);
+	return bool(out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// corpus
+
+// lines of "<name> <options>", # starts a comment
+int generate_corpus(const char *corpus_path, const std::string &out_dir, size_t max_count) {
+	std::ifstream corpus(corpus_path);
+	if (!corpus) {
+		std::cerr << "e: cannot open " << corpus_path << std::endl;
+		return 1;
+	}
+
+	std::string line;
+	while (std::getline(corpus, line)) {
+		line = line.substr(0, line.find('#'));
+
+		std::istringstream words(line);
+		std::string name, word;
+		std::vector<std::string> args;
+		if (!(words >> name)) {
+			continue;
+		}
+		while (words >> word) {
+			args.push_back(word);
+		}
+
+		std::vector<const char*> argv;
+		for (const std::string &a : args) {
+			argv.push_back(a.c_str());
+		}
+
+		SceneGenOptions opt;
+		if (!parse_options(opt, argv)) {
+			std::cerr << "e: bad corpus entry " << name << std::endl;
+			return 1;
+		}
+
+		std::string path = out_dir + "/" + name + ".txt";
+		if (opt.count > max_count) {
+			std::cerr << "i: " << name << ": " << opt.count << " primitives, skipped" << std::endl;
+			continue;
+		}
+
+		if (std::ifstream(path)) {
+			std::cerr << "i: " << name << ": exists" << std::endl;
+			continue;
+		}
+
+		// written under a temporary name, so that an interrupted run does not
+		// leave a truncated scene behind
+		if (!generate(opt, path + ".tmp") || std::rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+			return 1;
+		}
+		std::cerr << "i: " << name << ": " << opt.count << " primitives written" << std::endl;
+	}
+
+	return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+	const char *corpus = nullptr;
+	std::string out_dir = ".";
+	size_t max_count = MAX_COUNT;
+	std::vector<const char*> files, args;
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strncmp(argv[i], "--corpus=", 9) == 0) {
+			corpus = argv[i] + 9;
+		} else if (std::strncmp(argv[i], "--out-dir=", 10) == 0) {
+			out_dir = argv[i] + 10;
+		} else if (std::strncmp(argv[i], "--max-count=", 12) == 0) {
+			max_count = std::strtoull(argv[i] + 12, nullptr, 10);
+		} else if (std::strncmp(argv[i], "--", 2) == 0) {
+			args.push_back(argv[i]);
+		} else {
+			files.push_back(argv[i]);
+		}
+	}
+
+	if (corpus) {
+		return generate_corpus(corpus, out_dir, max_count);
+	}
+
+	SceneGenOptions opt;
+	if (files.size() != 1 || !parse_options(opt, args)) {
+		std::cerr << "usage: " << argv[0] << " <output> [--case=...] [--count=N] [options], see the source" << std::endl;
+		return 1;
+	}
+
+	return generate(opt, files[0]) ? 0 : 1;
+}